@@ -0,0 +1,15 @@
+(* Parallel workers of Mysql: threads, before OCaml 5. They run OCaml code
+   one at a time, but the calls to the client library overlap. *)
+
+type 'a t = Thread.t * ('a, exn) result option ref
+
+let spawn f =
+  let r = ref None in
+  Thread.create (fun () -> r := Some (match f () with x -> Ok x | exception exn -> Error exn)) (), r
+
+let join (thread, r) =
+  Thread.join thread;
+  match !r with
+  | Some (Ok x) -> x
+  | Some (Error exn) -> raise exn
+  | None -> assert false
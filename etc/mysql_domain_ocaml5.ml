@@ -0,0 +1,6 @@
+(* Parallel workers of Mysql: domains, on OCaml 5 *)
+
+type 'a t = 'a Domain.t
+
+let spawn = Domain.spawn
+let join = Domain.join
@@ -0,0 +1,259 @@
+(**
+  Stand-in MySQL server replaying recorded sessions, for benchmarks and tests
+  of the bindings without the variance of a real server.
+
+  Record the sessions of a client through a proxy to a real server:
+
+    fakeserver record -listen 3307 -server 127.0.0.1:3306 -o session.cap
+
+  then replay them, with optional artificial latency and bandwidth:
+
+    fakeserver replay -listen 3307 -i session.cap -latency 20 -bandwidth 1000000
+
+  While recording TLS and compression are hidden from the client, and
+  [caching_sha2_password] accounts need a cached login (or use
+  [mysql_native_password]). On replay the handshake of the first recorded
+  session is played to every client, then each command (COM_QUERY,
+  COM_STMT_PREPARE, COM_STMT_EXECUTE...) gets the response recorded for the
+  identical packet, cycling through the responses when it was recorded several
+  times. Unknown commands get an error packet.
+
+  Capture file: "OCMYCAP1" then records of
+    u8 direction ('c' client to server, 's' server to client)
+    u32 BE connection number
+    u32 BE length, followed by the packet (header included)
+*)
+
+open Printf
+
+let magic = "OCMYCAP1"
+
+(* packets *)
+
+let read_packet ic =
+  let header = really_input_string ic 4 in
+  let len = Char.code header.[0] lor (Char.code header.[1] lsl 8) lor (Char.code header.[2] lsl 16) in
+  header ^ really_input_string ic len
+
+let seq packet = Char.code packet.[3]
+
+let payload packet = String.sub packet 4 (String.length packet - 4)
+
+let make_packet seq payload =
+  let len = String.length payload in
+  let b = Bytes.create (4 + len) in
+  Bytes.set b 0 (Char.chr (len land 0xff));
+  Bytes.set b 1 (Char.chr ((len lsr 8) land 0xff));
+  Bytes.set b 2 (Char.chr ((len lsr 16) land 0xff));
+  Bytes.set b 3 (Char.chr (seq land 0xff));
+  Bytes.blit_string payload 0 b 4 len;
+  Bytes.unsafe_to_string b
+
+let error_packet seq msg =
+  (* ERR, code 1105 (unknown error), SQL state HY000 *)
+  make_packet seq ("\xff\x51\x04#HY000" ^ msg)
+
+let client_ssl = 0x0800
+let client_compress = 0x0020
+
+(* clears the TLS and compression capabilities of the server greeting *)
+let hide_capabilities packet =
+  let b = Bytes.of_string packet in
+  if Bytes.length b > 5 && Bytes.get b 4 = '\x0a' then begin
+    let version_end = Bytes.index_from b 5 '\000' in
+    let pos = version_end + 1 + 4 + 8 + 1 in
+    if pos + 1 < Bytes.length b then begin
+      let caps = Bytes.get_uint16_le b pos in
+      Bytes.set_uint16_le b pos (caps land lnot (client_ssl lor client_compress))
+    end
+  end;
+  Bytes.unsafe_to_string b
+
+(* capture file *)
+
+let write_record oc lock dir conn packet =
+  Mutex.lock lock;
+  output_char oc dir;
+  output_binary_int oc conn;
+  output_binary_int oc (String.length packet);
+  output_string oc packet;
+  flush oc;
+  Mutex.unlock lock
+
+let read_records file =
+  let ic = open_in_bin file in
+  if really_input_string ic (String.length magic) <> magic then failwith (file ^ ": not a capture file");
+  let rec loop acc =
+    match input_char ic with
+    | exception End_of_file -> close_in ic; List.rev acc
+    | dir ->
+      let conn = input_binary_int ic in
+      let len = input_binary_int ic in
+      loop ((dir, conn, really_input_string ic len) :: acc)
+  in
+  loop []
+
+(* record *)
+
+let connect_to addr =
+  let host, port = match String.rindex_opt addr ':' with
+  | Some i -> String.sub addr 0 i, int_of_string (String.sub addr (i + 1) (String.length addr - i - 1))
+  | None -> addr, 3306
+  in
+  let inet = (Unix.gethostbyname host).Unix.h_addr_list.(0) in
+  let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.connect sock (Unix.ADDR_INET (inet, port));
+  sock
+
+let serve port f =
+  let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.setsockopt sock Unix.SO_REUSEADDR true;
+  Unix.bind sock (Unix.ADDR_INET (Unix.inet_addr_loopback, port));
+  Unix.listen sock 64;
+  let conn = ref 0 in
+  while true do
+    let client, _ = Unix.accept sock in
+    incr conn;
+    ignore (Thread.create (fun n ->
+      (try f n client with End_of_file | Sys_error _ | Unix.Unix_error _ -> ());
+      (try Unix.close client with Unix.Unix_error _ -> ())) !conn)
+  done
+
+let record ~port ~server ~file =
+  let capture = open_out_bin file in
+  output_string capture magic;
+  flush capture;
+  let lock = Mutex.create () in
+  serve port (fun conn client ->
+    let upstream = connect_to server in
+    let cin = Unix.in_channel_of_descr client and cout = Unix.out_channel_of_descr client in
+    let sin = Unix.in_channel_of_descr upstream and sout = Unix.out_channel_of_descr upstream in
+    let pump ic oc dir transform =
+      try
+        while true do
+          let packet = transform (read_packet ic) in
+          write_record capture lock dir conn packet;
+          output_string oc packet;
+          flush oc
+        done
+      with End_of_file | Sys_error _ | Unix.Unix_error _ -> ()
+    in
+    let first = ref true in
+    let greeting packet = if !first then (first := false; hide_capabilities packet) else packet in
+    let t = Thread.create (fun () -> pump sin cout 's' greeting; Unix.shutdown client Unix.SHUTDOWN_ALL) () in
+    pump cin sout 'c' (fun p -> p);
+    (try Unix.shutdown upstream Unix.SHUTDOWN_ALL with Unix.Unix_error _ -> ());
+    Thread.join t;
+    Unix.close upstream)
+
+(* replay *)
+
+type exchange = { request : string; responses : string list }
+
+(* splits the records of one connection in its handshake (packets before
+   the first command) and the exchanges of the command phase *)
+let split_session records =
+  let rec handshake acc = function
+    | ('c', p) :: _ as rest when seq p = 0 -> List.rev acc, rest
+    | r :: rest -> handshake (r :: acc) rest
+    | [] -> List.rev acc, []
+  in
+  let rec exchanges acc = function
+    | ('c', request) :: rest ->
+      let rec responses r = function
+        | ('s', p) :: rest -> responses (p :: r) rest
+        | rest -> List.rev r, rest
+      in
+      let r, rest = responses [] rest in
+      exchanges ({ request = payload request; responses = r } :: acc) rest
+    | _ :: rest -> exchanges acc rest
+    | [] -> List.rev acc
+  in
+  let h, rest = handshake [] records in
+  h, exchanges [] rest
+
+let replay ~port ~file ~latency ~bandwidth =
+  let records = read_records file in
+  let sessions = Hashtbl.create 16 in
+  List.iter (fun (dir, conn, p) ->
+    let l = try Hashtbl.find sessions conn with Not_found -> [] in
+    Hashtbl.replace sessions conn ((dir, p) :: l)) records;
+  let conns = List.sort compare (Hashtbl.fold (fun k _ acc -> k :: acc) sessions []) in
+  if conns = [] then failwith (file ^ ": no session");
+  let table = Hashtbl.create 1024 in
+  let handshake = ref [] in
+  List.iteri (fun i conn ->
+    let h, exchanges = split_session (List.rev (Hashtbl.find sessions conn)) in
+    if i = 0 then handshake := h;
+    List.iter (fun e ->
+      let l = try Hashtbl.find table e.request with Not_found -> [] in
+      Hashtbl.replace table e.request (e.responses :: l)) exchanges) conns;
+  let table =
+    let t = Hashtbl.create (Hashtbl.length table) in
+    Hashtbl.iter (fun k l -> Hashtbl.replace t k (Array.of_list (List.rev l), ref 0)) table;
+    t
+  in
+  let lock = Mutex.create () in
+  let next_response request =
+    Mutex.lock lock;
+    let r = match Hashtbl.find_opt table request with
+    | None -> None
+    | Some (responses, cursor) ->
+      let r = responses.(!cursor mod Array.length responses) in
+      incr cursor;
+      Some r
+    in
+    Mutex.unlock lock;
+    r
+  in
+  let send oc packets =
+    if latency > 0. then Thread.delay latency;
+    let bytes = List.fold_left (fun n p -> n + String.length p) 0 packets in
+    List.iter (output_string oc) packets;
+    flush oc;
+    if bandwidth > 0. then Thread.delay (float bytes /. bandwidth)
+  in
+  printf "replaying %d sessions, %d distinct commands\n%!" (List.length conns) (Hashtbl.length table);
+  serve port (fun _ client ->
+    let ic = Unix.in_channel_of_descr client and oc = Unix.out_channel_of_descr client in
+    let rec play pending = function
+      | ('s', p) :: rest -> play (p :: pending) rest
+      | ('c', _) :: rest ->
+        if pending <> [] then send oc (List.rev pending);
+        ignore (read_packet ic);
+        play [] rest
+      | _ :: rest -> play pending rest
+      | [] -> if pending <> [] then send oc (List.rev pending)
+    in
+    play [] !handshake;
+    let rec loop () =
+      let request = payload (read_packet ic) in
+      if request <> "" && request.[0] = '\x01' then () (* COM_QUIT *) else begin
+        (match next_response request with
+         | Some [] -> ()
+         | Some packets -> send oc packets
+         | None -> send oc [error_packet 1 "fakeserver: no recorded response"]);
+        loop ()
+      end
+    in
+    loop ())
+
+let () =
+  let mode = ref "" and port = ref 3307 and server = ref "127.0.0.1:3306" and file = ref "" in
+  let latency = ref 0. and bandwidth = ref 0. in
+  let spec = [
+    "-listen", Arg.Set_int port, "<port> port to listen on, on the loopback interface (default 3307)";
+    "-server", Arg.Set_string server, "<host:port> server to record (default 127.0.0.1:3306)";
+    "-o", Arg.Set_string file, "<file> capture file to write";
+    "-i", Arg.Set_string file, "<file> capture file to replay";
+    "-latency", Arg.Int (fun ms -> latency := float ms /. 1000.), "<ms> delay before each response";
+    "-bandwidth", Arg.Set_float bandwidth, "<bytes/s> throughput of the responses";
+  ] in
+  let usage = "fakeserver (record|replay) [options]" in
+  Arg.parse spec (fun s -> mode := s) usage;
+  if !file = "" then (Arg.usage spec usage; exit 2);
+  Sys.set_signal Sys.sigpipe Sys.Signal_ignore;
+  match !mode with
+  | "record" -> record ~port:!port ~server:!server ~file:!file
+  | "replay" -> replay ~port:!port ~file:!file ~latency:!latency ~bandwidth:!bandwidth
+  | _ -> Arg.usage spec usage; exit 2
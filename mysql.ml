@@ -18,12 +18,9 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
 *)
 
-module Map = MoreLabels.Map
 module String = StdLabels.String
 module Array = StdLabels.Array
 
-module StrMap = Map.Make(struct type t = string let compare = compare end)
-
 exception Error of string
 
 let _ = Callback.register_exception "mysql error" (Error "Registering Callback")
@@ -32,10 +29,17 @@ let _ = Callback.register_exception "mysql error" (Error "Registering Callback")
 let fail  msg   = raise (Failure msg)
 
 type dbd        (* database connection handle *)
-type result     (* handle to access result from query *)
+type result_handle (* handle to access result from query *)
 
 external init : unit -> unit = "db_library_init"
 
+(* once, before any thread or domain can call escape: libmariadb crashes without it *)
+let () = init ()
+
+(* needed to unmarshal results *)
+external register_ops : unit -> unit = "db_register_ops"
+let () = register_ops ()
+
 (* Do not change any type definition that is used by external functions 
    without changing the C source code accordingly! *)
 
@@ -305,6 +309,18 @@ type field = { name : string; (* Name of the field *)
                decimals : int (* Number of decimals for numeric fields *)
              } 
 
+(* columns description of a result, computed once per result *)
+type meta = { col_names : string array;
+              col_types : dbty array;
+              col_flags : int array;
+              col_index : (string, int) Hashtbl.t; (* maps names to positions *)
+            }
+
+type result = { handle : result_handle;
+                mutable meta : meta option; (* cache for [metadata] *)
+                mutable intern : string array array; (* see [intern] *)
+              }
+
 
 
 (* low level C interface *)
@@ -318,6 +334,8 @@ type protocol =
 | PROTOCOL_PIPE
 | PROTOCOL_MEMORY
 
+type tls_session = string (* session data from the client library *)
+
 type db_option =
 | OPT_COMPRESS
 | OPT_NAMED_PIPE
@@ -337,6 +355,15 @@ type db_option =
 | SET_CHARSET_NAME of string
 | SHARED_MEMORY_BASE_NAME of string
 | OPT_FOUND_ROWS
+| OPT_SSL_CA of string
+| OPT_SSL_CAPATH of string
+| OPT_SSL_CERT of string
+| OPT_SSL_KEY of string
+| OPT_SSL_CIPHER of string
+| OPT_TLS_VERSION of string
+| OPT_SSL_SESSION of tls_session
+| OPT_COMPRESSION_ALGORITHMS of string
+| OPT_ZSTD_COMPRESSION_LEVEL of int
 
 external connect    : db_option list -> db -> dbd                             = "db_connect"
 
@@ -354,17 +381,50 @@ external select_db   : dbd -> string -> unit                = "db_select_db"
 external list_dbs    : dbd -> ?pat:string -> unit -> string array option = "db_list_dbs"
 external disconnect : dbd -> unit                           = "db_disconnect"
 external ping       : dbd -> unit                           = "db_ping"
-external exec       : dbd -> string -> result               = "db_exec"
+
+external tls_session : dbd -> tls_session option = "db_tls_session"
+external tls_session_reused : dbd -> bool = "db_tls_session_reused"
+external connect_many_raw : db_option list -> db -> int -> dbd array = "db_connect_many"
+
+let connect_many ?(options=[]) db n =
+  let tls = List.exists (function
+    | OPT_SSL_CA _ | OPT_SSL_CAPATH _ | OPT_SSL_CERT _ | OPT_SSL_KEY _ | OPT_SSL_CIPHER _
+    | OPT_TLS_VERSION _ -> true
+    | _ -> false) options
+  and resumed = List.exists (function OPT_SSL_SESSION _ -> true | _ -> false) options in
+  if n <= 1 || not tls || resumed then connect_many_raw options db n else
+  let first = connect ~options db in
+  let options = match tls_session first with
+  | Some s -> OPT_SSL_SESSION s :: options
+  | None -> options
+  in
+  match connect_many_raw options db (n - 1) with
+  | rest -> Array.append [| first |] rest
+  | exception exn -> disconnect first; raise exn
+
+external db_exec    : dbd -> string -> result               = "db_exec"
+external exec_timeout : dbd -> string -> float -> result    = "db_exec_timeout"
+(* [Some t] for a deadline of [t] seconds, no deadline for [0.] *)
+let check_timeout fn = function
+  | Some t when Float.is_nan t || t < 0. -> invalid_arg (fn ^ ": timeout")
+  | Some t when t > 0. -> Some t
+  | _ -> None
+
+let exec ?timeout dbd sql =
+  match check_timeout "Mysql.exec" timeout with
+  | None -> db_exec dbd sql
+  | Some timeout -> exec_timeout dbd sql timeout
+external db_exec_spill : dbd -> string -> string -> result  = "db_exec_spill"
+let exec_spill ?(dir=Filename.get_temp_dir_name ()) dbd sql = db_exec_spill dbd sql dir
+external free       : result -> unit                        = "db_free"
 external real_status     : dbd -> int                         = "db_status"
 external errmsg     : dbd -> string option                  = "db_errmsg"
-external db_escape  : string -> string                      = "db_escape"
-let escape s =
-  init (); (* libmariadb crashes without init *)
-  db_escape s
+external escape     : string -> string                      = "db_escape"
 external real_escape: dbd -> string -> string               = "db_real_escape"
 external set_charset: dbd -> string -> unit                 = "db_set_charset"
 external fetch      : result -> string option array option  = "db_fetch" 
 external to_row     : result -> int64 -> unit                 = "db_to_row"
+external get_row    : result -> int64 -> string option array  = "db_get_row"
 external size       : result -> int64                         = "db_size"
 external affected    : dbd -> int64                           = "db_affected"
 external insert_id: dbd -> int64 = "db_insert_id"
@@ -386,6 +446,65 @@ let status dbd =
 
 let errno dbd = error_of_int (real_status dbd)
 
+let quote_ident s = "`" ^ String.concat ~sep:"``" (String.split_on_char ~sep:'`' s) ^ "`"
+
+(* [db.table] or [table] *)
+let quote_table s = String.concat ~sep:"." (List.map quote_ident (String.split_on_char ~sep:'.' s))
+
+(* transactions *)
+
+external query : dbd -> string -> unit = "db_query"
+external autocommit : dbd -> bool -> unit = "db_autocommit"
+external commit : dbd -> unit = "db_commit"
+external rollback : dbd -> unit = "db_rollback"
+external in_transaction : dbd -> bool = "db_in_transaction"
+
+type isolation = Read_uncommitted | Read_committed | Repeatable_read | Serializable
+
+let string_of_isolation = function
+  | Read_uncommitted -> "READ UNCOMMITTED"
+  | Read_committed -> "READ COMMITTED"
+  | Repeatable_read -> "REPEATABLE READ"
+  | Serializable -> "SERIALIZABLE"
+
+let er_lock_deadlock = 1213
+
+let savepoint dbd name = query dbd ("SAVEPOINT " ^ quote_ident name)
+let rollback_to dbd name = query dbd ("ROLLBACK TO SAVEPOINT " ^ quote_ident name)
+let release_savepoint dbd name = query dbd ("RELEASE SAVEPOINT " ^ quote_ident name)
+
+let with_savepoint dbd name f =
+  savepoint dbd name;
+  match f () with
+  | x -> release_savepoint dbd name; x
+  | exception (Error _ as exn) when real_status dbd = er_lock_deadlock ->
+    (* the server rolled back the whole transaction and the savepoint with it,
+       keep the error code for with_transaction to retry *)
+    raise exn
+  | exception exn -> (try rollback_to dbd name with Error _ -> ()); raise exn
+
+let with_transaction ?isolation ?(read_only=false) ?(retries=3) dbd f =
+  (* a nested call would commit the outer transaction and leave the rest
+     of it in autocommit *)
+  if in_transaction dbd then invalid_arg "Mysql.with_transaction: transaction already open";
+  let rec attempt n =
+    Option.iter (fun i -> query dbd ("SET TRANSACTION ISOLATION LEVEL " ^ string_of_isolation i)) isolation;
+    autocommit dbd false;
+    match
+      if read_only then query dbd "START TRANSACTION READ ONLY";
+      let x = f dbd in
+      commit dbd;
+      x
+    with
+    | x -> autocommit dbd true; x
+    | exception exn ->
+      let deadlock = (match exn with Error _ -> real_status dbd = er_lock_deadlock | _ -> false) in
+      (try rollback dbd with Error _ -> ());
+      (try autocommit dbd true with Error _ -> ());
+      if deadlock && n < retries then attempt (n + 1) else raise exn
+  in
+  attempt 0
+
 (* [sub start len str] returns integer obtained from substring of length 
    [len] from [str] *)
 
@@ -488,17 +607,50 @@ let not_null f arg = match arg with
     | Some x    -> f x 
 
 
-let names result =
-  Array.init (fields result) ~f:(function offset ->
-    match fetch_field_dir result offset with
-    | Some field -> field.name
-    | None -> "")
+external raw_metadata : result -> string array * dbty array * int array = "db_metadata"
+
+let make_meta (names, types, flags) =
+  let index = Hashtbl.create (Array.length names) in
+  Array.iteri names ~f:(fun i name -> Hashtbl.replace index name i);
+  { col_names = names; col_types = types; col_flags = flags; col_index = index }
+
+let metadata result =
+  match result.meta with
+  | Some meta -> meta
+  | None ->
+    let meta = make_meta (raw_metadata result) in
+    result.meta <- Some meta;
+    meta
+
+let column_index meta name = Hashtbl.find meta.col_index name
+
+(* Intern tables, one per column, are handled by the C stubs as open
+   addressing hash tables where "" marks a free slot. Columns which are
+   not interned get an empty table. *)
 
-let types result =
-  Array.init (fields result) ~f:(function offset ->
-    match fetch_field_dir result offset with
-    | Some field -> field.ty
-    | None -> (fail "Unknown type in field"))
+let intern_slots = 256
+
+let enum_flag = 256
+let set_flag = 2048
+
+let intern_tables meta columns =
+  let columns = match columns with
+  | Some columns -> columns
+  | None ->
+    let l = ref [] in
+    Array.iteri meta.col_types ~f:(fun i ty ->
+      if ty = EnumTy || ty = SetTy || meta.col_flags.(i) land (enum_flag lor set_flag) <> 0 then
+        l := i :: !l);
+    !l
+  in
+  Array.init (Array.length meta.col_names) ~f:(fun i ->
+    if List.mem i columns then Array.make intern_slots "" else [||])
+
+let intern ?columns result = result.intern <- intern_tables (metadata result) columns
+
+let names result = Array.copy (metadata result).col_names
+
+let types result = Array.copy (metadata result).col_types
 
 (* [column result] returns a function [col] which fetches columns from
    results by column name.  [col] has type string -> 'a array -> 'b. 
@@ -516,19 +668,10 @@ let types result =
 *)
 
 let column result =
-    let names = names result                                    in
-    let map   = (* maps names to positions *)
-        match Array.length names with
-        | 0 -> StrMap.empty
-        | n -> let rec loop i map =
-                 if   i = n 
-                 then map
-                 else loop (i+1) (StrMap.add ~key:names.(i) ~data:i map)
-               in
-                 loop 0 StrMap.empty                            in
+    let meta = metadata result                                  in
      (* return column name from array and apply f *)
      let col ~key ~row =
-       row.(StrMap.find key map)
+       row.(column_index meta key)
      in
      col
 
@@ -632,19 +775,1437 @@ let map_cols res ~key ~f =
   let col = column res in
   map res ~f:(function row -> f (Array.map key ~f:(function key -> col ~key ~row)))
 
+type compression = {
+  algorithm : string option;
+  level : int option;
+  bytes_sent : int64;
+  bytes_received : int64;
+}
+
+let compression dbd =
+  let r = exec dbd "SHOW SESSION STATUS WHERE Variable_name IN \
+    ('Compression','Compression_algorithm','Compression_level','Bytes_sent','Bytes_received')" in
+  let status = Hashtbl.create 5 in
+  iter r ~f:(function
+    | [| Some name; Some v |] -> Hashtbl.replace status name v
+    | _ -> ());
+  let find name = Hashtbl.find_opt status name in
+  let counter name = Option.fold (find name) ~none:0L ~some:Int64.of_string in
+  let algorithm = match find "Compression", find "Compression_algorithm" with
+  | Some "ON", (None | Some "") -> Some "zlib"
+  | Some "ON", Some a -> Some a
+  | _ -> None
+  in
+  { algorithm;
+    level = Option.bind (find "Compression_level") int_of_string_opt;
+    (* counted by the server, so in the other direction *)
+    bytes_sent = counter "Bytes_received";
+    bytes_received = counter "Bytes_sent" }
+
+type export_format = Csv | Tsv | Json
+
+external channel_descriptor : out_channel -> int = "caml_channel_descriptor"
+external export_fd : result -> export_format -> bool -> int -> int64 = "db_export"
+
+let export ?(header=true) result format oc =
+  flush oc;
+  export_fd result format header (channel_descriptor oc)
+
+external build_index : result -> unit = "db_build_index"
+external decode_row : result -> int64 -> string option array = "db_decode_row"
+
+(* rows are split in [domains] consecutive chunks, the first one is
+   handled by the calling domain *)
+let parallel_map result ~domains ~f =
+  if domains < 1 then invalid_arg "Mysql.parallel_map: domains";
+  let n = Int64.to_int (size result) in
+  build_index result;
+  let domains = min domains (max n 1) in
+  let chunk k =
+    let lo = n * k / domains and hi = n * (k + 1) / domains in
+    Array.init (hi - lo) ~f:(fun i -> f (decode_row result (Int64.of_int (lo + i))))
+  in
+  let spawned = List.init (domains - 1) (fun k -> Mysql_domain.spawn (fun () -> chunk (k + 1))) in
+  let first = try Ok (chunk 0) with exn -> Error exn in
+  let rest = List.map (fun d -> try Ok (Mysql_domain.join d) with exn -> Error exn) spawned in
+  Array.concat (List.map (function Ok a -> a | Error exn -> raise exn) (first :: rest))
+
+module Row = struct
+
+type t
+
+external fetch : result -> t option = "db_row_fetch"
+external get : result -> int64 -> t = "db_row_get"
+external is_null : t -> int -> bool = "db_row_is_null"
+external length : t -> int -> int = "db_row_length"
+external get_string : t -> int -> string option = "db_row_get_string"
+external get_int : t -> int -> int option = "db_row_get_int"
+external to_array : t -> string option array = "db_row_to_array"
+
+end
+
+module Decoder = struct
+
+type 'a column = { accepts : dbty -> int -> bool; parse : string -> 'a }
+
+(* decoders are staged: given the description of the columns they
+   resolve names and check types once, and return the row function *)
+type 'a t = meta -> string option array -> 'a
+
+let failf fmt = Printf.ksprintf (fun s -> raise (Error s)) fmt
+
+let custom ?types parse =
+  let accepts = match types with
+  | None -> fun _ _ -> true
+  | Some types -> fun ty _ -> List.mem ty types
+  in
+  { accepts; parse }
+
+let string = custom str2ml
+let int = custom ~types:[IntTy; Int64Ty; YearTy] int2ml
+let int64 = custom ~types:[IntTy; Int64Ty; YearTy] int642ml
+let float = custom ~types:[IntTy; Int64Ty; FloatTy; DecimalTy] float2ml
+let decimal = custom ~types:[IntTy; Int64Ty; DecimalTy] decimal2ml
+let bool = custom ~types:[IntTy] (fun s -> s <> "0")
+let blob = custom ~types:[StringTy; BlobTy] blob2ml
+let date = custom ~types:[DateTy] date2ml
+let time = custom ~types:[TimeTy] time2ml
+let datetime = custom ~types:[DateTimeTy; TimeStampTy]
+  (fun s -> if String.length s = 14 then timestamp2ml s else datetime2ml s)
+let enum = { accepts = (fun ty flags -> ty = EnumTy || flags land enum_flag <> 0); parse = enum2ml }
+let set = { accepts = (fun ty flags -> ty = SetTy || flags land set_flag <> 0); parse = set2ml }
+
+let resolve meta name c =
+  let i = match column_index meta name with
+  | i -> i
+  | exception Not_found -> failf "Mysql.Decoder: no column %s" name
+  in
+  let ty = meta.col_types.(i) in
+  if not (c.accepts ty meta.col_flags.(i)) then
+    failf "Mysql.Decoder: column %s has unexpected type %s" name (pretty_type ty);
+  i
+
+let parse name c s =
+  match c.parse s with
+  | v -> v
+  | exception (Failure _ | Invalid_argument _ | Assert_failure _) ->
+    failf "Mysql.Decoder: cannot decode %S in column %s" s name
+
+let field name c meta =
+  let i = resolve meta name c in
+  fun row -> match row.(i) with
+  | Some s -> parse name c s
+  | None -> failf "Mysql.Decoder: NULL in column %s" name
+
+let field_opt name c meta =
+  let i = resolve meta name c in
+  fun row -> match row.(i) with
+  | Some s -> Some (parse name c s)
+  | None -> None
+
+let return x _ _ = x
+
+let map f d meta =
+  let d = d meta in
+  fun row -> f (d row)
+
+let both a b meta =
+  let a = a meta and b = b meta in
+  fun row -> let x = a row in (x, b row)
+
+let ( let+ ) d f = map f d
+let ( and+ ) = both
+
+let compile d meta = d meta
+
+let all d result =
+  let d = d (metadata result) in
+  let l = ref [] in
+  iter result ~f:(fun row -> l := d row :: !l);
+  List.rev !l
+
+end
+
+module Snapshot = struct
+
+external to_bytes : result -> bytes = "db_snapshot_to_bytes"
+external of_bytes : bytes -> result = "db_snapshot_of_bytes"
+external map_file : string -> result = "db_snapshot_map_file"
+
+(* written aside and renamed over [path], so that mappings of the
+   previous file stay valid *)
+let save result path =
+  let b = to_bytes result in
+  let tmp, oc = Filename.open_temp_file ~mode:[Open_binary] ~perms:0o644 ~temp_dir:(Filename.dirname path)
+    (Filename.basename path) ".tmp" in
+  match output_bytes oc b; close_out oc; Sys.rename tmp path with
+  | () -> ()
+  | exception exn -> close_out_noerr oc; (try Sys.remove tmp with Sys_error _ -> ()); raise exn
+
+end
+
 module Prepared = struct
 
-type stmt
-type stmt_result
+type stmt_handle
+type stmt = { stmt_handle : stmt_handle;
+              mutable stmt_meta : meta option; (* cache for [metadata] *)
+              stmt_dbd : dbd; (* connection the statement belongs to *)
+              mutable stmt_intern : string array array; (* see [intern] *)
+              stmt_sql : string;
+            }
+type stmt_result_handle
+type stmt_result = { sr_handle : stmt_result_handle;
+                     sr_intern : string array array; (* tables of the statement when executed *)
+                   }
 
 external create : dbd -> string -> stmt = "caml_mysql_stmt_prepare"
-external execute : stmt -> string array -> stmt_result = "caml_mysql_stmt_execute"
-external execute_null : stmt -> string option array -> stmt_result = "caml_mysql_stmt_execute_null"
+external execute_plain : stmt -> string array -> stmt_result = "caml_mysql_stmt_execute"
+external execute_null_plain : stmt -> string option array -> stmt_result = "caml_mysql_stmt_execute_null"
+external execute_timeout : stmt -> string array -> float -> stmt_result = "caml_mysql_stmt_execute_timeout"
+external execute_null_timeout : stmt -> string option array -> float -> stmt_result = "caml_mysql_stmt_execute_null_timeout"
+
+let execute ?timeout stmt params =
+  match check_timeout "Mysql.Prepared.execute" timeout with
+  | None -> execute_plain stmt params
+  | Some timeout -> execute_timeout stmt params timeout
+
+type param =
+  | Null
+  | Value of string
+  | Stream of (unit -> (bytes * int) option)
+  | Channel of in_channel
+
+external execute_params_plain : stmt -> param array -> stmt_result = "caml_mysql_stmt_execute_params"
+external execute_params_timeout : stmt -> param array -> float -> stmt_result = "caml_mysql_stmt_execute_params_timeout"
+
+let channel_producer chunk_size ic =
+  let b = Bytes.create chunk_size in
+  fun () ->
+    match input ic b 0 chunk_size with
+    | 0 -> None
+    | n -> Some (b, n)
+
+let execute_params ?timeout ?(chunk_size=65536) stmt params =
+  if chunk_size <= 0 then invalid_arg "Mysql.Prepared.execute_params: chunk_size";
+  let params = Array.map params ~f:(function
+    | Channel ic -> Stream (channel_producer chunk_size ic)
+    | p -> p)
+  in
+  match check_timeout "Mysql.Prepared.execute_params" timeout with
+  | None -> execute_params_plain stmt params
+  | Some timeout -> execute_params_timeout stmt params timeout
+
+let execute_null ?timeout stmt params =
+  match check_timeout "Mysql.Prepared.execute_null" timeout with
+  | None -> execute_null_plain stmt params
+  | Some timeout -> execute_null_timeout stmt params timeout
+
 external affected : stmt -> int64 = "caml_mysql_stmt_affected"
 external insert_id : stmt -> int64 = "caml_mysql_stmt_insert_id"
 external real_status : stmt -> int = "caml_mysql_stmt_status"
 external fetch : stmt_result -> string option array option = "caml_mysql_stmt_fetch"
+external free_result : stmt_result -> unit = "caml_mysql_stmt_free_result"
+external store_result : stmt_result -> result = "caml_mysql_stmt_store_result"
+external next : stmt_result -> bool = "caml_mysql_stmt_next"
+external column : stmt_result -> int -> string option = "caml_mysql_stmt_column"
+external stream_column_ : stmt_result -> int -> int -> (bytes -> int -> unit) -> bool = "caml_mysql_stmt_stream_column"
+
+let stream_column ?(chunk_size=65536) r i f = stream_column_ r i chunk_size f
+
+let output_column ?chunk_size r i oc =
+  stream_column ?chunk_size r i (fun b n -> output oc b 0 n)
+
+external export_fd : stmt_result -> export_format -> bool -> int -> int64 = "caml_mysql_stmt_export"
+
+let export ?(header=true) r format oc =
+  flush oc;
+  export_fd r format header (channel_descriptor oc)
+external query_one : stmt -> string array -> string option array option = "caml_mysql_stmt_query_one"
+external query_one_null : stmt -> string option array -> string option array option = "caml_mysql_stmt_query_one_null"
 external result_metadata : stmt -> result = "caml_mysql_stmt_result_metadata"
 external close : stmt -> unit = "caml_mysql_stmt_close"
 
+let metadata stmt =
+  match stmt.stmt_meta with
+  | Some meta -> meta
+  | None ->
+    let res = result_metadata stmt in
+    let meta = make_meta (raw_metadata res) in
+    free res;
+    stmt.stmt_meta <- Some meta;
+    meta
+
+let intern ?columns stmt = stmt.stmt_intern <- intern_tables (metadata stmt) columns
+
+let query_one_as d stmt params =
+  match query_one_null stmt params with
+  | None -> None
+  | Some row -> Some (Decoder.compile d (metadata stmt) row)
+
+end
+
+module Lookup = struct
+
+external thread_init : unit -> unit = "db_thread_init"
+external thread_end : unit -> unit = "db_thread_end"
+
+type t = {
+  conns : dbd array;
+  prefix : string; (* statement up to the placeholders *)
+  chunk_size : int;
+  mutable budget : int; (* bytes of keys per chunk, 0 until known *)
+  stmts : (int, Prepared.stmt) Hashtbl.t array; (* by number of placeholders, per connection *)
+}
+
+let create ?(chunk_size=1000) ?columns conns ~table ~key =
+  if chunk_size < 1 then invalid_arg "Mysql.Lookup.create: chunk_size";
+  if Array.length conns = 0 then invalid_arg "Mysql.Lookup.create: no connection";
+  let columns = match columns with
+  | None -> quote_table table ^ ".*"
+  | Some l -> String.concat ~sep:", " (List.map quote_ident l)
+  in
+  let prefix = Printf.sprintf "SELECT %s, %s FROM %s WHERE %s IN (" (quote_ident key) columns (quote_table table) (quote_ident key) in
+  { conns; prefix; chunk_size; budget = 0; stmts = Array.map conns ~f:(fun _ -> Hashtbl.create 8) }
+
+(* half of max_allowed_packet, leaving room for the rest of the packet *)
+let budget t =
+  if t.budget = 0 then begin
+    let packet =
+      match fetch (exec t.conns.(0) "SELECT @@max_allowed_packet") with
+      | Some [| Some v |] -> int_of_string v
+      | _ -> 4 * 1024 * 1024
+    in
+    t.budget <- packet / 2
+  end;
+  t.budget
+
+(* number of parameters of a chunk of [k] keys once padded, a power of two
+   so that few statements are prepared *)
+let padded t k =
+  let rec pow2 p = if p >= k then p else pow2 (2 * p) in
+  min t.chunk_size (pow2 1)
+
+(* bytes of a parameter: length, type and null bitmap *)
+let param_bytes k = String.length k + 12
+
+(* distinct keys grouped by [chunk_size] keys and [budget] bytes, the
+   padding of the chunk included *)
+let chunks t keys =
+  let budget = budget t in
+  let seen = Hashtbl.create 1024 in
+  let out = ref [] and cur = ref [] and n = ref 0 and bytes = ref 0 and shortest = ref max_int in
+  let close () =
+    if !n > 0 then out := Array.of_list (List.rev !cur) :: !out;
+    cur := []; n := 0; bytes := 0; shortest := max_int
+  in
+  let fits b =
+    let n = !n + 1 in
+    !bytes + b + (padded t n - n) * min !shortest b <= budget
+  in
+  List.iter (fun k ->
+    if not (Hashtbl.mem seen k) then begin
+      Hashtbl.add seen k ();
+      let b = param_bytes k in
+      if !n = t.chunk_size || (!n > 0 && not (fits b)) then close ();
+      cur := k :: !cur;
+      incr n;
+      bytes := !bytes + b;
+      shortest := min !shortest b
+    end) keys;
+  close ();
+  Array.of_list (List.rev !out)
+
+(* pads [keys] to [padded t k] keys with its shortest key *)
+let pad t keys =
+  let k = Array.length keys in
+  let p = padded t k in
+  if p = k then keys else
+  let shortest = Array.fold_left keys ~init:keys.(0) ~f:(fun a b -> if String.length b < String.length a then b else a) in
+  Array.append keys (Array.make (p - k) shortest)
+
+let stmt t i n =
+  match Hashtbl.find_opt t.stmts.(i) n with
+  | Some s -> s
+  | None ->
+    let sql = t.prefix ^ String.concat ~sep:", " (List.init n (fun _ -> "?")) ^ ")" in
+    let s = Prepared.create t.conns.(i) sql in
+    Hashtbl.add t.stmts.(i) n s;
+    s
+
+let iter t keys ~f =
+  let chunks = chunks t keys in
+  let next = ref 0 and lock = Mutex.create () in
+  let locked g =
+    Mutex.lock lock;
+    Fun.protect ~finally:(fun () -> Mutex.unlock lock) g
+  in
+  let emit key row = locked (fun () -> f key row) in
+  let rec rows r =
+    match Prepared.fetch r with
+    | None -> ()
+    | Some row ->
+      (match row.(0) with
+       | Some key -> emit key (Array.sub row ~pos:1 ~len:(Array.length row - 1))
+       | None -> ());
+      rows r
+  in
+  let worker i =
+    let rec loop () =
+      let c = locked (fun () -> let c = !next in incr next; c) in
+      if c < Array.length chunks then begin
+        let keys = pad t chunks.(c) in
+        let r = Prepared.execute (stmt t i (Array.length keys)) keys in
+        Fun.protect ~finally:(fun () -> Prepared.free_result r) (fun () -> rows r);
+        loop ()
+      end
+    in
+    (* stop the other workers on error *)
+    try loop () with exn -> locked (fun () -> next := Array.length chunks); raise exn
+  in
+  let workers = min (Array.length t.conns) (Array.length chunks) in
+  let spawned = List.init (max 0 (workers - 1)) (fun i -> Mysql_domain.spawn (fun () ->
+    thread_init ();
+    Fun.protect ~finally:thread_end (fun () -> worker (i + 1)))) in
+  let first = try Ok (worker 0) with exn -> Error exn in
+  let rest = List.map (fun d -> try Ok (Mysql_domain.join d) with exn -> Error exn) spawned in
+  List.iter (function Ok () -> () | Error exn -> raise exn) (first :: rest)
+
+let close t =
+  Array.iter t.stmts ~f:(fun stmts ->
+    Hashtbl.iter (fun _ s -> try Prepared.close s with Error _ -> ()) stmts;
+    Hashtbl.reset stmts)
+
+end
+
+let lookup_many ?chunk_size ?columns dbd ~table ~key keys ~f =
+  let t = Lookup.create ?chunk_size ?columns [| dbd |] ~table ~key in
+  Fun.protect ~finally:(fun () -> Lookup.close t) (fun () -> Lookup.iter t keys ~f)
+
+module Cache = struct
+
+external now : unit -> float = "db_monotonic_now"
+
+type entry = {
+  key : string;
+  data : bytes; (* snapshot *)
+  expires : float;
+  tags : string list;
+  mutable prev : entry option; (* more recently used *)
+  mutable next : entry option; (* less recently used *)
+}
+
+type stats = {
+  hits : int;
+  misses : int;
+  expired : int;
+  evictions : int;
+  invalidations : int;
+  entries : int;
+  bytes : int;
+}
+
+type t = {
+  lock : Mutex.t;
+  ttl : float;
+  max_bytes : int;
+  entries : (string, entry) Hashtbl.t;
+  by_tag : (string, (string, unit) Hashtbl.t) Hashtbl.t;
+  mutable first : entry option; (* most recently used *)
+  mutable last : entry option;
+  mutable bytes : int;
+  mutable hits : int;
+  mutable misses : int;
+  mutable expired : int;
+  mutable evictions : int;
+  mutable invalidations : int;
+}
+
+let create ?(ttl=60.) ?(max_bytes=64*1024*1024) () =
+  { lock = Mutex.create (); ttl; max_bytes;
+    entries = Hashtbl.create 64; by_tag = Hashtbl.create 16;
+    first = None; last = None; bytes = 0;
+    hits = 0; misses = 0; expired = 0; evictions = 0; invalidations = 0; }
+
+let locked c f =
+  Mutex.lock c.lock;
+  Fun.protect ~finally:(fun () -> Mutex.unlock c.lock) f
+
+(* LRU list *)
+
+let unlink c e =
+  (match e.prev with Some p -> p.next <- e.next | None -> c.first <- e.next);
+  (match e.next with Some n -> n.prev <- e.prev | None -> c.last <- e.prev);
+  e.prev <- None;
+  e.next <- None
+
+let push_front c e =
+  e.next <- c.first;
+  (match c.first with Some f -> f.prev <- Some e | None -> c.last <- Some e);
+  c.first <- Some e
+
+let remove c e =
+  unlink c e;
+  Hashtbl.remove c.entries e.key;
+  c.bytes <- c.bytes - Bytes.length e.data;
+  List.iter (fun tag ->
+    match Hashtbl.find_opt c.by_tag tag with
+    | Some keys ->
+      Hashtbl.remove keys e.key;
+      if Hashtbl.length keys = 0 then Hashtbl.remove c.by_tag tag
+    | None -> ()) e.tags
+
+let find c key =
+  locked c (fun () ->
+    match Hashtbl.find_opt c.entries key with
+    | Some e when e.expires > now () ->
+      c.hits <- c.hits + 1;
+      unlink c e;
+      push_front c e;
+      Some e.data
+    | Some e ->
+      c.expired <- c.expired + 1;
+      c.misses <- c.misses + 1;
+      remove c e;
+      None
+    | None ->
+      c.misses <- c.misses + 1;
+      None)
+
+let add c key ttl tags data =
+  if Bytes.length data <= c.max_bytes then
+  locked c (fun () ->
+    Option.iter (remove c) (Hashtbl.find_opt c.entries key);
+    while c.bytes + Bytes.length data > c.max_bytes do
+      match c.last with
+      | Some e -> remove c e; c.evictions <- c.evictions + 1
+      | None -> assert false
+    done;
+    let e = { key; data; expires = now () +. ttl; tags; prev = None; next = None } in
+    Hashtbl.replace c.entries key e;
+    push_front c e;
+    c.bytes <- c.bytes + Bytes.length data;
+    List.iter (fun tag ->
+      let keys = match Hashtbl.find_opt c.by_tag tag with
+      | Some keys -> keys
+      | None -> let keys = Hashtbl.create 8 in Hashtbl.replace c.by_tag tag keys; keys
+      in
+      Hashtbl.replace keys key ()) tags)
+
+(* collapse whitespace outside of quotes so that formatting does not matter *)
+let normalize sql =
+  let b = Buffer.create (String.length sql) in
+  let quote = ref None and space = ref false and escaped = ref false in
+  String.iter sql ~f:(fun ch ->
+    match !quote, ch with
+    | None, (' ' | '\t' | '\n' | '\r') -> space := true
+    | None, _ ->
+      if !space && Buffer.length b > 0 then Buffer.add_char b ' ';
+      space := false;
+      Buffer.add_char b ch;
+      if ch = '\'' || ch = '"' || ch = '`' then quote := Some ch
+    | Some q, _ ->
+      Buffer.add_char b ch;
+      if !escaped then escaped := false
+      else if ch = '\\' then escaped := true
+      else if ch = q then quote := None);
+  Buffer.contents b
+
+external session_key : dbd -> string = "db_session_key"
+
+(* only statements returning rows are cached, others run each time *)
+let cached c ?ttl ?(tags=[]) key ~has_rows run =
+  match find c key with
+  | Some data -> Snapshot.of_bytes data
+  | None ->
+    let result = run () in
+    if has_rows result then add c key (Option.value ttl ~default:c.ttl) tags (Snapshot.to_bytes result);
+    result
+
+let exec c ?ttl ?tags ?namespace dbd sql =
+  let ns = match namespace with Some ns -> ns | None -> session_key dbd in
+  cached c ?ttl ?tags (ns ^ "\000" ^ normalize sql) ~has_rows:(fun r -> fields r > 0)
+    (fun () -> exec dbd sql)
+
+let execute c ?ttl ?tags ?namespace stmt params =
+  let b = Buffer.create 64 in
+  Buffer.add_string b (match namespace with Some ns -> ns | None -> session_key stmt.Prepared.stmt_dbd);
+  Buffer.add_char b '\000';
+  Buffer.add_string b (normalize stmt.Prepared.stmt_sql);
+  Array.iter params ~f:(function
+    | None -> Buffer.add_string b "\000N"
+    | Some s -> Printf.bprintf b "\000S%d:%s" (String.length s) s);
+  if Array.length (Prepared.metadata stmt).col_names = 0 then
+    invalid_arg "Mysql.Cache.execute: statement without result set";
+  cached c ?ttl ?tags (Buffer.contents b) ~has_rows:(fun _ -> true) (fun () ->
+    Prepared.store_result (Prepared.execute_null stmt params))
+
+let invalidate c tag =
+  locked c (fun () ->
+    match Hashtbl.find_opt c.by_tag tag with
+    | None -> ()
+    | Some keys ->
+      let keys = Hashtbl.fold (fun key () acc -> key :: acc) keys [] in
+      List.iter (fun key ->
+        Option.iter (fun e -> remove c e; c.invalidations <- c.invalidations + 1)
+          (Hashtbl.find_opt c.entries key)) keys)
+
+let clear c =
+  locked c (fun () ->
+    c.invalidations <- c.invalidations + Hashtbl.length c.entries;
+    Hashtbl.reset c.entries;
+    Hashtbl.reset c.by_tag;
+    c.first <- None;
+    c.last <- None;
+    c.bytes <- 0)
+
+let stats c =
+  locked c (fun () ->
+    ({ hits = c.hits; misses = c.misses; expired = c.expired; evictions = c.evictions;
+       invalidations = c.invalidations; entries = Hashtbl.length c.entries; bytes = c.bytes } : stats))
+
+end
+
+module Bulk_writer = struct
+
+type t
+
+type config = { max_rows : int; max_bytes : int; interval : float; max_queue : int; columns : int }
+
+type stats = {
+  flushes : int;
+  rows : int;
+  failed : int;
+  last_rows : int;
+  last_latency : float;
+  total_latency : float;
+  queued : int;
+}
+
+external create_raw : db_option list -> db -> string -> string -> config -> t = "caml_mysql_bulk_create"
+external add : t -> string option array -> unit = "caml_mysql_bulk_add"
+external flush : t -> unit = "caml_mysql_bulk_flush"
+external close : t -> unit = "caml_mysql_bulk_close"
+external stats : t -> stats = "caml_mysql_bulk_stats"
+
+let create ?(options=[]) ?(max_rows=1000) ?(max_bytes=0) ?(interval=1.0) ?(max_queue=16*1024*1024)
+    ?on_duplicate db ~table ~columns =
+  if Array.length columns = 0 then invalid_arg "Mysql.Bulk_writer.create: no columns";
+  let prefix = Printf.sprintf "INSERT INTO %s (%s) VALUES "
+    (quote_table table)
+    (String.concat ~sep:"," (Array.to_list (Array.map columns ~f:quote_ident)))
+  in
+  let suffix = match on_duplicate with
+  | None -> ""
+  | Some update -> " ON DUPLICATE KEY UPDATE " ^ update
+  in
+  create_raw options db prefix suffix
+    { max_rows; max_bytes; interval; max_queue; columns = Array.length columns }
+
+end
+
+module Group_commit = struct
+
+external sleep : float -> unit = "db_sleep"
+
+type outcome = Pending | Written | Failed of exn
+
+type job = { write : dbd -> unit; mutable outcome : outcome }
+
+type t = {
+  dbd : dbd;
+  window : float;
+  max_batch : int;
+  retries : int;
+  lock : Mutex.t;
+  cond : Condition.t;
+  mutable pending : job list; (* newest first *)
+  mutable leader : bool;
+  mutable n_commits : int;
+  mutable n_writes : int;
+}
+
+let create ?(window=0.) ?(max_batch=1000) ?(retries=3) dbd =
+  if max_batch < 1 then invalid_arg "Mysql.Group_commit.create: max_batch";
+  { dbd; window; max_batch; retries; lock = Mutex.create (); cond = Condition.create ();
+    pending = []; leader = false; n_commits = 0; n_writes = 0 }
+
+(* oldest [n] jobs of [pending] and the remaining ones *)
+let take n pending =
+  let rec split k acc = function
+    | job :: rest when k > 0 -> split (k - 1) (job :: acc) rest
+    | rest -> acc, List.rev rest
+  in
+  let batch, rest = split n [] (List.rev pending) in
+  List.rev batch, rest
+
+(* each write runs under its savepoint, so that a failed write does not
+   abort the others, a deadlock (which rolls back the whole transaction)
+   is raised to with_transaction, which restarts the batch *)
+let run g batch =
+  with_transaction ~retries:g.retries g.dbd (fun dbd ->
+    List.map (fun job ->
+      match with_savepoint dbd "group_commit" (fun () -> job.write dbd) with
+      | () -> Written
+      | exception (Error _ as exn) when real_status dbd = er_lock_deadlock -> raise exn
+      | exception exn -> Failed exn) batch)
+
+let lead g =
+  if g.window > 0. then sleep g.window;
+  Mutex.lock g.lock;
+  let batch, rest = take g.max_batch g.pending in
+  g.pending <- rest;
+  Mutex.unlock g.lock;
+  let outcomes = match run g batch with
+  | outcomes -> outcomes
+  | exception exn -> List.map (fun _ -> Failed exn) batch
+  in
+  Mutex.lock g.lock;
+  List.iter2 (fun job o -> job.outcome <- o) batch outcomes;
+  g.leader <- false;
+  g.n_commits <- g.n_commits + 1;
+  g.n_writes <- g.n_writes + List.length batch;
+  Condition.broadcast g.cond
+
+let submit g write =
+  let job = { write; outcome = Pending } in
+  Mutex.lock g.lock;
+  g.pending <- job :: g.pending;
+  let rec wait () =
+    match job.outcome with
+    | Pending when not g.leader ->
+      g.leader <- true;
+      Mutex.unlock g.lock;
+      lead g;
+      wait ()
+    | Pending -> Condition.wait g.cond g.lock; wait ()
+    | o -> o
+  in
+  let o = wait () in
+  Mutex.unlock g.lock;
+  match o with
+  | Failed exn -> raise exn
+  | Pending | Written -> ()
+
+type stats = { transactions : int; writes : int }
+
+let stats g =
+  Mutex.lock g.lock;
+  let x = { transactions = g.n_commits; writes = g.n_writes } in
+  Mutex.unlock g.lock;
+  x
+
+end
+
+module Router = struct
+
+external now : unit -> float = "db_monotonic_now"
+
+type node = {
+  node_db : db;
+  mutable conn : dbd option; (* opened on first use *)
+  mutable latency : float; (* smoothed duration of the probes, in seconds *)
+  mutable lag : float option; (* Seconds_Behind_Source, None when unknown *)
+  mutable up : bool;
+  mutable applied : string; (* GTID set known to be applied *)
+}
+
+type t = {
+  options : db_option list;
+  primary_node : node;
+  replicas : node array;
+  max_lag : float;
+  refresh_interval : float;
+  wait_timeout : float;
+  mutable refreshed : float;
+  mutable in_transaction : bool;
+  mutable written : bool; (* writes on the primary since [gtid] was read *)
+  mutable temporary : bool; (* temporary tables were created on the primary *)
+  mutable gtid : string; (* GTID set of the primary after the last write *)
+}
+
+let make_node db = { node_db = db; conn = None; latency = 0.; lag = None; up = true; applied = "" }
+
+let create ?(options=[]) ?(max_lag=5.) ?(refresh_interval=1.) ?(wait_timeout=1.) ~primary ~replicas () =
+  { options; primary_node = make_node primary; replicas = Array.of_list (List.map make_node replicas);
+    max_lag; refresh_interval; wait_timeout; refreshed = neg_infinity;
+    in_transaction = false; written = false; temporary = false; gtid = "" }
+
+let conn t n =
+  match n.conn with
+  | Some dbd -> dbd
+  | None ->
+    let dbd = connect ~options:t.options n.node_db in
+    n.conn <- Some dbd;
+    dbd
+
+let drop n =
+  n.up <- false;
+  Option.iter (fun dbd -> try disconnect dbd with Error _ -> ()) n.conn;
+  n.conn <- None
+
+let primary t = conn t t.primary_node
+
+(* client errors for a connection which is gone *)
+let connection_lost dbd =
+  match real_status dbd with
+  | 2002 | 2003 | 2006 | 2013 | 2055 -> true
+  | _ -> false
+
+let contains s sub =
+  let n = String.length sub in
+  let rec loop i = i + n <= String.length s && (String.sub s ~pos:i ~len:n = sub || loop (i + 1)) in
+  loop 0
+
+let is_mariadb dbd = contains (server_info dbd) "MariaDB"
+
+let scalar dbd sql =
+  match fetch (exec dbd sql) with
+  | Some [| v |] -> v
+  | _ -> None
+
+let replica_status dbd =
+  let r = try exec dbd "SHOW REPLICA STATUS" with Error _ -> exec dbd "SHOW SLAVE STATUS" in
+  match fetch r with
+  | None -> None
+  | Some row ->
+    let meta = metadata r in
+    let find name = try row.(column_index meta name) with Not_found -> None in
+    match find "Seconds_Behind_Source", find "Seconds_Behind_Master" with
+    | Some lag, _ | None, Some lag -> Some (float_of_string lag)
+    | None, None -> None
+
+let probe t n =
+  match
+    let dbd = conn t n in
+    let start = now () in
+    let lag = replica_status dbd in
+    lag, now () -. start
+  with
+  | lag, d ->
+    n.up <- true;
+    n.lag <- lag;
+    n.latency <- (if n.latency = 0. then d else 0.8 *. n.latency +. 0.2 *. d)
+  | exception Error _ -> drop n
+
+let refresh t =
+  Array.iter t.replicas ~f:(probe t);
+  t.refreshed <- now ()
+
+(* usable replica with the lowest latency *)
+let pick t =
+  if now () -. t.refreshed > t.refresh_interval then refresh t;
+  Array.fold_left t.replicas ~init:None ~f:(fun best n ->
+    match n.lag, best with
+    | Some lag, _ when not n.up || lag > t.max_lag -> best
+    | None, _ -> best
+    | Some _, Some b when b.latency <= n.latency -> best
+    | Some _, _ -> Some n)
+
+let primary_gtid t =
+  if t.written then begin
+    let dbd = primary t in
+    let sql = if is_mariadb dbd then "SELECT @@GLOBAL.gtid_binlog_pos" else "SELECT @@GLOBAL.gtid_executed" in
+    t.gtid <- Option.value (scalar dbd sql) ~default:"";
+    t.written <- false
+  end;
+  t.gtid
+
+(* whether [n] has applied the writes made so far on the primary, waiting
+   at most [wait_timeout] for it *)
+let caught_up t n =
+  let gtid = primary_gtid t in
+  gtid = "" || n.applied = gtid ||
+  begin
+    let dbd = conn t n in
+    let sql =
+      if is_mariadb dbd then Printf.sprintf "SELECT MASTER_GTID_WAIT(%s, %g)" (ml2rstr dbd gtid) t.wait_timeout
+      else Printf.sprintf "SELECT WAIT_FOR_EXECUTED_GTID_SET(%s, %g)" (ml2rstr dbd gtid) t.wait_timeout
+    in
+    let ok = scalar dbd sql = Some "0" in
+    if ok then n.applied <- gtid;
+    ok
+  end
+
+let write t f =
+  let dbd = primary t in
+  Fun.protect ~finally:(fun () -> t.written <- true) (fun () -> f dbd)
+
+let read ?(consistent=true) t f =
+  if t.in_transaction || t.temporary then f (primary t) else
+  match pick t with
+  | None -> f (primary t)
+  | Some n ->
+    match if consistent && not (caught_up t n) then None else Some (conn t n) with
+    | None -> f (primary t)
+    | Some dbd ->
+      match f dbd with
+      | x -> x
+      | exception (Error _ as exn) ->
+        if connection_lost dbd then (drop n; f (primary t)) else raise exn
+
+(* first keyword of [sql], skipping blanks and comments *)
+let keyword sql =
+  let len = String.length sql in
+  let rec skip i =
+    if i >= len then i else
+    match sql.[i] with
+    | ' ' | '\t' | '\n' | '\r' | '(' -> skip (i + 1)
+    | '#' -> line i
+    | '-' when i + 2 < len && sql.[i+1] = '-' && (sql.[i+2] = ' ' || sql.[i+2] = '\t') -> line i
+    | '/' when i + 1 < len && sql.[i+1] = '*' -> block (i + 2)
+    | _ -> i
+  and line i = if i >= len then i else if sql.[i] = '\n' then skip (i + 1) else line (i + 1)
+  and block i = if i + 1 >= len then len else if sql.[i] = '*' && sql.[i+1] = '/' then skip (i + 2) else block (i + 1)
+  in
+  let start = skip 0 in
+  let rec word i = if i < len && (match sql.[i] with 'a'..'z' | 'A'..'Z' -> true | _ -> false) then word (i + 1) else i in
+  String.uppercase_ascii (String.sub sql ~pos:start ~len:(word start - start))
+
+(* [sql] in upper case without the contents of its string literals *)
+let code sql =
+  let b = Buffer.create (String.length sql) in
+  let quote = ref None and escaped = ref false in
+  String.iter sql ~f:(fun ch ->
+    match !quote with
+    | None ->
+      Buffer.add_char b (Char.uppercase_ascii ch);
+      if ch = '\'' || ch = '"' then quote := Some ch
+    | Some q ->
+      if !escaped then escaped := false
+      else if ch = '\\' then escaped := true
+      else if ch = q then (quote := None; Buffer.add_char b ch));
+  Buffer.contents b
+
+(* functions whose result depends on the session *)
+let session_functions = [
+  "LAST_INSERT_ID"; "FOUND_ROWS"; "ROW_COUNT"; "CONNECTION_ID";
+  "GET_LOCK"; "RELEASE_LOCK"; "RELEASE_ALL_LOCKS"; "IS_FREE_LOCK"; "IS_USED_LOCK";
+]
+
+let is_read sql =
+  match keyword sql with
+  | "SELECT" ->
+    let sql = code sql in
+    not (contains sql "FOR UPDATE" || contains sql "FOR SHARE" || contains sql "LOCK IN SHARE MODE" || contains sql "INTO" ||
+         (* user and session variables *)
+         contains sql "@" ||
+         List.exists (contains sql) session_functions)
+  | "SHOW" | "DESC" | "DESCRIBE" | "EXPLAIN" -> true
+  | _ -> false
+
+let exec ?consistent t sql =
+  if is_read sql then read ?consistent t (fun dbd -> exec dbd sql)
+  else begin
+    if keyword sql = "CREATE" && contains (code sql) "TEMPORARY" then t.temporary <- true;
+    write t (fun dbd -> exec dbd sql)
+  end
+
+let with_transaction ?isolation ?read_only ?retries t f =
+  if t.in_transaction then invalid_arg "Mysql.Router.with_transaction: nested transaction";
+  t.in_transaction <- true;
+  Fun.protect ~finally:(fun () -> t.in_transaction <- false; t.written <- true)
+    (fun () -> with_transaction ?isolation ?read_only ?retries (primary t) f)
+
+let close t =
+  drop t.primary_node;
+  Array.iter t.replicas ~f:drop
+
+end
+
+module Resilient = struct
+
+external sleep : float -> unit = "db_sleep"
+
+type t = {
+  options : db_option list;
+  mutable db : db;
+  mutable charset : string option;
+  init : string list;
+  retries : int;
+  backoff : float;
+  max_backoff : float;
+  random : Random.State.t;
+  mutable conn : dbd option;
+  mutable generation : int; (* number of connections opened *)
+  mutable reconnects : int;
+  mutable broken : bool; (* connection lost in a transaction, not reported by close yet *)
+}
+
+type stmt = {
+  owner : t;
+  sql : string;
+  idempotent : bool;
+  mutable handle : Prepared.stmt option;
+  mutable prepared_in : int; (* generation of [handle] *)
+}
+
+let create ?(options=[]) ?charset ?(init=[]) ?(retries=3) ?(backoff=0.1) ?(max_backoff=10.) db =
+  (* statements do not survive the reconnections of the client library *)
+  let options = List.filter (function OPT_RECONNECT _ -> false | _ -> true) options in
+  { options; db; charset; init; retries; backoff; max_backoff; random = Random.State.make_self_init ();
+    conn = None; generation = 0; reconnects = 0; broken = false }
+
+(* client errors for a connection which is gone *)
+let lost code =
+  match code with
+  | 2006 | 2013 | 2055 | 4031 -> true
+  | _ -> false
+
+let er_unknown_stmt_handler = 1243
+
+let drop t =
+  Option.iter (fun dbd -> try disconnect dbd with Error _ -> ()) t.conn;
+  t.conn <- None
+
+(* drops the lost connection, true if a transaction was open on it: its
+   statements are gone and must not be followed by others in autocommit *)
+let lose t dbd =
+  let in_trans = in_transaction dbd in
+  drop t;
+  if in_trans then t.broken <- true;
+  in_trans
+
+let open_conn t =
+  let dbd = connect ~options:t.options t.db in
+  match
+    Option.iter (set_charset dbd) t.charset;
+    List.iter (query dbd) t.init
+  with
+  | () -> dbd
+  | exception exn -> (try disconnect dbd with Error _ -> ()); raise exn
+
+(* exponential backoff with full jitter, so that the clients of a server
+   which went away do not all come back at once *)
+let delay t attempt =
+  let d = Float.min t.max_backoff (t.backoff *. Float.pow 2. (float attempt)) in
+  sleep (Random.State.float t.random d)
+
+let connection t =
+  if t.broken then raise (Error "Mysql.Resilient: connection lost in a transaction");
+  match t.conn with
+  | Some dbd -> dbd
+  | None ->
+    let rec loop attempt =
+      if t.generation > 0 || attempt > 0 then delay t attempt;
+      match open_conn t with
+      | dbd -> dbd
+      | exception (Error _ as exn) -> if attempt >= t.retries then raise exn else loop (attempt + 1)
+    in
+    let dbd = loop 0 in
+    if t.generation > 0 then t.reconnects <- t.reconnects + 1;
+    t.generation <- t.generation + 1;
+    t.conn <- Some dbd;
+    dbd
+
+let run ?(idempotent=false) t f =
+  let rec loop attempt =
+    let dbd = connection t in
+    match f dbd with
+    | x -> x
+    | exception (Error _ as exn) when lost (real_status dbd) ->
+      if not (lose t dbd) && idempotent && attempt < t.retries then loop (attempt + 1) else raise exn
+  in
+  loop 0
+
+let with_transaction ?isolation ?read_only ?retries t f =
+  let dbd = connection t in
+  match with_transaction ?isolation ?read_only ?retries dbd f with
+  | x -> x
+  | exception exn ->
+    (* the caller learns here that the transaction is gone *)
+    (match t.conn with
+     | Some d when d == dbd && lost (real_status dbd) -> drop t
+     | _ -> ());
+    t.broken <- false;
+    raise exn
+
+let exec ?idempotent t sql =
+  let idempotent = match idempotent with Some b -> b | None -> Router.is_read sql in
+  run ~idempotent t (fun dbd -> exec dbd sql)
+
+let select_db t name =
+  run ~idempotent:true t (fun dbd -> select_db dbd name);
+  t.db <- { t.db with dbname = Some name }
+
+let set_charset t charset =
+  run ~idempotent:true t (fun dbd -> set_charset dbd charset);
+  t.charset <- Some charset
+
+let handle s dbd =
+  match s.handle with
+  | Some h when s.prepared_in = s.owner.generation -> h
+  | _ ->
+    (* the previous handle belongs to a closed connection and is released by the GC *)
+    s.handle <- None;
+    let h = Prepared.create dbd s.sql in
+    s.handle <- Some h;
+    s.prepared_in <- s.owner.generation;
+    h
+
+let with_stmt ?idempotent s f =
+  let t = s.owner in
+  let idempotent = Option.value idempotent ~default:s.idempotent in
+  let rec loop attempt =
+    let dbd = connection t in
+    match f (handle s dbd) with
+    | x -> x
+    | exception (Error _ as exn) ->
+      let code = match s.handle with Some h -> Prepared.real_status h | None -> 0 in
+      if code = er_unknown_stmt_handler && attempt < t.retries then begin
+        (* not executed: prepare again on the same connection *)
+        s.handle <- None;
+        loop (attempt + 1)
+      end
+      else if lost code || lost (real_status dbd) then begin
+        if not (lose t dbd) && idempotent && attempt < t.retries then loop (attempt + 1) else raise exn
+      end
+      else raise exn
+  in
+  loop 0
+
+let prepare t sql =
+  let s = { owner = t; sql; idempotent = Router.is_read sql; handle = None; prepared_in = 0 } in
+  with_stmt ~idempotent:true s ignore;
+  s
+
+let execute ?idempotent ?timeout s params = with_stmt ?idempotent s (fun h -> Prepared.execute ?timeout h params)
+let execute_null ?idempotent ?timeout s params = with_stmt ?idempotent s (fun h -> Prepared.execute_null ?timeout h params)
+
+let close_stmt s =
+  Option.iter (fun h -> try Prepared.close h with Error _ -> ()) s.handle;
+  s.handle <- None
+
+let reconnects t = t.reconnects
+
+let close t = drop t; t.broken <- false
+
+end
+
+module Binlog = struct
+
+type handle
+external open_stream : dbd -> string -> int64 -> int -> handle = "db_binlog_open"
+external fetch_event : dbd -> handle -> string option = "db_binlog_fetch"
+external close_stream : dbd -> handle -> unit = "db_binlog_close"
+
+type table = {
+  table_id : int;
+  schema : string;
+  name : string;
+  types : int array; (* binlog column types *)
+  meta : int array; (* type specific metadata *)
+}
+
+type event =
+  | Rotate of string * int64
+  | Gtid of string
+  | Query of string * string
+  | Xid of int64
+  | Table_map of table
+  | Insert of table * string option array list
+  | Update of table * (string option array * string option array) list
+  | Delete of table * string option array list
+  | Heartbeat
+  | Other of int
+
+type t = {
+  dbd : dbd;
+  handle : handle;
+  checksum : bool; (* events end with a CRC32 *)
+  tables : (int, table) Hashtbl.t;
+  mutable file : string;
+  mutable position : int64;
+  mutable gtid : string option;
+}
+
+(* little endian readers *)
+let u8 s i = Bytes.get_uint8 (Bytes.unsafe_of_string s) i
+let u16 s i = Bytes.get_uint16_le (Bytes.unsafe_of_string s) i
+let i32 s i = Bytes.get_int32_le (Bytes.unsafe_of_string s) i
+let i64 s i = Bytes.get_int64_le (Bytes.unsafe_of_string s) i
+let u24 s i = u16 s i lor (u8 s (i + 2) lsl 16)
+let u32 s i = Int32.to_int (i32 s i) land 0xFFFF_FFFF
+let u48 s i = u32 s i lor (u16 s (i + 4) lsl 32)
+
+(* big endian unsigned integer of [n] bytes *)
+let be s i n =
+  let v = ref 0 in
+  for k = 0 to n - 1 do v := (!v lsl 8) lor u8 s (i + k) done;
+  !v
+
+(* unsigned little endian integer of [n] bytes *)
+let le64 s i n =
+  let v = ref 0L in
+  for k = n - 1 downto 0 do v := Int64.logor (Int64.shift_left !v 8) (Int64.of_int (u8 s (i + k))) done;
+  !v
+
+let lenenc s i =
+  match u8 s i with
+  | n when n < 0xfb -> n, i + 1
+  | 0xfc -> u16 s (i + 1), i + 3
+  | 0xfd -> u24 s (i + 1), i + 4
+  | _ -> Int64.to_int (i64 s (i + 1)), i + 9
+
+let header_size = 19
+
+let table_map s =
+  let table_id = u48 s header_size in
+  let pos = header_size + 8 in
+  let schema = String.sub s ~pos:(pos + 1) ~len:(u8 s pos) in
+  let pos = pos + 1 + String.length schema + 1 in
+  let name = String.sub s ~pos:(pos + 1) ~len:(u8 s pos) in
+  let pos = pos + 1 + String.length name + 1 in
+  let n, pos = lenenc s pos in
+  let types = Array.init n ~f:(fun k -> u8 s (pos + k)) in
+  let _, pos = lenenc s (pos + n) in
+  let p = ref pos in
+  let meta = Array.map types ~f:(fun ty ->
+    let take n v = p := !p + n; v in
+    match ty with
+    | 4 | 5 | 17 | 18 | 19 | 245 | 252 | 255 -> take 1 (u8 s !p)
+    | 15 | 16 | 253 -> take 2 (u16 s !p)
+    | 246 | 254 -> take 2 (be s !p 2)
+    | _ -> 0)
+  in
+  { table_id; schema; name; types; meta }
+
+let fraction s pos fsp =
+  let n = (fsp + 1) / 2 in
+  if n = 0 then "", pos else
+  let micro = be s pos n * (match n with 1 -> 10000 | 2 -> 100 | _ -> 1) in
+  let rec pow k = if k = 0 then 1 else 10 * pow (k - 1) in
+  Printf.sprintf ".%0*d" fsp (micro / pow (6 - fsp)), pos + n
+
+let dig2bytes = [| 0; 1; 1; 2; 2; 3; 3; 4; 4; 4 |]
+
+(* binary DECIMAL, see decimal2bin in MySQL *)
+let decimal s pos meta =
+  let precision = meta lsr 8 and scale = meta land 255 in
+  let intg = precision - scale in
+  let intg0 = intg / 9 and intg0x = intg mod 9 and frac0 = scale / 9 and frac0x = scale mod 9 in
+  let size = intg0 * 4 + dig2bytes.(intg0x) + frac0 * 4 + dig2bytes.(frac0x) in
+  let b = Bytes.of_string (String.sub s ~pos ~len:size) in
+  let negative = Char.code (Bytes.get b 0) land 0x80 = 0 in
+  Bytes.set b 0 (Char.chr (Char.code (Bytes.get b 0) lxor 0x80));
+  if negative then Bytes.iteri (fun i c -> Bytes.set b i (Char.chr (Char.code c lxor 0xff))) b;
+  let d = Bytes.unsafe_to_string b in
+  let buf = Buffer.create (precision + 2) in
+  let p = ref 0 in
+  let group n digits =
+    let v = be d !p n in
+    p := !p + n;
+    Printf.bprintf buf "%0*d" digits v
+  in
+  if intg0x > 0 then group dig2bytes.(intg0x) intg0x;
+  for _ = 1 to intg0 do group 4 9 done;
+  let ipart = Buffer.contents buf in
+  let i = ref 0 in
+  while !i < String.length ipart - 1 && ipart.[!i] = '0' do incr i done;
+  let ipart = if ipart = "" then "0" else String.sub ipart ~pos:!i ~len:(String.length ipart - !i) in
+  Buffer.clear buf;
+  for _ = 1 to frac0 do group 4 9 done;
+  if frac0x > 0 then group dig2bytes.(frac0x) frac0x;
+  let fpart = Buffer.contents buf in
+  (if negative then "-" else "") ^ ipart ^ (if scale > 0 then "." ^ fpart else ""), pos + size
+
+let signed v bits = if v >= 1 lsl (bits - 1) then v - (1 lsl bits) else v
+
+let sized_string s pos len_bytes =
+  let len = match len_bytes with
+  | 1 -> u8 s pos
+  | 2 -> u16 s pos
+  | 3 -> u24 s pos
+  | _ -> u32 s pos
+  in
+  String.sub s ~pos:(pos + len_bytes) ~len, pos + len_bytes + len
+
+(* value of a column, in the format of the text protocol *)
+let column s pos ty meta =
+  match ty with
+  | 1 -> string_of_int (signed (u8 s pos) 8), pos + 1
+  | 2 -> string_of_int (signed (u16 s pos) 16), pos + 2
+  | 9 -> string_of_int (signed (u24 s pos) 24), pos + 3
+  | 3 -> Int32.to_string (i32 s pos), pos + 4
+  | 8 -> Int64.to_string (i64 s pos), pos + 8
+  | 4 -> Printf.sprintf "%.9g" (Int32.float_of_bits (i32 s pos)), pos + 4
+  | 5 -> Printf.sprintf "%.17g" (Int64.float_of_bits (i64 s pos)), pos + 8
+  | 13 -> let y = u8 s pos in (if y = 0 then "0000" else string_of_int (y + 1900)), pos + 1
+  | 10 ->
+    let v = u24 s pos in
+    Printf.sprintf "%04d-%02d-%02d" (v lsr 9) ((v lsr 5) land 15) (v land 31), pos + 3
+  | 11 ->
+    let v = u24 s pos in
+    Printf.sprintf "%02d:%02d:%02d" (v / 10000) (v / 100 mod 100) (v mod 100), pos + 3
+  | 12 ->
+    let v = i64 s pos in
+    let d = Int64.to_int (Int64.div v 1000000L) and t = Int64.to_int (Int64.rem v 1000000L) in
+    Printf.sprintf "%04d-%02d-%02d %02d:%02d:%02d" (d / 10000) (d / 100 mod 100) (d mod 100)
+      (t / 10000) (t / 100 mod 100) (t mod 100), pos + 8
+  | 7 -> string_of_int (u32 s pos), pos + 4
+  | 17 ->
+    let frac, next = fraction s (pos + 4) meta in
+    string_of_int (be s pos 4) ^ frac, next
+  | 18 ->
+    let v = be s pos 5 - 0x80_0000_0000 in
+    let ymd = v lsr 17 and hms = v land 0x1ffff in
+    let ym = ymd lsr 5 in
+    let frac, next = fraction s (pos + 5) meta in
+    Printf.sprintf "%04d-%02d-%02d %02d:%02d:%02d%s" (ym / 13) (ym mod 13) (ymd land 31)
+      (hms lsr 12) ((hms lsr 6) land 63) (hms land 63) frac, next
+  | 19 ->
+    let v = be s pos 3 - 0x80_0000 in
+    let a = abs v in
+    let frac, next = fraction s (pos + 3) meta in
+    Printf.sprintf "%s%02d:%02d:%02d%s" (if v < 0 then "-" else "")
+      ((a lsr 12) land 0x3ff) ((a lsr 6) land 63) (a land 63) frac, next
+  | 15 | 253 -> sized_string s pos (if meta < 256 then 1 else 2)
+  | 245 | 252 | 255 -> sized_string s pos meta
+  | 246 -> decimal s pos meta
+  | 16 ->
+    let n = (meta lsr 8) + (if meta land 255 > 0 then 1 else 0) in
+    let v = ref 0L in
+    for k = 0 to n - 1 do v := Int64.logor (Int64.shift_left !v 8) (Int64.of_int (u8 s (pos + k))) done;
+    Int64.to_string !v, pos + n
+  | 254 ->
+    let real_type = meta lsr 8 and len = meta land 255 in
+    if real_type = 247 then (* ENUM, index of the value *)
+      string_of_int (if len = 1 then u8 s pos else u16 s pos), pos + len
+    else if real_type = 248 then (* SET, bitmap of the values *)
+      Int64.to_string (le64 s pos len), pos + len
+    else
+      let max_len =
+        if real_type land 0x30 <> 0x30 then len lor (((real_type land 0x30) lxor 0x30) lsl 4) else len
+      in
+      sized_string s pos (if max_len < 256 then 1 else 2)
+  | _ -> raise (Error (Printf.sprintf "Mysql.Binlog: unsupported column type %d" ty))
+
+let bit s base k = u8 s (base + k / 8) land (1 lsl (k mod 8)) <> 0
+
+let row table s present n pos =
+  let count = ref 0 in
+  for k = 0 to n - 1 do if bit s present k then incr count done;
+  let nulls = pos in
+  let pos = ref (pos + (!count + 7) / 8) in
+  let j = ref 0 in
+  let values = Array.make n None in
+  for k = 0 to n - 1 do
+    if bit s present k then begin
+      if not (bit s nulls !j) then begin
+        let v, next = column s !pos table.types.(k) table.meta.(k) in
+        values.(k) <- Some v;
+        pos := next
+      end;
+      incr j
+    end
+  done;
+  values, !pos
+
+let rows t s len ty =
+  let table_id = u48 s header_size in
+  let table = match Hashtbl.find_opt t.tables table_id with
+  | Some table -> table
+  | None -> raise (Error (Printf.sprintf "Mysql.Binlog: no table map for table id %d" table_id))
+  in
+  let pos = header_size + 8 in
+  let pos = if ty >= 30 then pos + u16 s pos else pos in
+  let n, pos = lenenc s pos in
+  let bitmap = (n + 7) / 8 in
+  let before = pos in
+  let update = ty = 24 || ty = 31 in
+  let after, pos = if update then pos + bitmap, pos + 2 * bitmap else before, pos + bitmap in
+  let rec loop pos acc =
+    if pos >= len then List.rev acc else
+    let r1, pos = row table s before n pos in
+    if update then
+      let r2, pos = row table s after n pos in
+      loop pos ((r1, Some r2) :: acc)
+    else loop pos ((r1, None) :: acc)
+  in
+  table, loop pos []
+
+let hex s pos len =
+  String.concat ~sep:"" (List.init len (fun k -> Printf.sprintf "%02x" (u8 s (pos + k))))
+
+let decode t s =
+  let len = String.length s - (if t.checksum then 4 else 0) in
+  let ty = u8 s 4 in
+  let log_pos = u32 s 13 in
+  if log_pos > 0 then t.position <- Int64.of_int log_pos;
+  match ty with
+  | 4 ->
+    let position = i64 s header_size in
+    let file = String.sub s ~pos:(header_size + 8) ~len:(len - header_size - 8) in
+    t.file <- file;
+    t.position <- position;
+    Rotate (file, position)
+  | 33 ->
+    let p = header_size + 1 in
+    let gtid = Printf.sprintf "%s-%s-%s-%s-%s:%Ld" (hex s p 4) (hex s (p + 4) 2) (hex s (p + 6) 2)
+      (hex s (p + 8) 2) (hex s (p + 10) 6) (i64 s (p + 16)) in
+    t.gtid <- Some gtid;
+    Gtid gtid
+  | 2 ->
+    let schema_len = u8 s (header_size + 8) and status_len = u16 s (header_size + 11) in
+    let pos = header_size + 13 + status_len in
+    let schema = String.sub s ~pos ~len:schema_len in
+    let pos = pos + schema_len + 1 in
+    Query (schema, String.sub s ~pos ~len:(len - pos))
+  | 16 -> Xid (i64 s header_size)
+  | 19 ->
+    let table = table_map s in
+    Hashtbl.replace t.tables table.table_id table;
+    Table_map table
+  | 23 | 30 -> let table, l = rows t s len ty in Insert (table, List.map fst l)
+  | 25 | 32 -> let table, l = rows t s len ty in Delete (table, List.map fst l)
+  | 24 | 31 ->
+    let table, l = rows t s len ty in
+    Update (table, List.map (function (b, Some a) -> b, a | (b, None) -> b, b) l)
+  | 27 -> Heartbeat
+  | ty -> Other ty
+
+let scalar dbd sql =
+  match fetch (exec dbd sql) with
+  | Some row when Array.length row > 0 -> row.(0)
+  | _ -> None
+
+let current_position dbd =
+  let r = try exec dbd "SHOW BINARY LOG STATUS" with Error _ -> exec dbd "SHOW MASTER STATUS" in
+  match fetch r with
+  | Some row when Array.length row >= 2 ->
+    (match row.(0), row.(1) with
+     | Some file, Some pos -> file, Int64.of_string pos
+     | _ -> raise (Error "Mysql.Binlog.connect: binary logging is disabled"))
+  | _ -> raise (Error "Mysql.Binlog.connect: binary logging is disabled")
+
+let connect ?start ?(heartbeat=0.) ~server_id dbd =
+  let file, position = match start with
+  | Some start -> start
+  | None -> current_position dbd
+  in
+  let checksum = scalar dbd "SELECT @@GLOBAL.binlog_checksum" in
+  let checksum_sql = ml2rstr dbd (Option.value checksum ~default:"NONE") in
+  query dbd (Printf.sprintf "SET @master_binlog_checksum = %s, @source_binlog_checksum = %s" checksum_sql checksum_sql);
+  if heartbeat > 0. then
+    query dbd (Printf.sprintf "SET @master_heartbeat_period = %.0f, @source_heartbeat_period = %.0f"
+      (heartbeat *. 1e9) (heartbeat *. 1e9));
+  let handle = open_stream dbd file position server_id in
+  { dbd; handle; checksum = (match checksum with Some "NONE" | None -> false | Some _ -> true);
+    tables = Hashtbl.create 16; file; position; gtid = None }
+
+let next t =
+  match fetch_event t.dbd t.handle with
+  | None -> None
+  | Some s -> Some (decode t s)
+
+let rec iter t ~f =
+  match next t with
+  | None -> ()
+  | Some e -> f e; iter t ~f
+
+let position t = t.file, t.position
+
+let gtid t = t.gtid
+
+let close t = close_stream t.dbd t.handle
+
 end
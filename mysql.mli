@@ -49,6 +49,9 @@ type protocol =
 | PROTOCOL_PIPE
 | PROTOCOL_MEMORY
 
+(** TLS session of a connection, see {!tls_session} *)
+type tls_session
+
 type db_option =
 | OPT_COMPRESS
 | OPT_NAMED_PIPE
@@ -75,10 +78,23 @@ type db_option =
 | SHARED_MEMORY_BASE_NAME of string (** The name of the shared-memory object for communication to the server 
                                         on Windows, if the server supports shared-memory connections *)
 | OPT_FOUND_ROWS  (** Return the number of found (matched) rows, not the number of changed rows. *)
+| OPT_SSL_CA of string (** Path of the file of trusted certificate authorities *)
+| OPT_SSL_CAPATH of string (** Path of the directory of trusted certificate authorities *)
+| OPT_SSL_CERT of string (** Path of the client certificate *)
+| OPT_SSL_KEY of string (** Path of the client private key *)
+| OPT_SSL_CIPHER of string (** Permitted ciphers *)
+| OPT_TLS_VERSION of string (** Permitted TLS versions, e.g. ["TLSv1.2,TLSv1.3"] *)
+| OPT_SSL_SESSION of tls_session (** Resume a TLS session instead of a full handshake.
+                                     Ignored if the client library does not support it. *)
+| OPT_COMPRESSION_ALGORITHMS of string (** Permitted compression algorithms, in order of
+                                           preference: ["zstd,zlib,uncompressed"].
+                                           Requires MySQL client 8.0.18 or later. *)
+| OPT_ZSTD_COMPRESSION_LEVEL of int (** zstd compression level, from 1 to 22 (default 3).
+                                        Requires MySQL client 8.0.18 or later. *)
 
 (**
   Initialize library (in particular initializes default character set for {!escape} NB it is recommended to always use {!real_escape})
-  NB init is called automatically when db handle is created
+  NB init is called automatically when the module is loaded
 *)
 val init : unit -> unit
 
@@ -87,6 +103,20 @@ val init : unit -> unit
 *)
 val connect : ?options:db_option list -> db -> dbd
 
+(** [connect_many ?options db n] opens [n] connections to [db] concurrently.
+    When TLS is used, the first connection is opened alone and the others resume
+    its TLS session (see {!tls_session}), unless [options] has [OPT_SSL_SESSION].
+    Either all the connections are opened or {!Error} is raised. Not supported on Windows. *)
+val connect_many : ?options:db_option list -> db -> int -> dbd array
+
+(** [tls_session dbd] returns the TLS session of [dbd], to be passed as [OPT_SSL_SESSION]
+    to connections to the same server. [None] if [dbd] does not use TLS or the client
+    library does not support resumption (MySQL 8.0.29 and later do). *)
+val tls_session : dbd -> tls_session option
+
+(** [tls_session_reused dbd] tells whether [dbd] resumed a TLS session *)
+val tls_session_reused : dbd -> bool
+
 (** Shortcut for connecting to a database with mostly default field values *)
 val quick_connect: ?options:db_option list -> ?host:string -> ?database:string -> ?port:int -> ?password:string -> ?user:string -> ?socket:string -> unit -> dbd
 
@@ -157,6 +187,20 @@ val errno  : dbd -> error_code
    failed *)
 val errmsg : dbd -> string option
 
+(** {2 Compression} *)
+
+(** Protocol compression of a connection, as reported by the server *)
+type compression = {
+  algorithm : string option; (** Negotiated algorithm, [None] if uncompressed *)
+  level : int option; (** Compression level, if reported *)
+  bytes_sent : int64; (** Bytes sent to the server on this connection, after compression *)
+  bytes_received : int64; (** Bytes received from the server on this connection, after compression *)
+}
+
+(** [compression dbd] queries the compression status of [dbd] with [SHOW SESSION STATUS].
+    Compare the byte counts of the same work with and without compression to measure its effect. *)
+val compression : dbd -> compression
+
 (** {1 Queries} *)
 
 (** {2 Making a query} *)
@@ -165,8 +209,66 @@ val errmsg : dbd -> string option
 type result
 
 (** [exec dbd str] executes a SQL statement and returns a handle to obtain 
-   the result. Check [status] for errors! *) 
-val exec : dbd -> string -> result
+   the result. Check [status] for errors!
+
+   @param timeout deadline in seconds for the query and the transfer of its result.
+   When it expires the query is killed on the server with [KILL QUERY] issued over
+   a separate connection (opened with the same host, user, password and TLS options),
+   [exec] raises {!Error} and [dbd] stays usable. [0.] means no deadline.
+   Not supported on Windows.
+   @raise Invalid_argument if [timeout] is negative or NaN *) 
+val exec : ?timeout:float -> dbd -> string -> result
+
+(** [exec_spill dbd str] is the same as {!exec} but the rows are streamed from the
+   server into a temporary file which is then mapped in memory, so that results larger
+   than the available memory can be traversed and seeked in. The file is removed
+   when the result is freed or collected. Not supported on Windows.
+
+   @param dir directory of the temporary file, default is [Filename.get_temp_dir_name ()] *)
+val exec_spill : ?dir:string -> dbd -> string -> result
+
+(** {2 Transactions} *)
+
+(** [autocommit dbd on] switches autocommit mode on or off, with [mysql_autocommit] *)
+val autocommit : dbd -> bool -> unit
+
+(** [commit dbd] commits the current transaction, with [mysql_commit] *)
+val commit : dbd -> unit
+
+(** [rollback dbd] rolls back the current transaction, with [mysql_rollback] *)
+val rollback : dbd -> unit
+
+(** [in_transaction dbd] is true when the last response of the server reported an
+    open transaction or autocommit off *)
+val in_transaction : dbd -> bool
+
+(** Transaction isolation levels *)
+type isolation = Read_uncommitted | Read_committed | Repeatable_read | Serializable
+
+(** [with_transaction dbd f] runs [f dbd] in a transaction, committed when [f] returns
+    and rolled back when it raises. Autocommit is switched off for the transaction and
+    back on afterwards.
+    @param isolation isolation level of the transaction, default is the session one
+    @param read_only start the transaction with [START TRANSACTION READ ONLY]
+    @param retries number of times [f] is run again when the transaction is
+    rolled back because of a deadlock (default 3)
+    @raise Invalid_argument if a transaction is already open on [dbd] or autocommit
+    is off, see {!with_savepoint} for nesting *)
+val with_transaction : ?isolation:isolation -> ?read_only:bool -> ?retries:int -> dbd -> (dbd -> 'a) -> 'a
+
+(** [savepoint dbd name] sets a savepoint in the current transaction *)
+val savepoint : dbd -> string -> unit
+
+(** [rollback_to dbd name] rolls back the current transaction to savepoint [name] *)
+val rollback_to : dbd -> string -> unit
+
+(** [release_savepoint dbd name] removes savepoint [name] *)
+val release_savepoint : dbd -> string -> unit
+
+(** [with_savepoint dbd name f] runs [f ()] after setting savepoint [name],
+    rolling back to it if [f] raises. After a deadlock the whole transaction is
+    already rolled back by the server: the error is raised as is. *)
+val with_savepoint : dbd -> string -> (unit -> 'a) -> 'a
 
 (** {2 Getting the results of a query} *)
 
@@ -178,15 +280,28 @@ val exec : dbd -> string -> result
 val fetch : result -> string option array option
 
 (** [to_row result row] sets the current row.
+  The first seek builds an index of the rows, later seeks take constant time.
 
 @raise Invalid_argument if the row is out of range.
 *)
 val to_row : result -> int64 -> unit 
 
+(** [get_row result row] returns the row at position [row] (starting from 0),
+  the current row is not changed.
+
+@raise Invalid_argument if the row is out of range.
+*)
+val get_row : result -> int64 -> string option array
+
 (** [size result] returns the size of the actual result set (number of 
    rows) *)
 val size : result -> int64
 
+(** [free result] releases the memory held by [result] immediately instead of
+   waiting for the garbage collector. Any further use of [result] raises {!Error}.
+   @raise Error while another thread is running {!export} on [result] *)
+val free : result -> unit
+
 (** [iter result f] applies f to each row of result in turn, starting
    from the first. iter_col applies f to the value of the named column
    in every row.
@@ -206,9 +321,70 @@ val map : result -> f:(string option array -> 'a) -> 'a list
 val map_col : result -> key:string -> f:(string option -> 'a) -> 'a list
 val map_cols : result -> key:string array -> f:(string option array -> 'a) -> 'a list
 
+(** [parallel_map result ~domains ~f] applies [f] to all the rows of [result]
+   using [domains] domains (including the calling one) and returns the results
+   in the order of the rows. Rows are decoded in parallel as well, [f] must be
+   safe to run in parallel. The current row is not changed and values are never
+   interned. [result] must not be freed meanwhile. Before OCaml 5 the domains are
+   threads, which give the same results without running in parallel.
+   @raise Invalid_argument if [domains] is less than 1 *)
+val parallel_map : result -> domains:int -> f:(string option array -> 'a) -> 'a array
+
+(** Output formats of {!export} *)
+type export_format =
+  | Csv (** RFC 4180 with LF line ends, NULL is an empty field and the empty string [""] *)
+  | Tsv (** As [SELECT ... INTO OUTFILE]: tab separated, backslash escapes, NULL is [\N] *)
+  | Json (** One object per line, numeric columns are JSON numbers, other values JSON strings
+             with their bytes as is (binary data is not valid UTF-8) *)
+
+(** [export result format oc] writes all the rows of [result] to [oc] and returns their number.
+    The rows are formatted in C straight from the result into a large buffer, written
+    with few [write] calls to the file descriptor of [oc] (flushed before) without
+    holding the runtime. Use [Unix.out_channel_of_descr] to export to a file descriptor.
+    The position of {!fetch} is not changed.
+    @param header output the column names first (CSV and TSV), default true
+    @raise Error if writing fails *)
+val export : ?header:bool -> result -> export_format -> out_channel -> int64
+
 (** Returns one field of a result row based on column name. *)
 val column : result -> key:string -> row:string option array -> string option
 
+(** Rows read in place from the memory of the result, only the columns
+    actually accessed are copied. This is cheaper than {!fetch} when only
+    a few columns of wide rows are used. A row keeps its result alive,
+    accessing it after {!free} raises {!Error}. Columns are numbered from 0,
+    see {!column_index} to get them by name.
+    Accessors raise [Invalid_argument] if the column is out of range. *)
+module Row : sig
+
+(** Row of a result *)
+type t
+
+(** [fetch result] returns the next row, like {!Mysql.fetch} *)
+val fetch : result -> t option
+
+(** [get result row] returns the row at position [row], like {!Mysql.get_row}
+@raise Invalid_argument if the row is out of range. *)
+val get : result -> int64 -> t
+
+(** [is_null row i] tells whether column [i] is NULL *)
+val is_null : t -> int -> bool
+
+(** [length row i] returns the length in bytes of column [i], 0 for NULL *)
+val length : t -> int -> int
+
+(** [get_string row i] returns the value of column [i], [None] for NULL *)
+val get_string : t -> int -> string option
+
+(** [get_int row i] parses the value of column [i] without copying it, [None] for NULL.
+@raise Failure if the value is not an integer in the range of [int] *)
+val get_int : t -> int -> int option
+
+(** [to_array row] copies all the columns, as returned by {!Mysql.fetch} *)
+val to_array : t -> string option array
+
+end
+
 (** {2 Metainformation about a result set} *)
 
 (** The type of a database field. Each of these represents one or more MySQL data types. *)
@@ -260,6 +436,30 @@ val names : result -> string array
 (** [types result] returns an array with the MySQL types of the current result *)
 val types : result -> dbty array
 
+(** Description of all the columns of a result *)
+type meta = private {
+  col_names : string array; (** Names of the columns *)
+  col_types : dbty array; (** Types of the columns *)
+  col_flags : int array; (** Flags of the columns *)
+  col_index : (string, int) Hashtbl.t; (** Maps column names to positions *)
+}
+
+(** [metadata result] returns the description of the columns of [result].
+  It is computed on the first call and cached in [result]. *)
+val metadata : result -> meta
+
+(** [column_index meta name] returns the position of the column [name].
+@raise Not_found if there is no such column *)
+val column_index : meta -> string -> int
+
+(** [intern ?columns result] makes the following fetches from [result] share
+  equal values of the given columns instead of allocating a new string for each row.
+  Up to 256 distinct values of at most 255 bytes are shared per column, the others
+  are allocated as usual. This reduces memory use when keeping many rows of low
+  cardinality columns. Applies to {!fetch}, {!get_row} and {!Row}.
+@param columns positions of the columns, default is all the ENUM and SET columns *)
+val intern : ?columns:int list -> result -> unit
+
 (** Returns the information on the next field *)
 val fetch_field : result -> field option 
 
@@ -364,6 +564,103 @@ val ml2timestampl   : year:int -> month:int -> day:int -> hour:int -> min:int ->
   SQL `insert ... values ( .. )' statements *)
 val values          : string list -> string
 
+(** {1 Row decoders} *)
+
+(** Decoders build OCaml values from rows. A decoder is compiled against the
+    description of the columns of a result or statement: column names are resolved
+    to positions and their types checked once, rows are then decoded by position.
+
+{[
+type user = { id : int; name : string; email : string option }
+
+let user = Decoder.(
+  let+ id = field "id" int
+  and+ name = field "name" string
+  and+ email = field_opt "email" string in
+  { id; name; email })
+
+let users = Decoder.all user (exec dbd "select id, name, email from users")
+]}
+
+    Errors in the schema (missing column, unexpected type) raise {!Error} when
+    the decoder is compiled, errors in the data raise {!Error} naming the column. *)
+module Decoder : sig
+
+(** Parser of a column value, with the column types it accepts *)
+type 'a column
+
+(** Decoder of rows *)
+type 'a t
+
+(** [custom ?types parse] accepts the columns of [types] (default: any type) *)
+val custom : ?types:dbty list -> (string -> 'a) -> 'a column
+
+val string : string column (** any type *)
+val int : int column (** also [BIGINT], failing on overflow *)
+val int64 : int64 column
+val float : float column
+val decimal : string column
+val bool : bool column (** non-zero integer *)
+val blob : string column
+val date : (int * int * int) column
+val time : (int * int * int) column
+val datetime : (int * int * int * int * int * int) column (** DATETIME and TIMESTAMP *)
+val enum : string column
+val set : string list column
+
+(** [field name c] decodes column [name], which must not be NULL *)
+val field : string -> 'a column -> 'a t
+
+(** [field_opt name c] decodes column [name], [None] for NULL *)
+val field_opt : string -> 'a column -> 'a option t
+
+val return : 'a -> 'a t
+val map : ('a -> 'b) -> 'a t -> 'b t
+val both : 'a t -> 'b t -> ('a * 'b) t
+val ( let+ ) : 'a t -> ('a -> 'b) -> 'b t
+val ( and+ ) : 'a t -> 'b t -> ('a * 'b) t
+
+(** [compile d meta] checks [d] against [meta] (see {!metadata} and {!Prepared.metadata})
+    and returns the function decoding rows *)
+val compile : 'a t -> meta -> string option array -> 'a
+
+(** [all d result] decodes all the rows of [result] *)
+val all : 'a t -> result -> 'a list
+
+end
+
+(** {1 Snapshots} *)
+
+(** Results saved in a compact binary form with their fields description,
+    to be loaded back later without a connection. A loaded snapshot is an
+    ordinary {!result}: {!fetch}, {!column}, {!Row}, {!metadata}, {!fetch_fields} etc.
+    work as on the original result (which is not modified by saving it).
+    Results can also be marshalled, they are read back as snapshots.
+
+    The format depends on the architecture and is meant for caches, not for
+    exchange. Loaded snapshots are checked to stay within their buffer,
+    except those of {!map_file} of which only the structure is checked. *)
+module Snapshot : sig
+
+(** [to_bytes result] returns the snapshot of all the rows of [result] *)
+val to_bytes : result -> bytes
+
+(** Load a snapshot, its content is copied.
+@raise Error if it is not a valid snapshot *)
+val of_bytes : bytes -> result
+
+(** [save result path] writes the snapshot of [result] to the file [path],
+    replaced atomically: results mapped from the previous file stay valid *)
+val save : result -> string -> unit
+
+(** [map_file path] maps the snapshot stored in file [path] into memory,
+    rows are only read from the file when accessed, and are not checked: a
+    corrupted file can make {!fetch} read out of bounds. Not supported on Windows.
+@raise Error if the file cannot be read or is not a valid snapshot *)
+val map_file : string -> result
+
+end
+
 (** {1 Prepared statements} *)
 
 (** Prepared statements with parameters. Consult the MySQL manual for detailed description 
@@ -381,11 +678,28 @@ type stmt_result
     can be reused many times during the lifetime of the connection. *)
 val create : dbd -> string -> stmt
 
-(** Execute the prepared statement with the specified values for parameters. *)
-val execute : stmt -> string array -> stmt_result
+(** Execute the prepared statement with the specified values for parameters.
+    @param timeout deadline in seconds for the execution, see {!Mysql.exec}.
+    Fetching of the rows is not covered. *)
+val execute : ?timeout:float -> stmt -> string array -> stmt_result
 
 (** Same as {!execute}, but with support for NULL values. *)
-val execute_null : stmt -> string option array -> stmt_result
+val execute_null : ?timeout:float -> stmt -> string option array -> stmt_result
+
+(** Parameter of {!execute_params} *)
+type param =
+  | Null
+  | Value of string
+  | Stream of (unit -> (bytes * int) option)
+      (** called until it returns [None], each [Some (buf, len)] sends the first [len] bytes of [buf] *)
+  | Channel of in_channel (** read until end of file *)
+
+(** Same as {!execute}, but [Stream] and [Channel] parameters are sent to the server
+    in chunks with [mysql_stmt_send_long_data] before the statement is executed,
+    so large BLOB and TEXT values are uploaded with constant memory.
+    [chunk_size] (default 64k) is the size of the reads from [Channel] parameters.
+    Exceptions raised by a [Stream] producer are propagated and the statement is reset. *)
+val execute_params : ?timeout:float -> ?chunk_size:int -> stmt -> param array -> stmt_result
 
 (** @return Number of rows affected by the last execution of this statement. *)
 val affected : stmt -> int64
@@ -399,10 +713,448 @@ val real_status : stmt -> int
 (** @return the next row of the result set. *)
 val fetch : stmt_result -> string option array option
 
+(** [query_one stmt params] executes the statement and returns its first row, if any.
+    The remaining rows are discarded. This is faster than {!execute} followed by {!fetch}
+    for point lookups: everything is done in a single call and no result is allocated. *)
+val query_one : stmt -> string array -> string option array option
+
+(** Same as {!query_one}, but with support for NULL values. *)
+val query_one_null : stmt -> string option array -> string option array option
+
+(** [query_one_as d stmt params] is {!query_one} with the row decoded by [d],
+    checked against the statement's {!metadata}. *)
+val query_one_as : 'a Decoder.t -> stmt -> string option array -> 'a option
+
+(** Release the result set and discard the rows not fetched yet.
+    Must be called before the statement is closed. Any further use of the result raises {!Error}. *)
+val free_result : stmt_result -> unit
+
+(** [store_result r] fetches the remaining rows of [r] into an ordinary {!Mysql.result}
+    and releases [r]. *)
+val store_result : stmt_result -> result
+
+(** [next r] fetches the next row of [r] without copying its columns,
+    which are then read with {!column} or {!stream_column}.
+    @return false when there are no more rows *)
+val next : stmt_result -> bool
+
+(** [column r i] is the [i]th column of the row fetched by {!next} or {!fetch} *)
+val column : stmt_result -> int -> string option
+
+(** [stream_column ?chunk_size r i f] passes the [i]th column of the current row to [f]
+    in pieces of at most [chunk_size] bytes (default 64k), as [f buf len] with the data
+    in the first [len] bytes of [buf]. The same [buf] is reused for every piece and must
+    not be kept after [f] returns. Large BLOB and TEXT values are read this way without
+    building an OCaml string of their full size.
+    @return false if the column is NULL, [f] is not called then *)
+val stream_column : ?chunk_size:int -> stmt_result -> int -> (bytes -> int -> unit) -> bool
+
+(** [output_column ?chunk_size r i oc] writes the [i]th column of the current row to [oc]
+    with {!stream_column}. Use [Unix.out_channel_of_descr] to write to a file descriptor.
+    @return false if the column is NULL *)
+val output_column : ?chunk_size:int -> stmt_result -> int -> out_channel -> bool
+
+(** Same as {!Mysql.export}, for the remaining rows of a statement result *)
+val export : ?header:bool -> stmt_result -> export_format -> out_channel -> int64
+
 (** @return metadata on the statement's result set. *)
 val result_metadata : stmt -> result
 
+(** Description of the columns of the statement's result set,
+    computed on the first call and cached in the statement. *)
+val metadata : stmt -> meta
+
+(** Same as {!Mysql.intern}, for the results of the following executions of the statement
+    and for {!query_one}. The shared values are kept in the statement across executions. *)
+val intern : ?columns:int list -> stmt -> unit
+
 (** Destroy the prepared statement *)
 val close : stmt -> unit
 
 end
+
+(** {1 Batched key lookups} *)
+
+(** Rows of a table for many keys, with [SELECT ... WHERE key IN (?, ...)]
+    executed by chunks of keys. Chunks are padded to a power of two so that few
+    statements are prepared, and bounded by [chunk_size] keys and, padding
+    included, by half of [max_allowed_packet]; statements are kept for the
+    following lookups. *)
+module Lookup : sig
+
+(** Lookup *)
+type t
+
+(** [create conns ~table ~key] returns a lookup of the rows of [table] by [key].
+    With several connections chunks are executed in parallel, one domain per
+    connection (one thread before OCaml 5). The connections must not be used meanwhile.
+    @param chunk_size maximum number of keys per statement (default 1000)
+    @param columns columns returned (default all the columns of [table])
+    @raise Invalid_argument if [conns] is empty or [chunk_size] is less than 1 *)
+val create : ?chunk_size:int -> ?columns:string list -> dbd array -> table:string -> key:string -> t
+
+(** [iter t keys ~f] calls [f key row] for each row matching one of [keys], with
+    the key as returned by the server and the selected columns. Rows come by chunk,
+    in no particular order, and duplicate keys are looked up once. [f] is called
+    by one domain at a time and must not use the connections. *)
+val iter : t -> string list -> f:(string -> string option array -> unit) -> unit
+
+(** Close the prepared statements *)
+val close : t -> unit
+
+end
+
+(** Same as {!Lookup.iter}, on one connection and without keeping the statements *)
+val lookup_many : ?chunk_size:int -> ?columns:string list -> dbd -> table:string -> key:string ->
+  string list -> f:(string -> string option array -> unit) -> unit
+
+(** {1 Result cache} *)
+
+(** In-process cache of query results. Entries are snapshots (see {!Snapshot}) keyed on
+    the SQL text with whitespace normalized (plus the parameters for prepared statements).
+    Every hit returns its own copy, usable with {!fetch}, {!iter}, {!map} etc.
+    A cache can be shared between domains. *)
+module Cache : sig
+
+(** Result cache *)
+type t
+
+(** Counters of a cache *)
+type stats = {
+  hits : int;
+  misses : int;
+  expired : int; (** Misses on expired entries *)
+  evictions : int; (** Entries dropped to stay within [max_bytes] *)
+  invalidations : int; (** Entries dropped by {!invalidate} and {!clear} *)
+  entries : int; (** Current number of entries *)
+  bytes : int; (** Current size of the entries *)
+}
+
+(** [create ()] makes an empty cache.
+    @param ttl default lifetime of the entries in seconds, default 60
+    @param max_bytes total size of the entries above which the least recently
+    used ones are evicted, default 64MB *)
+val create : ?ttl:float -> ?max_bytes:int -> unit -> t
+
+(** [exec cache dbd sql] returns the cached result of [sql], or executes it with
+    {!Mysql.exec} and caches the result. Statements without a result set
+    ([UPDATE], [INSERT]...) are executed every time and never cached.
+    @param ttl lifetime of the entry, default is the one of the cache
+    @param tags names (typically the tables read) under which the entry can be invalidated
+    @param namespace part of the key besides [sql], default is the user, server
+    and current database of [dbd] (as changed by {!Mysql.select_db}) *)
+val exec : t -> ?ttl:float -> ?tags:string list -> ?namespace:string -> dbd -> string -> result
+
+(** Same as {!exec} for a prepared statement and its parameters,
+    using {!Prepared.execute_null} and {!Prepared.store_result} on a miss.
+    @raise Invalid_argument if the statement has no result set *)
+val execute : t -> ?ttl:float -> ?tags:string list -> ?namespace:string -> Prepared.stmt -> string option array -> result
+
+(** [invalidate cache tag] drops all the entries tagged with [tag],
+    to be called when the data they were read from changes *)
+val invalidate : t -> string -> unit
+
+(** Drop all the entries *)
+val clear : t -> unit
+
+val stats : t -> stats
+
+end
+
+(** {1 Bulk inserts} *)
+
+(** Buffered writer turning rows into multi-row [INSERT] statements.
+    Rows are queued and written by a background thread with its own connection,
+    each statement being capped by the server [max_allowed_packet].
+    Not supported on Windows. *)
+module Bulk_writer : sig
+
+(** Bulk writer *)
+type t
+
+(** Statistics of a writer *)
+type stats = {
+  flushes : int; (** Statements executed *)
+  rows : int; (** Rows written *)
+  failed : int; (** Rows lost in failed statements *)
+  last_rows : int; (** Rows in the last statement *)
+  last_latency : float; (** Duration of the last statement in seconds *)
+  total_latency : float; (** Duration of all the statements in seconds *)
+  queued : int; (** Bytes of rows waiting to be written *)
+}
+
+(** [create db ~table ~columns] connects to [db] and starts a writer inserting into [columns] of [table]
+    ([table] or [db.table]). The connection character set cannot be big5, cp932, gbk, gb18030 or sjis.
+    @param options connection options, see {!Mysql.connect}
+    @param max_rows maximum number of rows in one statement, default 1000
+    @param max_bytes maximum size of one statement, default (and upper bound) is the server [max_allowed_packet]
+    @param interval maximum delay in seconds before a queued row is written, default 1.0
+    @param max_queue size in bytes of the queued rows above which {!add} blocks, default 16MB
+    @param on_duplicate appended to the statements as [ON DUPLICATE KEY UPDATE on_duplicate] to make upserts *)
+val create : ?options:db_option list -> ?max_rows:int -> ?max_bytes:int -> ?interval:float -> ?max_queue:int ->
+  ?on_duplicate:string -> db -> table:string -> columns:string array -> t
+
+(** [add writer row] queues a row, [None] values are inserted as NULL.
+    Blocks while the queue is full.
+    @raise Error if a previous statement failed (once per failed statement) *)
+val add : t -> string option array -> unit
+
+(** Wait until all the rows queued so far are written.
+    @raise Error if a previous statement failed *)
+val flush : t -> unit
+
+(** Write the queued rows and release the writer.
+    @raise Error if a statement failed and was not reported yet *)
+val close : t -> unit
+
+(** Current statistics of the writer *)
+val stats : t -> stats
+
+end
+
+(** {1 Group commit} *)
+
+(** Small writes from several threads or domains coalesced into one transaction,
+    so that they share the cost of the commit. The first writer to find no
+    transaction in progress runs all the pending writes (up to [max_batch]) in
+    one transaction, the others wait for it; writes submitted meanwhile go in
+    the next transaction. Each write runs under a savepoint, a failing write
+    is rolled back alone. *)
+module Group_commit : sig
+
+(** Group of writes on one connection *)
+type t
+
+(** [create dbd] returns a group writing on [dbd], which must not be used otherwise
+    while the group is.
+    @param window seconds the first writer waits for others to join its transaction (default 0.)
+    @param max_batch maximum number of writes in a transaction (default 1000)
+    @param retries see {!Mysql.with_transaction} *)
+val create : ?window:float -> ?max_batch:int -> ?retries:int -> dbd -> t
+
+(** [submit g write] runs [write dbd] in the next transaction of [g] and returns once
+    it is committed. Writes may be run again if the transaction hits a deadlock,
+    and must use {!Mysql.with_savepoint} rather than {!Mysql.with_transaction}.
+    @raise exn the exception raised by [write], or the failure of the commit *)
+val submit : t -> (dbd -> unit) -> unit
+
+(** Statistics of a group *)
+type stats = { transactions : int; (** Transactions run *)
+               writes : int; (** Writes submitted in them *)
+             }
+
+val stats : t -> stats
+
+end
+
+(** {1 Read/write splitting} *)
+
+(** Routing of queries between a primary server and its replicas. Writes and
+    transactions go to the primary, read-only queries to the replica with the
+    lowest latency among those lagging by at most [max_lag] seconds, or to the
+    primary when there is none. Replicas are probed with [SHOW REPLICA STATUS]
+    every [refresh_interval] seconds on use.
+
+    Reads see the previous writes made through the router: after a write the
+    GTID set of the primary is read once, and a replica which is not known to
+    have applied it is waited for with [WAIT_FOR_EXECUTED_GTID_SET] (MySQL) or
+    [MASTER_GTID_WAIT] (MariaDB) for at most [wait_timeout] seconds before
+    falling back to the primary. GTID based replication is needed for this.
+
+    A router holds one connection per server, opened on first use, and must be
+    used by one thread at a time. *)
+module Router : sig
+
+(** Router *)
+type t
+
+(** [create ~primary ~replicas ()] returns a router, no connection is opened yet.
+    @param options connection options of all the servers
+    @param max_lag maximum replication lag of the replicas used, in seconds (default 5.)
+    @param refresh_interval seconds between probes of the replicas (default 1.)
+    @param wait_timeout seconds to wait for a replica to catch up (default 1.) *)
+val create : ?options:db_option list -> ?max_lag:float -> ?refresh_interval:float -> ?wait_timeout:float ->
+  primary:db -> replicas:db list -> unit -> t
+
+(** Connection to the primary *)
+val primary : t -> dbd
+
+(** [is_read sql] tells whether [sql] can run on a replica: [SELECT] without
+    locking clauses, [INTO], variables ([@v], [@@v]) or functions depending on
+    the session ([LAST_INSERT_ID], [FOUND_ROWS], [ROW_COUNT], [CONNECTION_ID],
+    [GET_LOCK] and the other lock functions), [SHOW], [DESCRIBE] and [EXPLAIN] *)
+val is_read : string -> bool
+
+(** [exec t sql] executes [sql] on a replica if {!is_read}, on the primary otherwise.
+    Once a temporary table was created with [exec], all the queries go to the primary.
+    @param consistent see {!read} *)
+val exec : ?consistent:bool -> t -> string -> result
+
+(** [read t f] runs [f] on the connection to a replica, or to the primary inside
+    {!with_transaction} or after a temporary table was created. [f] must not depend on
+    the session state of the primary (see {!is_read}).
+    [f] is run again on the primary if the replica connection is lost.
+    @param consistent wait for the replica to apply the previous writes (default true) *)
+val read : ?consistent:bool -> t -> (dbd -> 'a) -> 'a
+
+(** [write t f] runs [f] on the connection to the primary *)
+val write : t -> (dbd -> 'a) -> 'a
+
+(** Same as {!Mysql.with_transaction}, on the primary. Queries made with {!exec}
+    and {!read} while [f] runs go to the primary too. *)
+val with_transaction : ?isolation:isolation -> ?read_only:bool -> ?retries:int -> t -> (dbd -> 'a) -> 'a
+
+(** Probe the replicas now *)
+val refresh : t -> unit
+
+(** Close all the connections *)
+val close : t -> unit
+
+end
+
+(** {1 Reconnection} *)
+
+(** Connection which is opened again when the server goes away (client errors
+    2006, 2013, 2055 and 4031), with exponential backoff and random jitter
+    between the attempts. The new connection gets the database selected with
+    {!select_db}, the character set and the init commands; statements created
+    with {!prepare} are prepared again on first use.
+
+    Operations failing with a lost connection are retried when idempotent,
+    otherwise the error is raised and the next operation reconnects. [OPT_RECONNECT]
+    is ignored. Must be used by one thread at a time.
+
+    A connection lost while a transaction is open (or autocommit is off) is never
+    retried, the transaction being rolled back by the server. The following
+    operations raise {!Error} instead of running outside of the transaction, until
+    the {!with_transaction} it happened in returns or {!close} is called. *)
+module Resilient : sig
+
+(** Connection *)
+type t
+
+(** Prepared statement *)
+type stmt
+
+(** [create db] returns a connection, opened on first use.
+    @param options connection options
+    @param charset character set, see {!Mysql.set_charset}
+    @param init statements executed on each new connection
+    @param retries attempts to reconnect and to run an idempotent operation again (default 3)
+    @param backoff maximum delay before the first attempt to reconnect, in seconds (default 0.1),
+    doubling with each attempt
+    @param max_backoff upper bound of the delay (default 10.) *)
+val create : ?options:db_option list -> ?charset:string -> ?init:string list ->
+  ?retries:int -> ?backoff:float -> ?max_backoff:float -> db -> t
+
+(** Current connection, reconnecting if needed. It must not be kept across
+    operations of [t]. *)
+val connection : t -> dbd
+
+(** [run t f] runs [f] on the connection.
+    @param idempotent run [f] again on a new connection if it was lost (default false) *)
+val run : ?idempotent:bool -> t -> (dbd -> 'a) -> 'a
+
+(** Same as {!Mysql.with_transaction}, on the current connection. The connection
+    is dropped if it is lost, and the transaction is not run again then. *)
+val with_transaction : ?isolation:isolation -> ?read_only:bool -> ?retries:int -> t -> (dbd -> 'a) -> 'a
+
+(** Same as {!Mysql.exec}. Queries are idempotent by default if {!Router.is_read}. *)
+val exec : ?idempotent:bool -> t -> string -> result
+
+(** Same as {!Mysql.select_db}, remembered for the next connections *)
+val select_db : t -> string -> unit
+
+(** Same as {!Mysql.set_charset}, remembered for the next connections *)
+val set_charset : t -> string -> unit
+
+(** Prepare a statement. Statements are idempotent by default if {!Router.is_read}. *)
+val prepare : t -> string -> stmt
+
+(** [with_stmt s f] runs [f] on the statement, prepared on the current connection.
+    Rows fetched in [f] are covered by the retries, unlike those fetched from the
+    result of {!execute}. *)
+val with_stmt : ?idempotent:bool -> stmt -> (Prepared.stmt -> 'a) -> 'a
+
+(** Same as {!Prepared.execute} *)
+val execute : ?idempotent:bool -> ?timeout:float -> stmt -> string array -> Prepared.stmt_result
+
+(** Same as {!Prepared.execute_null} *)
+val execute_null : ?idempotent:bool -> ?timeout:float -> stmt -> string option array -> Prepared.stmt_result
+
+(** Close the statement, it is prepared again if used *)
+val close_stmt : stmt -> unit
+
+(** Number of reconnections so far *)
+val reconnects : t -> int
+
+(** Close the connection, it is opened again if used, even after it was lost
+    in a transaction *)
+val close : t -> unit
+
+end
+
+(** {1 Replication stream} *)
+
+(** Change data capture from the binary log: the connection registers as a replica
+    and receives the events of the primary as they are written. Rows events need
+    [binlog_format=ROW] (and [binlog_row_image=FULL] to get all the columns).
+    Requires the MySQL client library, 5.7 or later, and the [REPLICATION SLAVE]
+    privilege (plus [REPLICATION CLIENT] to start at the current position).
+
+    Column values are strings in the format of the text protocol, as returned by
+    {!fetch}, with these exceptions: [TIMESTAMP] columns are seconds since the epoch,
+    [ENUM] and [SET] columns are the index and the bitmap of the values, [JSON]
+    columns are in the binary format of the server, integers are signed.
+    Columns missing from the row image are [None], as NULL. *)
+module Binlog : sig
+
+(** Table of a rows event *)
+type table = private {
+  table_id : int;
+  schema : string;
+  name : string;
+  types : int array; (** Column types, see [enum_field_types] in [mysql_com.h] *)
+  meta : int array; (** Type specific metadata of the columns *)
+}
+
+type event =
+  | Rotate of string * int64 (** The stream continues in this file, at this position *)
+  | Gtid of string (** Start of transaction [uuid:number] *)
+  | Query of string * string (** Default schema and statement: DDL, [BEGIN]... *)
+  | Xid of int64 (** Commit of a transaction *)
+  | Table_map of table (** Description of the table of the following rows events *)
+  | Insert of table * string option array list
+  | Update of table * (string option array * string option array) list (** rows before and after *)
+  | Delete of table * string option array list
+  | Heartbeat (** Sent by the server when there are no events, see [heartbeat] *)
+  | Other of int (** Event of another type *)
+
+(** Replication stream *)
+type t
+
+(** [connect ~server_id dbd] starts streaming the binary log on [dbd], which can be used
+    for nothing else until {!close}.
+    @param start binary log file and position to start from, default is the current
+    position of the server. Use a {!position} saved after an [Xid] event to resume.
+    @param heartbeat interval in seconds of [Heartbeat] events when idle
+    @param server_id must differ from the ids of the server and its other replicas *)
+val connect : ?start:string * int64 -> ?heartbeat:float -> server_id:int -> dbd -> t
+
+(** [next t] waits for the next event, [None] when the server ends the stream
+    @raise Error if the connection fails *)
+val next : t -> event option
+
+(** [iter t ~f] applies [f] to the events until the server ends the stream *)
+val iter : t -> f:(event -> unit) -> unit
+
+(** Binary log file and position following the last event *)
+val position : t -> string * int64
+
+(** Last GTID seen *)
+val gtid : t -> string option
+
+(** Stop the stream *)
+val close : t -> unit
+
+end
@@ -6,6 +6,18 @@
 #include <stdio.h>              /* sprintf */
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>                 /* _write */
+#define write _write
+#endif
 
 /* OCaml runtime system */
 #define CAML_NAME_SPACE
@@ -16,6 +28,11 @@
 #include <caml/callback.h>
 #include <caml/custom.h>
 #include <caml/signals.h>
+#include <caml/version.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -41,6 +58,31 @@
 
 #define EXTERNAL                /* dummy to highlight fn's exported to ML */
 
+typedef struct store_tag
+{
+  char *mem;                    /* memory holding the rows (NULL if empty) */
+  size_t size;
+  int mapped;                   /* mem is mapped, else allocated with malloc */
+  const char *data;             /* first row */
+  const uint64_t *index;        /* offset of each row from data */
+  uint64_t rows;
+  unsigned int fields;
+  MYSQL_FIELD *defs;            /* fields of snapshots (NULL for spilled results) */
+  unsigned int field_cursor;    /* for fetch_field on snapshots */
+  uint64_t cursor;              /* next row returned by fetch */
+  char **cells;                 /* current row for make_row */
+  unsigned long *lengths;
+} store_t;
+
+typedef struct res_tag
+{
+  MYSQL_RES *res;
+  int freed;
+  MYSQL_ROW_OFFSET *index;      /* row offsets, built on first seek */
+  store_t *store;               /* rows kept out of MYSQL_RES (or NULL) */
+  int busy;                     /* exports running outside the runtime lock */
+} res_t;
+
 #ifdef CAML_TEST_GC_SAFE
 #include <unistd.h>
 #define caml_enter_blocking_section() if (1) { caml_enter_blocking_section(); sleep(1); }
@@ -56,9 +98,35 @@
  *
  * res - result returned from query/exec
  *
- *      header with Final_tag
- *      0:      finalization function for 1
- *      1:      MYSQL_RES*
+ *      block with tag 0 (Mysql.result record)
+ *      0:      custom block holding res_t
+ *      1:      cached metadata (meta option), managed from OCaml
+ *      2:      intern tables (string array array), see intern_string
+ *
+ *      res_t:
+ *      res:    MYSQL_RES* (NULL if the statement returned no data)
+ *      freed:  set by Mysql.free, the block must not be used afterwards
+ *      index:  array of row offsets for constant time seeks (or NULL)
+ *      store:  rows spilled by Mysql.exec_spill, res then only describes
+ *              the fields, or rows of a snapshot, res is then NULL
+ *              (NULL for other results)
+ *      busy:   number of exports reading the rows in a blocking section,
+ *              Mysql.free fails while it is not 0
+ *
+ * stmt - prepared statement
+ *
+ *      block with tag 0 (Mysql.Prepared.stmt record)
+ *      0:      custom block holding MYSQL_STMT* (NULL when closed)
+ *      1:      cached metadata (meta option), managed from OCaml
+ *      2:      dbd the statement was prepared on
+ *      3:      intern tables (string array array), see intern_string
+ *      4:      SQL text of the statement
+ *
+ * stmt_result - result of a prepared statement execution
+ *
+ *      block with tag 0 (Mysql.Prepared.stmt_result record)
+ *      0:      custom block holding row_t* (NULL when freed)
+ *      1:      intern tables of the statement at execution time
  *
  */
 
@@ -66,10 +134,17 @@
 
 #define DBDmysql(x) ((MYSQL*)(Field(x,1)))
 #define DBDopen(x) (Field(x,2))
-#define RESval(x) (*(MYSQL_RES**)Data_custom_val(x))
-
-#define STMTval(x) (*(MYSQL_STMT**)Data_custom_val(x))
-#define ROWval(x) (*(row_t**)Data_custom_val(x))
+#define RES_handle(x) Field(x,0)
+#define RESval(x) ((res_t*)Data_custom_val(RES_handle(x)))
+#define RES_intern(x) Field(x,2)
+
+#define STMT_handle(x) Field(x,0)
+#define STMT_dbd(x) Field(x,2)
+#define STMTval(x) (*(MYSQL_STMT**)Data_custom_val(STMT_handle(x)))
+#define STMT_intern(x) Field(x,3)
+#define ROW_handle(x) Field(x,0)
+#define ROW_intern(x) Field(x,1)
+#define ROWval(x) (*(row_t**)Data_custom_val(ROW_handle(x)))
 
 static void mysqlfailwith(char *err) Noreturn;
 static void mysqlfailmsg(const char *fmt, ...) Noreturn;
@@ -153,6 +228,72 @@ val_str_option(const char* s, unsigned long length)
   }
 }
 
+/*
+ * intern_string -- returns a string equal to [s], shared with the
+ * previous calls when possible.  An intern table is a string array
+ * used as an open addressing hash table, the empty string marking a
+ * free slot.  When the probed slots are all taken by other values the
+ * string is allocated as usual, so a table never grows.
+ */
+
+#define INTERN_PROBES 8
+#define INTERN_MAX_LEN 255
+
+static value
+intern_string(value table, const char *s, unsigned long length)
+{
+  CAMLparam1(table);
+  CAMLlocal1(v);
+  mlsize_t size = Wosize_val(table);
+  unsigned int h = 2166136261u;   /* FNV-1a */
+  unsigned long i;
+  mlsize_t k, slot;
+
+  for (i = 0; i < length; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+
+  for (k = 0; k < INTERN_PROBES; k++)
+  {
+    slot = (h + k) % size;
+    v = Field(table, slot);
+    if (caml_string_length(v) == length && !memcmp(String_val(v), s, length))
+      CAMLreturn(v);
+    if (caml_string_length(v) == 0)
+      break;
+  }
+
+  v = caml_alloc_string(length);
+  memcpy(String_val(v), s, length);
+  if (k < INTERN_PROBES)
+    Store_field(table, slot, v);
+  CAMLreturn(v);
+}
+
+/* val_str_option_intern -- same as val_str_option for column [col],
+ * interning the value if [tables] has a table for this column.  Empty
+ * values and values longer than INTERN_MAX_LEN are not interned.
+ */
+
+static int
+interned(value tables, mlsize_t col, unsigned long length)
+{
+  return length > 0 && length <= INTERN_MAX_LEN &&
+    col < Wosize_val(tables) && Wosize_val(Field(tables, col)) > 0;
+}
+
+static value
+val_str_option_intern(value tables, mlsize_t col, const char* s, unsigned long length)
+{
+  CAMLparam1(tables);
+  CAMLlocal1(v);
+
+  if (!s || !interned(tables, col, length))
+    CAMLreturn(val_str_option(s, length));
+
+  v = intern_string(Field(tables, col), s, length);
+  CAMLreturn(Val_some(v));
+}
+
 /* check_db checks that the data base connection is still open.  The
  * open flag is reset by db_disconnect().
  */
@@ -191,24 +332,137 @@ static unsigned int ml_mysql_protocol_type[] = {
 #define SET_OPTION_BOOL(option) option_bool = Bool_val(v); SET_OPTION(option, &option_bool)
 #define SET_OPTION_INT(option) option_int = Int_val(v); SET_OPTION(option, &option_int)
 #define SET_OPTION_STR(option) SET_OPTION(option, String_val(v))
-#define SET_CLIENT_FLAG(flag) client_flag |= flag; break
+#define SET_CLIENT_FLAG(flag) *client_flag |= flag; break
+
+/* TLS session resumption, MySQL client library 8.0.29 and later */
+#if !defined(MARIADB_PACKAGE_VERSION_ID) && !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80029
+#define HAVE_SSL_SESSION_DATA 1
+#endif
+
+/* configurable protocol compression, MySQL client library 8.0.18 and later */
+#if !defined(MARIADB_PACKAGE_VERSION_ID) && !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80018
+#define SET_OPTION_COMPRESSION_ALGORITHMS() SET_OPTION_STR(OPT_COMPRESSION_ALGORITHMS)
+#define SET_OPTION_ZSTD_COMPRESSION_LEVEL() SET_OPTION_INT(OPT_ZSTD_COMPRESSION_LEVEL)
+#else
+#define SET_OPTION_COMPRESSION_ALGORITHMS() mysqlfailwith("Mysql.connect: OPT_COMPRESSION_ALGORITHMS is not supported by the client library")
+#define SET_OPTION_ZSTD_COMPRESSION_LEVEL() mysqlfailwith("Mysql.connect: OPT_ZSTD_COMPRESSION_LEVEL is not supported by the client library")
+#endif
+
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+#define SET_OPTION_TLS_VERSION() \
+  if (0 != mysql_options(init,MARIADB_OPT_TLS_VERSION,String_val(v))) mysqlfailwith("MARIADB_OPT_TLS_VERSION"); break
+#elif defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 50710
+#define SET_OPTION_TLS_VERSION() SET_OPTION_STR(OPT_TLS_VERSION)
+#else
+#define SET_OPTION_TLS_VERSION() mysqlfailwith("Mysql.connect: OPT_TLS_VERSION is not supported by the client library")
+#endif
+
+/*
+ * set_options applies a list of db_option to a handle returned by
+ * mysql_init, flags to pass to mysql_real_connect are or'ed into
+ * client_flag.
+ */
+
+static void
+set_options(MYSQL *init, value options, unsigned long *client_flag)
+{
+  CAMLparam1(options);
+  CAMLlocal1(v);
+  unsigned int option_int;
+  my_bool option_bool;
+
+  while (options != Val_emptylist)
+  {
+    if (Is_block(Field(options,0)))
+    {
+      v = Field(Field(options,0),0);
+      switch (Tag_val(Field(options,0)))
+      {
+        case  0: SET_OPTION_BOOL(OPT_LOCAL_INFILE);
+        case  1: SET_OPTION_BOOL(OPT_RECONNECT);
+        case  2: SET_OPTION_BOOL(OPT_SSL_VERIFY_SERVER_CERT);
+        case  3: SET_OPTION_BOOL(REPORT_DATA_TRUNCATION);
+        case  4: SET_OPTION_BOOL(SECURE_AUTH);
+        case  5: SET_OPTION(OPT_PROTOCOL, &ml_mysql_protocol_type[Int_val(v)]);
+        case  6: SET_OPTION_INT(OPT_CONNECT_TIMEOUT);
+        case  7: SET_OPTION_INT(OPT_READ_TIMEOUT);
+        case  8: SET_OPTION_INT(OPT_WRITE_TIMEOUT);
+        case  9: SET_OPTION_STR(INIT_COMMAND);
+        case 10: SET_OPTION_STR(READ_DEFAULT_FILE);
+        case 11: SET_OPTION_STR(READ_DEFAULT_GROUP);
+        case 12: SET_OPTION_STR(SET_CHARSET_DIR);
+        case 13: SET_OPTION_STR(SET_CHARSET_NAME);
+        case 14: SET_OPTION_STR(SHARED_MEMORY_BASE_NAME);
+        case 15: SET_OPTION_STR(OPT_SSL_CA);
+        case 16: SET_OPTION_STR(OPT_SSL_CAPATH);
+        case 17: SET_OPTION_STR(OPT_SSL_CERT);
+        case 18: SET_OPTION_STR(OPT_SSL_KEY);
+        case 19: SET_OPTION_STR(OPT_SSL_CIPHER);
+        case 20: SET_OPTION_TLS_VERSION();
+        case 21:
+#ifdef HAVE_SSL_SESSION_DATA
+          SET_OPTION_STR(OPT_SSL_SESSION_DATA);
+#else
+          break; /* resumption is an optimization, ignored when not supported */
+#endif
+        case 22: SET_OPTION_COMPRESSION_ALGORITHMS();
+        case 23: SET_OPTION_ZSTD_COMPRESSION_LEVEL();
+        default:
+          caml_invalid_argument("Mysql.connect: unknown option");
+      }
+    }
+    else
+    {
+      switch (Int_val(Field(options,0)))
+      {
+        case 0: SET_OPTION(OPT_COMPRESS, NULL);
+        case 1: SET_OPTION(OPT_NAMED_PIPE, NULL);
+        case 2: SET_CLIENT_FLAG(CLIENT_FOUND_ROWS);
+        default: caml_invalid_argument("Mysql.connect: unknown option");
+      }
+    }
+    options = Field(options, 1);
+  }
+
+  CAMLreturn0;
+}
+
+/*
+ * real_connect connects a handle prepared with set_options using the
+ * login information of a db record.  Performs network I/O in a blocking
+ * section, returns NULL on failure (see mysql_error(init)).
+ */
+
+static MYSQL*
+real_connect(MYSQL *init, value args, unsigned long client_flag)
+{
+  char *host      = strdup_option(Field(args,0));
+  char *db        = strdup_option(Field(args,1));
+  unsigned int port = (unsigned int) int_option(Field(args,2));
+  char *pwd       = strdup_option(Field(args,3));
+  char *user      = strdup_option(Field(args,4));
+  char *socket    = strdup_option(Field(args,5));
+  MYSQL *mysql;
+
+  caml_enter_blocking_section();
+  mysql = mysql_real_connect(init ,host ,user
+                             ,pwd ,db ,port
+                             ,socket, client_flag);
+  caml_leave_blocking_section();
+
+  free(host); free(db); free(pwd); free(user); free(socket);
+
+  return mysql;
+}
 
 EXTERNAL value
 db_connect(value options, value args)
 
 {
   CAMLparam2(options, args);
-  CAMLlocal2(res, v);
-  char *host      = NULL;
-  char *db        = NULL;
-  unsigned int port     = 0;
-  char *pwd       = NULL;
-  char *user      = NULL;
-  char *socket    = NULL;
+  CAMLlocal1(res);
   MYSQL *init;
   MYSQL *mysql;
-  unsigned int option_int;
-  my_bool option_bool;
   unsigned long client_flag = 0;
 
   init = mysql_init(NULL);
@@ -218,59 +472,9 @@ db_connect(value options, value args)
   }
   else
   {
-    while (options != Val_emptylist)
-    {
-      if (Is_block(Field(options,0)))
-      {
-        v = Field(Field(options,0),0);
-        switch (Tag_val(Field(options,0)))
-        {
-          case  0: SET_OPTION_BOOL(OPT_LOCAL_INFILE);
-          case  1: SET_OPTION_BOOL(OPT_RECONNECT);
-          case  2: SET_OPTION_BOOL(OPT_SSL_VERIFY_SERVER_CERT);
-          case  3: SET_OPTION_BOOL(REPORT_DATA_TRUNCATION);
-          case  4: SET_OPTION_BOOL(SECURE_AUTH);
-          case  5: SET_OPTION(OPT_PROTOCOL, &ml_mysql_protocol_type[Int_val(v)]);
-          case  6: SET_OPTION_INT(OPT_CONNECT_TIMEOUT);
-          case  7: SET_OPTION_INT(OPT_READ_TIMEOUT);
-          case  8: SET_OPTION_INT(OPT_WRITE_TIMEOUT);
-          case  9: SET_OPTION_STR(INIT_COMMAND);
-          case 10: SET_OPTION_STR(READ_DEFAULT_FILE);
-          case 11: SET_OPTION_STR(READ_DEFAULT_GROUP);
-          case 12: SET_OPTION_STR(SET_CHARSET_DIR);
-          case 13: SET_OPTION_STR(SET_CHARSET_NAME);
-          case 14: SET_OPTION_STR(SHARED_MEMORY_BASE_NAME);
-          default:
-            caml_invalid_argument("Mysql.connect: unknown option");
-        }
-      }
-      else
-      {
-        switch (Int_val(Field(options,0)))
-        {
-          case 0: SET_OPTION(OPT_COMPRESS, NULL);
-          case 1: SET_OPTION(OPT_NAMED_PIPE, NULL);
-          case 2: SET_CLIENT_FLAG(CLIENT_FOUND_ROWS);
-          default: caml_invalid_argument("Mysql.connect: unknown option");
-        }
-      }
-      options = Field(options, 1);
-    }
-
-    host      = strdup_option(Field(args,0));
-    db        = strdup_option(Field(args,1));
-    port      = (unsigned int) int_option(Field(args,2));
-    pwd       = strdup_option(Field(args,3));
-    user      = strdup_option(Field(args,4));
-    socket    = strdup_option(Field(args,5));
-
-    caml_enter_blocking_section();
-    mysql = mysql_real_connect(init ,host ,user
-                               ,pwd ,db ,port
-                               ,socket, client_flag);
-    caml_leave_blocking_section();
+    set_options(init, options, &client_flag);
 
-    free(host); free(db); free(pwd); free(user); free(socket);
+    mysql = real_connect(init, args, client_flag);
 
     if (!mysql)
     {
@@ -286,6 +490,314 @@ db_connect(value options, value args)
   CAMLreturn(res);
 }
 
+/*
+ * db_tls_session -- TLS session of a connection, to be resumed by the
+ * following connections to the same server.
+ */
+
+EXTERNAL value
+db_tls_session(value dbd)
+{
+  CAMLparam1(dbd);
+  CAMLlocal1(session);
+  MYSQL* db = check_db(dbd,"tls_session");
+#ifdef HAVE_SSL_SESSION_DATA
+  unsigned int len = 0;
+  void *data = mysql_get_ssl_session_data(db, 0, &len);
+
+  if (!data)
+    CAMLreturn(Val_none);
+  session = caml_alloc_initialized_string(len, data);
+  mysql_free_ssl_session_data(db, data);
+  CAMLreturn(Val_some(session));
+#else
+  (void)db;
+  CAMLreturn(Val_none);
+#endif
+}
+
+EXTERNAL value
+db_tls_session_reused(value dbd)
+{
+  CAMLparam1(dbd);
+  MYSQL* db = check_db(dbd,"tls_session_reused");
+#ifdef HAVE_SSL_SESSION_DATA
+  CAMLreturn(Val_bool(mysql_get_ssl_session_reused(db)));
+#else
+  (void)db;
+  CAMLreturn(Val_false);
+#endif
+}
+
+/*
+ * db_connect_many -- opens [n] connections with the same options, the
+ * handshakes being performed concurrently by one thread each.  Either
+ * all the connections are returned or none.
+ */
+
+#ifndef _WIN32
+typedef struct {
+  pthread_t thread;
+  int started;
+  MYSQL *init;
+  MYSQL *mysql;
+  const char *host, *user, *pwd, *db, *socket;
+  unsigned int port;
+  unsigned long client_flag;
+} connect_job_t;
+
+static void*
+connect_run(void *arg)
+{
+  connect_job_t *j = arg;
+  mysql_thread_init();
+  j->mysql = mysql_real_connect(j->init, j->host, j->user, j->pwd, j->db,
+                                j->port, j->socket, j->client_flag);
+  mysql_thread_end();
+  return NULL;
+}
+#endif
+
+EXTERNAL value
+db_connect_many(value options, value args, value v_n)
+{
+  CAMLparam3(options, args, v_n);
+  CAMLlocal2(res, dbd);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.connect_many: not supported on this platform");
+#else
+  long i, n = Long_val(v_n);
+  unsigned long client_flag = 0;
+  connect_job_t *jobs;
+  char *host, *db, *pwd, *user, *socket;
+  unsigned int port;
+  const char *failed = NULL;
+  char buf[1024];
+
+  if (n <= 0)
+    CAMLreturn(Atom(0));
+  /* the options are validated on the first handle while it is owned by a
+     finalized block, so that nothing leaks when set_options raises */
+  dbd = caml_alloc_final(3, conn_finalize, 0, 1);
+  Field(dbd, 1) = (value)mysql_init(NULL);
+  Field(dbd, 2) = Val_bool(0 != Field(dbd, 1));
+  if (!Field(dbd, 1))
+    mysqlfailwith("Mysql.connect_many: mysql_init failed");
+  set_options(DBDmysql(dbd), options, &client_flag);
+  jobs = calloc(n, sizeof(connect_job_t));
+  if (!jobs)
+    caml_raise_out_of_memory();
+  jobs[0].init = DBDmysql(dbd);
+  Field(dbd, 2) = Val_false;
+  for (i = 1; i < n; i++)
+  {
+    jobs[i].init = mysql_init(NULL);
+    if (!jobs[i].init)
+      break;
+    set_options(jobs[i].init, options, &client_flag);
+  }
+  if (i < n)
+  {
+    while (i-- > 0)
+      mysql_close(jobs[i].init);
+    free(jobs);
+    mysqlfailwith("Mysql.connect_many: mysql_init failed");
+  }
+
+  host = strdup_option(Field(args,0));
+  db = strdup_option(Field(args,1));
+  port = (unsigned int) int_option(Field(args,2));
+  pwd = strdup_option(Field(args,3));
+  user = strdup_option(Field(args,4));
+  socket = strdup_option(Field(args,5));
+
+  caml_enter_blocking_section();
+  for (i = 0; i < n; i++)
+  {
+    connect_job_t *j = &jobs[i];
+    j->host = host; j->db = db; j->port = port; j->pwd = pwd; j->user = user; j->socket = socket;
+    j->client_flag = client_flag;
+    j->started = (0 == pthread_create(&j->thread, NULL, connect_run, j));
+    if (!j->started)
+      connect_run(j);
+  }
+  for (i = 0; i < n; i++)
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+  for (i = 0; i < n; i++)
+  {
+    if (!jobs[i].mysql && !failed)
+    {
+      snprintf(buf, sizeof buf, "Mysql.connect_many: %s", mysql_error(jobs[i].init));
+      failed = buf;
+    }
+  }
+  if (failed)
+    for (i = 0; i < n; i++)
+      mysql_close(jobs[i].init);
+  caml_leave_blocking_section();
+
+  free(host); free(db); free(pwd); free(user); free(socket);
+
+  if (failed)
+  {
+    free(jobs);
+    mysqlfailwith(buf);
+  }
+
+  res = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++)
+  {
+    dbd = caml_alloc_final(3, conn_finalize, 0, 1);
+    Field(dbd, 1) = (value)jobs[i].mysql;
+    Field(dbd, 2) = Val_true;
+    Store_field(res, i, dbd);
+  }
+  free(jobs);
+#endif
+  CAMLreturn(res);
+}
+
+/*
+ * Binlog -- replication stream read with the mysql_binlog_* calls of
+ * the MySQL client library (5.7 and later), events are decoded in
+ * Mysql.Binlog.  The handle does not own the connection: it is passed
+ * to every call and not touched by the finalizer.
+ */
+
+#if !defined(MARIADB_PACKAGE_VERSION_ID) && !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 50706
+#define HAVE_BINLOG_API 1
+
+typedef struct {
+  MYSQL_RPL rpl;
+  char *file;
+  int open;
+} binlog_t;
+
+#define BINLOGval(v) (*(binlog_t**)Data_custom_val(v))
+
+static void
+binlog_finalize(value handle)
+{
+  binlog_t *b = BINLOGval(handle);
+  if (!b) return;
+  free(b->file);
+  free(b);
+}
+
+struct custom_operations binlog_ops = {
+  "Mysql Binlog",
+  binlog_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+#if defined(custom_fixed_length_default)
+  custom_fixed_length_default,
+#endif
+};
+
+static binlog_t*
+check_binlog(value handle, char *fun)
+{
+  binlog_t *b = BINLOGval(handle);
+  if (!b->open)
+    mysqlfailmsg("Mysql.Binlog.%s called with closed stream", fun);
+  return b;
+}
+#endif
+
+EXTERNAL value
+db_binlog_open(value dbd, value v_file, value v_pos, value v_server_id)
+{
+  CAMLparam4(dbd, v_file, v_pos, v_server_id);
+  CAMLlocal1(handle);
+#ifndef HAVE_BINLOG_API
+  mysqlfailwith("Mysql.Binlog.connect: not supported by the client library");
+#else
+  MYSQL* db = check_db(dbd,"Binlog.connect");
+  binlog_t *b = calloc(1, sizeof(binlog_t));
+  int ret;
+
+  if (!b || !(b->file = strdup(String_val(v_file))))
+  {
+    free(b);
+    caml_raise_out_of_memory();
+  }
+  b->rpl.file_name_length = strlen(b->file);
+  b->rpl.file_name = b->file;
+  b->rpl.start_position = Int64_val(v_pos);
+  b->rpl.server_id = Long_val(v_server_id);
+  b->rpl.flags = 0;
+
+  caml_enter_blocking_section();
+  ret = mysql_binlog_open(db, &b->rpl);
+  caml_leave_blocking_section();
+
+  if (ret)
+  {
+    free(b->file);
+    free(b);
+    mysqlfailmsg("Mysql.Binlog.connect: %s", mysql_error(db));
+  }
+  b->open = 1;
+  handle = caml_alloc_custom(&binlog_ops, sizeof(binlog_t*), 0, 1);
+  BINLOGval(handle) = b;
+#endif
+  CAMLreturn(handle);
+}
+
+/*
+ * db_binlog_fetch -- waits for the next event, returns it without the
+ * leading OK byte, None when the server ends the stream.
+ */
+
+EXTERNAL value
+db_binlog_fetch(value dbd, value handle)
+{
+  CAMLparam2(dbd, handle);
+  CAMLlocal1(event);
+#ifndef HAVE_BINLOG_API
+  mysqlfailwith("Mysql.Binlog.next: not supported by the client library");
+#else
+  MYSQL* db = check_db(dbd,"Binlog.next");
+  binlog_t *b = check_binlog(handle, "next");
+  int ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_binlog_fetch(db, &b->rpl);
+  caml_leave_blocking_section();
+
+  if (ret)
+    mysqlfailmsg("Mysql.Binlog.next: %s", mysql_error(db));
+  if (b->rpl.size <= 1)
+    CAMLreturn(Val_none);
+  event = caml_alloc_initialized_string(b->rpl.size - 1, (const char*)b->rpl.buffer + 1);
+#endif
+  CAMLreturn(Val_some(event));
+}
+
+EXTERNAL value
+db_binlog_close(value dbd, value handle)
+{
+  CAMLparam2(dbd, handle);
+#ifdef HAVE_BINLOG_API
+  binlog_t *b = BINLOGval(handle);
+  if (b->open)
+  {
+    MYSQL* db = check_db(dbd,"Binlog.close");
+    caml_enter_blocking_section();
+    mysql_binlog_close(db, &b->rpl);
+    caml_leave_blocking_section();
+    b->open = 0;
+  }
+#endif
+  CAMLreturn(Val_unit);
+}
+
 EXTERNAL value
 db_library_init(value v_unit)
 {
@@ -414,664 +926,3945 @@ db_ping(value dbd)
 }
 
 /*
- * finalize -- this is called when a data base result is garbage
- * collected -- frees memory allocated by MySQL.
+ * Transactions -- thin wrappers on the client calls, see
+ * Mysql.with_transaction.
  */
 
-static void
-res_finalize(value result)
+EXTERNAL value
+db_autocommit(value dbd, value v_on)
 {
-  MYSQL_RES *res = RESval(result);
-  if (res)
-    mysql_free_result(res);
+  CAMLparam2(dbd, v_on);
+  MYSQL* db = check_db(dbd,"autocommit");
+  my_bool on = Bool_val(v_on);
+  my_bool ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_autocommit(db, on);
+  caml_leave_blocking_section();
+
+  if (ret)
+    mysqlfailmsg("Mysql.autocommit: %s", mysql_error(db));
+
+  CAMLreturn(Val_unit);
 }
 
+EXTERNAL value
+db_commit(value dbd)
+{
+  CAMLparam1(dbd);
+  MYSQL* db = check_db(dbd,"commit");
+  my_bool ret;
 
-struct custom_operations res_ops = {
-  "Mysql Query Results",
-  res_finalize,
-  custom_compare_default,
-  custom_hash_default,
-  custom_serialize_default,
-  custom_deserialize_default,
-#if defined(custom_compare_ext_default)
-  custom_compare_ext_default,
-#endif
-#if defined(custom_fixed_length_default)
-  custom_fixed_length_default,
-#endif
-};
+  caml_enter_blocking_section();
+  ret = mysql_commit(db);
+  caml_leave_blocking_section();
+
+  if (ret)
+    mysqlfailmsg("Mysql.commit: %s", mysql_error(db));
+
+  CAMLreturn(Val_unit);
+}
+
+EXTERNAL value
+db_rollback(value dbd)
+{
+  CAMLparam1(dbd);
+  MYSQL* db = check_db(dbd,"rollback");
+  my_bool ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_rollback(db);
+  caml_leave_blocking_section();
+
+  if (ret)
+    mysqlfailmsg("Mysql.rollback: %s", mysql_error(db));
+
+  CAMLreturn(Val_unit);
+}
 
 /*
- * db_exec -- execute a SQL query or command.  Returns a handle to
- * access the result.
+ * db_query -- executes a statement and discards its result, if any,
+ * without allocating a result value.
  */
 
 EXTERNAL value
-db_exec(value v_dbd, value v_sql)
+db_query(value dbd, value sql)
 {
-  CAMLparam2(v_dbd, v_sql);
-  CAMLlocal1(res);
-  MYSQL *mysql = check_db(v_dbd,"exec");
-  char* sql = strdup(String_val(v_sql));
-  size_t len = caml_string_length(v_sql);
+  CAMLparam2(dbd, sql);
+  MYSQL* db = check_db(dbd,"query");
+  size_t len = caml_string_length(sql);
+  char* query = malloc(len);
+  MYSQL_RES* res = NULL;
   int ret;
 
+  if (!query)
+    caml_raise_out_of_memory();
+  memcpy(query, String_val(sql), len);
+
   caml_enter_blocking_section();
-  ret = mysql_real_query(mysql, sql, len);
+  ret = mysql_real_query(db, query, len);
+  if (0 == ret && (res = mysql_store_result(db)))
+    mysql_free_result(res);
   caml_leave_blocking_section();
 
-  free(sql);
+  free(query);
 
-  if (ret)
-  {
-    mysqlfailmsg("Mysql.exec: %s", mysql_error(mysql));
-  }
-  else
-  {
-    res = caml_alloc_custom(&res_ops, sizeof(MYSQL_RES*), 0, 1);
-    RESval(res) = mysql_store_result(mysql);
-  }
+  if (ret || mysql_errno(db))
+    mysqlfailmsg("Mysql.query: %s", mysql_error(db));
 
-  CAMLreturn(res);
+  CAMLreturn(Val_unit);
 }
 
 /*
- * db_fetch -- fetch one result tuple, represented as array of string
- * options.  In case a value is Null, the respective value is None.
- * Returns (Some v) in case there is such a result and None otherwise.
- * Moves the internal result cursor to the next tuple.
+ * Spilled results -- rows streamed from the server with
+ * mysql_use_result into an unlinked temporary file, then mapped in
+ * memory.  The MYSQL_RES is kept for the fields description only.
+ *
+ * Row file layout (native byte order):
+ *
+ *      rows:   for each column a uint32_t length (STORE_NULL for NULL)
+ *              followed by the data
+ *      index:  8 byte aligned array of uint64_t, offset of each row
+ *
+ * The index is written to a second temporary file while streaming and
+ * appended once the row count is known.
  */
 
-EXTERNAL value
-db_fetch (value result)
+#define STORE_NULL 0xFFFFFFFFu
+
+static const char*
+store_cell(const char *p, unsigned int i, unsigned long *len)
 {
-  CAMLparam1(result);
-  CAMLlocal2(fields, s);
-  unsigned int i, n;
-  unsigned long *length;  /* array of long */
-  MYSQL_RES *res;
-  MYSQL_ROW row;
+  uint32_t l;
 
-  res = RESval(result);
-  if (!res)
-    mysqlfailwith("Mysql.fetch: result did not return fetchable data");
+  for (;;)
+  {
+    memcpy(&l, p, sizeof l);
+    p += sizeof l;
+    if (i-- == 0)
+      break;
+    if (l != STORE_NULL)
+      p += l;
+  }
 
-  n = mysql_num_fields(res);
-  if (n == 0)
-    mysqlfailwith("Mysql.fetch: no columns");
+  *len = (l == STORE_NULL) ? 0 : l;
+  return (l == STORE_NULL) ? NULL : p;
+}
 
-  row = mysql_fetch_row(res);
-  if (!row)
-    CAMLreturn(Val_none);
+/* store_row -- fills [cells] and [lengths] with the columns of the row
+ * at [p], in the format of MYSQL_ROW and mysql_fetch_lengths */
 
-  /* create Some([| f1; f2; .. ;fn |]) */
+static void
+store_row(const char *p, unsigned int n, char **cells, unsigned long *lengths)
+{
+  unsigned int i;
+  uint32_t l;
 
-  length = mysql_fetch_lengths(res);      /* length[] */
-  fields = caml_alloc_tuple(n);                    /* array */
-  for (i=0;i<n;i++) {
-    s = val_str_option(row[i], length[i]);
-    Store_field(fields, i, s);
+  for (i = 0; i < n; i++)
+  {
+    memcpy(&l, p, sizeof l);
+    p += sizeof l;
+    cells[i] = (l == STORE_NULL) ? NULL : (char*)p;
+    lengths[i] = (l == STORE_NULL) ? 0 : l;
+    if (l != STORE_NULL)
+      p += l;
   }
+}
 
-  CAMLreturn(Val_some(fields));
+static const char*
+store_row_ptr(store_t *s, uint64_t off)
+{
+  return s->data + s->index[off];
 }
 
-EXTERNAL value
-db_to_row(value result, value offset)
+static void
+store_free(store_t *s)
 {
-  int64_t off = Int64_val(offset);
-  MYSQL_RES *res;
+  if (!s)
+    return;
+#ifndef _WIN32
+  if (s->mem && s->mapped)
+    munmap(s->mem, s->size);
+  else
+#endif
+    free(s->mem);
+  free(s->defs);
+  free(s->cells);
+  free(s->lengths);
+  free(s);
+}
 
-  res = RESval(result);
-  if (!res)
-    mysqlfailwith("Mysql.to_row: result did not return fetchable data");
+/* store_alloc_row -- allocates the buffers used by fetch */
+
+static int
+store_alloc_row(store_t *s)
+{
+  s->cells = malloc((s->fields + 1) * sizeof(char*));
+  s->lengths = malloc((s->fields + 1) * sizeof(unsigned long));
+  return s->cells && s->lengths;
+}
 
-  if (off < 0 || off > (int64_t)mysql_num_rows(res)-1)
-    caml_invalid_argument("Mysql.to_row: offset out of range");
+#ifndef _WIN32
 
-  mysql_data_seek(res, off);
+/* spill_tmpfile -- creates an anonymous temporary file in [dir] */
 
-  return Val_unit;
+static FILE*
+spill_tmpfile(const char *dir)
+{
+  size_t len = strlen(dir);
+  char *path = malloc(len + sizeof "/mysql-spill-XXXXXX");
+  FILE *f = NULL;
+  int fd;
+
+  if (!path)
+    return NULL;
+  sprintf(path, "%s/mysql-spill-XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd >= 0)
+  {
+    unlink(path);
+    f = fdopen(fd, "w+");
+    if (!f)
+      close(fd);
+  }
+  free(path);
+  return f;
 }
 
-/*
- * db_status -- returns current status (simplistic)
+/* spill_write -- streams the rows of [res] to [f] and the row offsets to
+ * [idx].  Returns 0 on success, -1 on I/O error (errno is set), -2 if
+ * fetching the rows failed.  Called without the runtime lock.
  */
 
-EXTERNAL value
-db_status(value dbd)
+static int
+spill_write(MYSQL *mysql, MYSQL_RES *res, FILE *f, FILE *idx, uint64_t *rows)
 {
-  CAMLparam1(dbd);
-  CAMLreturn(Val_int(mysql_errno(check_db(dbd,"status"))));
+  unsigned int i, n = mysql_num_fields(res);
+  unsigned long *lengths;
+  uint64_t off = 0;
+  uint32_t l;
+  MYSQL_ROW row;
+
+  *rows = 0;
+  while ((row = mysql_fetch_row(res)))
+  {
+    lengths = mysql_fetch_lengths(res);
+    if (fwrite(&off, sizeof off, 1, idx) != 1)
+      return -1;
+    for (i = 0; i < n; i++)
+    {
+      l = row[i] ? (uint32_t)lengths[i] : STORE_NULL;
+      if (fwrite(&l, sizeof l, 1, f) != 1)
+        return -1;
+      if (row[i] && lengths[i] && fwrite(row[i], lengths[i], 1, f) != 1)
+        return -1;
+      off += sizeof l + (row[i] ? lengths[i] : 0);
+    }
+    (*rows)++;
+  }
+
+  return mysql_errno(mysql) ? -2 : 0;
 }
 
-/*
- * db_errmsg -- returns string option with last error message (None ==
- * no error)
- */
+/* spill_finish -- appends the index to the row file and maps it */
 
-EXTERNAL value
-db_errmsg(value dbd)
+static int
+spill_finish(store_t *s, FILE *f, FILE *idx, uint64_t rows)
 {
-  CAMLparam1(dbd);
-  CAMLlocal1(s);
-  const char *msg;
+  static const char pad[8];
+  char buf[65536];
+  off_t pos;
+  size_t got;
+
+  if (fseeko(f, 0, SEEK_END) || (pos = ftello(f)) < 0)
+    return -1;
+  if (pos % 8 && fwrite(pad, 8 - pos % 8, 1, f) != 1)
+    return -1;
+  pos = (pos + 7) / 8 * 8;
+
+  rewind(idx);
+  while ((got = fread(buf, 1, sizeof buf, idx)) > 0)
+    if (fwrite(buf, got, 1, f) != 1)
+      return -1;
+  if (ferror(idx) || fflush(f))
+    return -1;
+
+  s->rows = rows;
+  s->size = pos + rows * sizeof(uint64_t);
+  if (s->size == 0)
+    return 0;
 
-  msg = mysql_error(check_db(dbd,"errmsg"));
-  if (!msg || msg[0] == '\0')
-    msg = (char*) NULL;
-  s = val_str_option(msg, msg == (char *) NULL ? 0 : strlen(msg));
-  CAMLreturn(s);
+  s->mem = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fileno(f), 0);
+  if (s->mem == MAP_FAILED)
+  {
+    s->mem = NULL;
+    return -1;
+  }
+  s->mapped = 1;
+  s->data = s->mem;
+  s->index = (const uint64_t*)(s->mem + pos);
+  return 0;
 }
 
+#endif
+
 /*
- * db_escape - takes a string and escape all characters inside which
- * must be escaped inside MySQL strings.  This helps to construct SQL
- * statements easily.  Simply returns the new string including the
- * quotes.
+ * finalize -- this is called when a data base result is garbage
+ * collected -- frees memory allocated by MySQL.
  */
 
-EXTERNAL value
-db_escape(value str)
+static void
+res_finalize(value handle)
 {
-  CAMLparam1(str);
-  char *s;
-  char *buf;
-  int len, esclen;
-  CAMLlocal1(res);
+  res_t *r = (res_t*)Data_custom_val(handle);
+  if (r->res && !r->freed)
+    mysql_free_result(r->res);
+  free(r->index);
+  store_free(r->store);
+}
 
-  s = String_val(str);
-  len = caml_string_length(str);
-  buf = (char*)caml_stat_alloc(2*len+1);
-  esclen = mysql_escape_string(buf,s,len);
+static void res_serialize(value handle, uintnat *wsize_32, uintnat *wsize_64);
+static uintnat res_deserialize(void *dst);
 
-  res = caml_alloc_string(esclen);
-  memcpy(String_val(res), buf, esclen);
-  caml_stat_free(buf);
+struct custom_operations res_ops = {
+  "Mysql Query Results",
+  res_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  res_serialize,
+  res_deserialize,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+#if defined(custom_fixed_length_default)
+  custom_fixed_length_default,
+#endif
+};
 
-  CAMLreturn(res);
-}
+/* check_res checks that the result was not released with Mysql.free
+ * and returns the underlying MYSQL_RES (NULL if there is no data).
+ */
 
-EXTERNAL value
-db_real_escape(value dbd, value str)
+static MYSQL_RES*
+check_res(value result, const char *fun)
 {
-  CAMLparam2(dbd, str);
-  char *s;
-  char *buf;
-  int len, esclen;
-  MYSQL *mysql;
-  CAMLlocal1(res);
-
-  mysql = check_db(dbd, "real_escape");
-
-  s = String_val(str);
-  len = caml_string_length(str);
-  buf = (char*)caml_stat_alloc(2*len+1);
-  /*
-   * mysql_real_escape doesn't perform network I/O,
-   * so no need for blocking section (and extra copying)
-   * */
-  esclen = mysql_real_escape_string(mysql,buf,s,len);
+  res_t *r = RESval(result);
+  if (r->freed)
+    mysqlfailmsg("Mysql.%s called with freed result", fun);
+  return r->res;
+}
 
-  res = caml_alloc_string(esclen);
-  memcpy(String_val(res), buf, esclen);
-  caml_stat_free(buf);
+/* accessors working for all kinds of results */
 
-  CAMLreturn(res);
+static unsigned int
+res_num_fields(res_t *r)
+{
+  if (r->store)
+    return r->store->fields;
+  return r->res ? mysql_num_fields(r->res) : 0;
 }
 
-EXTERNAL value
-db_set_charset(value dbd, value str)
+static uint64_t
+res_num_rows(res_t *r)
 {
-  CAMLparam2(dbd, str);
-  char *s;
-  MYSQL *mysql;
-  int res;
-
-  mysql = check_db(dbd, "set_charset");
-
-  s = strdup(String_val(str));
-  caml_enter_blocking_section();
-  res = mysql_set_character_set(mysql,s);
-  free(s);
-  caml_leave_blocking_section();
-
-  if (res)
-    mysqlfailmsg("Mysql.set_charset : %s",mysql_error(mysql));
+  if (r->store)
+    return r->store->rows;
+  return r->res ? mysql_num_rows(r->res) : 0;
+}
 
-  CAMLreturn(Val_unit);
+static MYSQL_FIELD*
+res_fields(res_t *r)
+{
+  if (r->store && r->store->defs)
+    return r->store->defs;
+  return r->res ? mysql_fetch_fields(r->res) : NULL;
 }
 
 /*
- * db_size -- returns the size of the current result (number of rows).
+ * res_mem_size -- approximate amount of client memory held by a stored
+ * result, so that the GC can account for it.  Each stored row is a
+ * MYSQL_ROWS node with the row packet and the (fields+1) column
+ * pointers allocated next to it.
  */
 
-EXTERNAL value
-db_size(value result)
+static size_t
+res_mem_size(MYSQL_RES *res)
 {
-  CAMLparam1(result);
-  MYSQL_RES *res;
-  int64_t size;
+  MYSQL_ROW_OFFSET cur;
+  unsigned int n;
+  size_t size;
 
-  res = RESval(result);
   if (!res)
-    size = 0;
-  else
-    size = (int64_t)mysql_num_rows(res);
+    return 0;
 
-  CAMLreturn(caml_copy_int64(size));
-}
+  n = mysql_num_fields(res);
+  size = n * sizeof(MYSQL_FIELD);
+  for (cur = mysql_row_tell(res); cur; cur = cur->next)
+    size += sizeof(MYSQL_ROWS) + (n + 1) * sizeof(char*) + cur->length;
 
-EXTERNAL value
-db_affected(value dbd) {
-  CAMLparam1(dbd);
-  CAMLreturn(caml_copy_int64(mysql_affected_rows(DBDmysql(dbd))));
+  return size;
 }
 
-EXTERNAL value
-db_insert_id(value dbd) {
-  CAMLparam1(dbd);
-  CAMLreturn(caml_copy_int64(mysql_insert_id(DBDmysql(dbd))));
-}
+/* Upper bound of off-heap memory to trigger a full GC cycle, only
+ * used by OCaml versions without caml_alloc_custom_mem */
+#define RES_MEM_MAX (64 * 1024 * 1024)
 
-EXTERNAL value
-db_fields(value result)
+static value
+alloc_res(MYSQL_RES *res, store_t *store)
 {
-  MYSQL_RES *res;
-  long size;
-
-  res = RESval(result);
-  if (!res)
-    size = 0;
-  else
-    size = (long)(mysql_num_fields(res));
-
-  return Val_long(size);
+  CAMLparam0();
+  CAMLlocal2(handle, v);
+  res_t *r;
+  size_t mem = res_mem_size(res);
+
+  if (store && !store->mapped)
+    mem += store->size;
+#if OCAML_VERSION >= 40800
+  handle = caml_alloc_custom_mem(&res_ops, sizeof(res_t), mem);
+#else
+  handle = caml_alloc_custom(&res_ops, sizeof(res_t), mem, RES_MEM_MAX);
+#endif
+  r = (res_t*)Data_custom_val(handle);
+  r->res = res;
+  r->freed = 0;
+  r->index = NULL;
+  r->store = store;
+  r->busy = 0;
+
+  v = caml_alloc_small(3, 0);
+  Field(v, 0) = handle;
+  Field(v, 1) = Val_none;
+  Field(v, 2) = Atom(0);
+  CAMLreturn(v);
 }
 
-EXTERNAL value
-db_client_info(value unit) {
-  CAMLparam1(unit);
-  CAMLlocal1(info);
-  info = caml_copy_string(mysql_get_client_info());
-  CAMLreturn(info);
-}
+/*
+ * db_exec -- execute a SQL query or command.  Returns a handle to
+ * access the result.
+ */
 
 EXTERNAL value
-db_host_info(value dbd) {
-  CAMLparam1(dbd);
-  CAMLlocal1(info);
-  info = caml_copy_string(mysql_get_host_info(DBDmysql(dbd)));
-  CAMLreturn(info);
+db_exec(value v_dbd, value v_sql)
+{
+  CAMLparam2(v_dbd, v_sql);
+  CAMLlocal1(res);
+  MYSQL *mysql = check_db(v_dbd,"exec");
+  char* sql = strdup(String_val(v_sql));
+  size_t len = caml_string_length(v_sql);
+  int ret;
+
+  caml_enter_blocking_section();
+  ret = mysql_real_query(mysql, sql, len);
+  caml_leave_blocking_section();
+
+  free(sql);
+
+  if (ret)
+  {
+    mysqlfailmsg("Mysql.exec: %s", mysql_error(mysql));
+  }
+  else
+  {
+    res = alloc_res(mysql_store_result(mysql), NULL);
+  }
+
+  CAMLreturn(res);
 }
 
-EXTERNAL value
-db_server_info(value dbd) {
-  CAMLparam1(dbd);
-  CAMLlocal1(info);
-  info = caml_copy_string(mysql_get_server_info(DBDmysql(dbd)));
-  CAMLreturn(info);
+/*
+ * Query deadlines
+ *
+ * A watchdog thread waits for the guarded call to return.  When the
+ * deadline expires first it opens a side connection with the same
+ * credentials and issues KILL QUERY for the connection thread id, so
+ * the server stops working on the statement and the guarded call
+ * returns with an error, leaving the connection usable.
+ */
+
+#ifndef _WIN32
+
+/* options of the guarded connection applied to the side connection */
+#if defined(MARIADB_PACKAGE_VERSION_ID) || (defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 50711)
+#define HAVE_WATCHDOG_OPTIONS 1
+static const enum mysql_option watchdog_options[] = {
+  MYSQL_OPT_SSL_KEY, MYSQL_OPT_SSL_CERT, MYSQL_OPT_SSL_CA, MYSQL_OPT_SSL_CAPATH, MYSQL_OPT_SSL_CIPHER,
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+  MARIADB_OPT_TLS_VERSION,
+#else
+  MYSQL_OPT_TLS_VERSION,
+#endif
+  MYSQL_DEFAULT_AUTH, MYSQL_PLUGIN_DIR
+};
+#define WATCHDOG_OPTIONS (sizeof watchdog_options / sizeof watchdog_options[0])
+#else
+#define WATCHDOG_OPTIONS 1
+#endif
+
+typedef struct watchdog_tag
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct timespec deadline;
+  int done;                     /* the guarded call returned */
+  int fired;                    /* KILL QUERY was issued */
+  unsigned long thread_id;
+  char *host, *user, *passwd, *socket;
+  unsigned int port;
+  char *options[WATCHDOG_OPTIONS]; /* values of watchdog_options, NULL when unset */
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+  my_bool verify_cert;
+#elif defined(HAVE_WATCHDOG_OPTIONS)
+  unsigned int ssl_mode;
+#endif
+} watchdog_t;
+
+static char*
+strdup_null(const char *s)
+{
+  return s ? strdup(s) : NULL;
+}
+
+static void
+watchdog_copy_options(watchdog_t *w, MYSQL *mysql)
+{
+  size_t i;
+
+  for (i = 0; i < WATCHDOG_OPTIONS; i++)
+    w->options[i] = NULL;
+#ifdef HAVE_WATCHDOG_OPTIONS
+  for (i = 0; i < WATCHDOG_OPTIONS; i++)
+  {
+    const char *v = NULL;
+    if (0 == mysql_get_option(mysql, watchdog_options[i], &v))
+      w->options[i] = strdup_null(v);
+  }
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+  w->verify_cert = 0;
+  mysql_get_option(mysql, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &w->verify_cert);
+#else
+  w->ssl_mode = 0;
+  mysql_get_option(mysql, MYSQL_OPT_SSL_MODE, &w->ssl_mode);
+#endif
+#endif
+}
+
+static void
+watchdog_apply_options(watchdog_t *w, MYSQL *killer)
+{
+#ifdef HAVE_WATCHDOG_OPTIONS
+  size_t i;
+
+  for (i = 0; i < WATCHDOG_OPTIONS; i++)
+    if (w->options[i])
+      mysql_options(killer, watchdog_options[i], w->options[i]);
+#if defined(MARIADB_PACKAGE_VERSION_ID)
+  mysql_options(killer, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &w->verify_cert);
+#else
+  if (w->ssl_mode)
+    mysql_options(killer, MYSQL_OPT_SSL_MODE, &w->ssl_mode);
+#endif
+#endif
+}
+
+static void
+watchdog_free(watchdog_t *w)
+{
+  size_t i;
+
+  free(w->host); free(w->user); free(w->passwd); free(w->socket);
+  for (i = 0; i < WATCHDOG_OPTIONS; i++)
+    free(w->options[i]);
+}
+
+static void
+watchdog_kill(watchdog_t *w)
+{
+  char sql[64];
+  unsigned int timeout = 5;
+  MYSQL *killer = mysql_init(NULL);
+
+  if (!killer)
+    return;
+  mysql_options(killer, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+  watchdog_apply_options(w, killer);
+  if (mysql_real_connect(killer, w->host, w->user, w->passwd, NULL, w->port, w->socket, 0))
+  {
+    snprintf(sql, sizeof sql, "KILL QUERY %lu", w->thread_id);
+    mysql_query(killer, sql);
+  }
+  mysql_close(killer);
+}
+
+static void*
+watchdog_run(void *arg)
+{
+  watchdog_t *w = (watchdog_t*)arg;
+  int rc = 0;
+
+  mysql_thread_init();
+  pthread_mutex_lock(&w->lock);
+  while (!w->done && ETIMEDOUT != rc && EINVAL != rc)
+    rc = pthread_cond_timedwait(&w->cond, &w->lock, &w->deadline);
+  w->fired = !w->done;
+  pthread_mutex_unlock(&w->lock);
+
+  if (w->fired)
+    watchdog_kill(w);
+  mysql_thread_end();
+  return NULL;
+}
+
+/* longest deadline, keeps the computation below in range */
+#define WATCHDOG_MAX_TIMEOUT 1e9
+
+/*
+ * watchdog_start arms the watchdog for [mysql], returns 0 on success.
+ * [timeout] must be positive, see check_timeout in mysql.ml.
+ */
+static int
+watchdog_start(watchdog_t *w, MYSQL *mysql, double timeout)
+{
+  struct timeval now;
+  long long nsec;
+
+  if (!(timeout > 0))
+    return -1;
+  if (timeout > WATCHDOG_MAX_TIMEOUT)
+    timeout = WATCHDOG_MAX_TIMEOUT;
+  gettimeofday(&now, NULL);
+  nsec = (long long)now.tv_usec * 1000 + (long long)(timeout * 1e9);
+  w->deadline.tv_sec = now.tv_sec + nsec / 1000000000;
+  w->deadline.tv_nsec = nsec % 1000000000;
+  w->done = 0;
+  w->fired = 0;
+  w->thread_id = mysql_thread_id(mysql);
+  w->host = strdup_null(mysql->host);
+  w->user = strdup_null(mysql->user);
+  w->passwd = strdup_null(mysql->passwd);
+  w->socket = strdup_null(mysql->unix_socket);
+  w->port = mysql->port;
+  watchdog_copy_options(w, mysql);
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (0 != pthread_create(&w->thread, NULL, watchdog_run, w))
+  {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    watchdog_free(w);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * watchdog_stop disarms the watchdog and returns whether KILL QUERY
+ * was issued.  Waits for the kill to complete, so that it cannot hit
+ * the next statement on this connection.
+ */
+static int
+watchdog_stop(watchdog_t *w)
+{
+  pthread_mutex_lock(&w->lock);
+  w->done = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  watchdog_free(w);
+  return w->fired;
 }
 
+#endif /* _WIN32 */
+
+/*
+ * db_exec_timeout -- same as db_exec, but kills the query when it
+ * doesn't complete (including the transfer of the result set) in
+ * [timeout] seconds.
+ */
+
 EXTERNAL value
-db_proto_info(value dbd) {
-  long info = (long)mysql_get_proto_info(DBDmysql(dbd));
-  return Val_long(info);
+db_exec_timeout(value v_dbd, value v_sql, value v_timeout)
+{
+  CAMLparam3(v_dbd, v_sql, v_timeout);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.exec: timeout is not supported on this platform");
+  CAMLreturn(Val_unit);
+#else
+  MYSQL *mysql = check_db(v_dbd,"exec");
+  double timeout = Double_val(v_timeout);
+  size_t len = caml_string_length(v_sql);
+  char* sql = malloc(len);
+  MYSQL_RES *res = NULL;
+  watchdog_t w;
+  int ret, fired;
+
+  if (!sql)
+    mysqlfailwith("Mysql.exec: malloc");
+  memcpy(sql, String_val(v_sql), len);
+  if (watchdog_start(&w, mysql, timeout))
+  {
+    free(sql);
+    mysqlfailwith("Mysql.exec: cannot start watchdog thread");
+  }
+
+  caml_enter_blocking_section();
+  ret = mysql_real_query(mysql, sql, len);
+  if (!ret)
+  {
+    res = mysql_store_result(mysql);
+    ret = (!res && mysql_field_count(mysql) != 0);
+  }
+  fired = watchdog_stop(&w);
+  caml_leave_blocking_section();
+
+  free(sql);
+
+  if (ret && fired)
+    mysqlfailmsg("Mysql.exec: query timed out after %g s: %s", timeout, mysql_error(mysql));
+  if (ret)
+    mysqlfailmsg("Mysql.exec: %s", mysql_error(mysql));
+
+  CAMLreturn(alloc_res(res, NULL));
+#endif
 }
 
+/*
+ * db_exec_spill -- execute a query and spill its rows to a file in the
+ * given directory instead of keeping them in memory.
+ */
+
+EXTERNAL value
+db_exec_spill(value v_dbd, value v_sql, value v_dir)
+{
+  CAMLparam3(v_dbd, v_sql, v_dir);
+  CAMLlocal1(result);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.exec_spill: not supported on this platform");
+  CAMLreturn(Val_unit);
+#else
+  MYSQL *mysql = check_db(v_dbd, "exec_spill");
+  size_t len = caml_string_length(v_sql);
+  char *sql = malloc(len);
+  char *dir = strdup(String_val(v_dir));
+  store_t *s = calloc(1, sizeof(store_t));
+  MYSQL_RES *res = NULL;
+  FILE *f = NULL, *idx = NULL;
+  uint64_t rows = 0;
+  int ret = 0, err = 0;
+
+  if (!sql || !dir || !s)
+  {
+    free(sql);
+    free(dir);
+    free(s);
+    mysqlfailwith("Mysql.exec_spill: malloc");
+  }
+  memcpy(sql, String_val(v_sql), len);
+
+  caml_enter_blocking_section();
+  if (mysql_real_query(mysql, sql, len))
+    ret = -2;
+  else if ((res = mysql_use_result(mysql)))
+  {
+    f = spill_tmpfile(dir);
+    idx = spill_tmpfile(dir);
+    if (!f || !idx)
+      ret = -1;
+    else
+      ret = spill_write(mysql, res, f, idx, &rows);
+    if (!ret)
+      ret = spill_finish(s, f, idx, rows);
+    err = errno;
+    if (ret)
+    {
+      while (mysql_fetch_row(res))      /* drain the connection */
+        ;
+      mysql_free_result(res);
+    }
+    if (f)
+      fclose(f);
+    if (idx)
+      fclose(idx);
+  }
+  else if (mysql_field_count(mysql) != 0)
+    ret = -2;
+  caml_leave_blocking_section();
+
+  free(sql);
+  free(dir);
+
+  if (ret)
+  {
+    store_free(s);
+    if (ret == -1)
+      mysqlfailmsg("Mysql.exec_spill: %s", strerror(err));
+    mysqlfailmsg("Mysql.exec_spill: %s", mysql_error(mysql));
+  }
+  if (!res)
+  {
+    store_free(s);
+    CAMLreturn(alloc_res(NULL, NULL));
+  }
+
+  s->fields = mysql_num_fields(res);
+  result = alloc_res(res, s);
+  if (!store_alloc_row(s))
+    mysqlfailwith("Mysql.exec_spill: malloc");
+
+  CAMLreturn(result);
+#endif
+}
 
 /*
- * type2dbty - maps column types to dbty values which describe the
- * column types in OCaml.
+ * db_free -- release the memory held by a result right away instead of
+ * waiting for the GC to finalize it.
  */
 
-#define INT_TY          0
-#define FLOAT_TY        1
-#define STRING_TY       2
-#define SET_TY          3
-#define ENUM_TY         4
-#define DATETIME_TY     5
-#define DATE_TY         6
-#define TIME_TY         7
-#define YEAR_TY         8
-#define TIMESTAMP_TY    9
-#define UNKNOWN_TY      10
-#define INT64_TY        11
-#define BLOB_TY         12
-#define DECIMAL_TY			13
+EXTERNAL value
+db_free(value result)
+{
+  CAMLparam1(result);
+  MYSQL_RES *res = check_res(result, "free");
+
+  if (RESval(result)->busy)
+    mysqlfailwith("Mysql.free: result is being exported");
+  if (res)
+    mysql_free_result(res);
+  free(RESval(result)->index);
+  store_free(RESval(result)->store);
+  RESval(result)->res = NULL;
+  RESval(result)->index = NULL;
+  RESval(result)->store = NULL;
+  RESval(result)->freed = 1;
+
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * make_row -- copy a row into an array of string options, NULL
+ * columns are represented by None.
+ */
 
 static value
-type2dbty (int type)
+make_row(MYSQL_ROW row, unsigned long *length, unsigned int n, value tables)
 {
-  static struct {int mysql; value caml;} map[] = {
-    {FIELD_TYPE_DECIMAL     , Val_long(DECIMAL_TY)},
-    {FIELD_TYPE_TINY        , Val_long(INT_TY)},
-    {FIELD_TYPE_SHORT       , Val_long(INT_TY)},
-    {FIELD_TYPE_LONG        , Val_long(INT_TY)},
-    {FIELD_TYPE_FLOAT       , Val_long(FLOAT_TY)},
-    {FIELD_TYPE_DOUBLE      , Val_long(FLOAT_TY)},
-    {FIELD_TYPE_NULL        , Val_long(STRING_TY)},
-    {FIELD_TYPE_TIMESTAMP   , Val_long(TIMESTAMP_TY)},
-    {FIELD_TYPE_LONGLONG    , Val_long(INT64_TY)},
-    {FIELD_TYPE_INT24       , Val_long(INT_TY)},
-    {FIELD_TYPE_DATE        , Val_long(DATE_TY)},
-    {FIELD_TYPE_TIME        , Val_long(TIME_TY)},
-    {FIELD_TYPE_DATETIME    , Val_long(DATETIME_TY)},
-    {FIELD_TYPE_YEAR        , Val_long(YEAR_TY)},
-    {FIELD_TYPE_NEWDATE     , Val_long(UNKNOWN_TY)},
-    {FIELD_TYPE_ENUM        , Val_long(ENUM_TY)},
-    {FIELD_TYPE_SET         , Val_long(SET_TY)},
-    {FIELD_TYPE_TINY_BLOB   , Val_long(BLOB_TY)},
-    {FIELD_TYPE_MEDIUM_BLOB , Val_long(BLOB_TY)},
-    {FIELD_TYPE_LONG_BLOB   , Val_long(BLOB_TY)},
-    {FIELD_TYPE_BLOB        , Val_long(BLOB_TY)},
-    {FIELD_TYPE_VAR_STRING  , Val_long(STRING_TY)},
-    {FIELD_TYPE_STRING      , Val_long(STRING_TY)},
-    {-1 /*default*/         , Val_long(UNKNOWN_TY)}
-  };
-  int i;
-
-  /* in principle using bsearch() would be better -- but how can
-   * we know that the left side of the map is properly sorted? 
-   */
+  CAMLparam1(tables);
+  CAMLlocal2(fields, s);
+  unsigned int i;
 
-  for (i=0; map[i].mysql != -1 && map[i].mysql != type; i++)
-    /* empty */ ;
+  fields = caml_alloc_tuple(n);                    /* array */
+  for (i=0;i<n;i++) {
+    s = val_str_option_intern(tables, i, row[i], length[i]);
+    Store_field(fields, i, s);
+  }
 
-  return map[i].caml;
+  CAMLreturn(fields);
 }
 
-value
-make_field(MYSQL_FIELD *f) {
-  CAMLparam0();
-  CAMLlocal5(out, data, name, table, def);
+/*
+ * db_fetch -- fetch one result tuple, represented as array of string
+ * options.  In case a value is Null, the respective value is None.
+ * Returns (Some v) in case there is such a result and None otherwise.
+ * Moves the internal result cursor to the next tuple.
+ */
 
-  name = caml_copy_string(f->name);
+EXTERNAL value
+db_fetch (value result)
+{
+  CAMLparam1(result);
+  CAMLlocal1(fields);
+  unsigned int n;
+  unsigned long *length;  /* array of long */
+  MYSQL_RES *res;
+  MYSQL_ROW row;
 
-  if (f->table)
-    table = val_str_option(f->table, strlen(f->table));
-  else
-    table = Val_none;
+  res = check_res(result, "fetch");
+  if (!res && !RESval(result)->store)
+    mysqlfailwith("Mysql.fetch: result did not return fetchable data");
 
-  if (f->def)
-    def = val_str_option(f->def, strlen(f->def));
+  n = res_num_fields(RESval(result));
+  if (n == 0)
+    mysqlfailwith("Mysql.fetch: no columns");
+
+  if (RESval(result)->store)
+  {
+    store_t *sp = RESval(result)->store;
+    if (sp->cursor >= sp->rows)
+      CAMLreturn(Val_none);
+    store_row(store_row_ptr(sp, sp->cursor++), n, sp->cells, sp->lengths);
+    row = sp->cells;
+    length = sp->lengths;
+  }
   else
-    def = Val_none;
+  {
+    row = mysql_fetch_row(res);
+    if (!row)
+      CAMLreturn(Val_none);
+    length = mysql_fetch_lengths(res);      /* length[] */
+  }
 
-  data = caml_alloc_small(7, 0);
-  Field(data, 0) = name;
-  Field(data, 1) = table;
-  Field(data, 2) = def;
-  Field(data, 3) = type2dbty(f->type);
-  Field(data, 4) = Val_long(f->max_length);
-  Field(data, 5) = Val_long(f->flags);
-  Field(data, 6) = Val_long(f->decimals);
+  /* create Some([| f1; f2; .. ;fn |]) */
+
+  fields = make_row(row, length, n, RES_intern(result));
+
+  CAMLreturn(Val_some(fields));
+}
+
+/*
+ * res_row_offset -- returns the offset of row [off] of a stored result.
+ * mysql_data_seek walks the list of rows from the head on every call,
+ * so on first use the offsets of all rows are collected into an index
+ * and later seeks are constant time.
+ */
+
+static void
+check_offset(int64_t off, uint64_t n, const char *fun)
+{
+  if (off < 0 || (uint64_t)off >= n)
+  {
+    char buf[64];
+    snprintf(buf, sizeof buf, "Mysql.%s: offset out of range", fun);
+    caml_invalid_argument(buf);
+  }
+}
+
+static MYSQL_ROW_OFFSET
+res_row_offset(value result, int64_t off, const char *fun)
+{
+  res_t *r = RESval(result);
+  MYSQL_RES *res = check_res(result, fun);
+  MYSQL_ROW_OFFSET cur, saved;
+  my_ulonglong i, n;
+
+  if (!res)
+    mysqlfailmsg("Mysql.%s: result did not return fetchable data", fun);
+
+  n = mysql_num_rows(res);
+  check_offset(off, n, fun);
+
+  if (!r->index)
+  {
+    r->index = malloc(n * sizeof(MYSQL_ROW_OFFSET));
+    if (!r->index)
+      mysqlfailmsg("Mysql.%s: cannot allocate row index", fun);
+
+    saved = mysql_row_tell(res);
+    mysql_data_seek(res, 0);
+    cur = mysql_row_tell(res);
+    mysql_row_seek(res, saved);
+
+    for (i = 0; i < n && cur; i++, cur = cur->next)
+      r->index[i] = cur;
+  }
+
+  return r->index[off];
+}
+
+/* res_store_row -- same as res_row_offset for spilled results */
+
+static const char*
+res_store_row(value result, int64_t off, const char *fun)
+{
+  store_t *sp = RESval(result)->store;
+
+  check_res(result, fun);
+  check_offset(off, sp->rows, fun);
+  return store_row_ptr(sp, off);
+}
+
+EXTERNAL value
+db_to_row(value result, value offset)
+{
+  MYSQL_ROW_OFFSET row;
+
+  if (RESval(result)->store)
+  {
+    res_store_row(result, Int64_val(offset), "to_row");
+    RESval(result)->store->cursor = Int64_val(offset);
+    return Val_unit;
+  }
+
+  row = res_row_offset(result, Int64_val(offset), "to_row");
+  mysql_row_seek(RESval(result)->res, row);
+
+  return Val_unit;
+}
+
+/*
+ * db_get_row -- returns the row at the given offset without moving the
+ * result cursor.
+ */
+
+EXTERNAL value
+db_get_row(value result, value offset)
+{
+  CAMLparam2(result, offset);
+  CAMLlocal1(fields);
+  MYSQL_ROW_OFFSET saved, off;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  store_t *sp = RESval(result)->store;
+
+  if (sp)
+  {
+    store_row(res_store_row(result, Int64_val(offset), "get_row"), sp->fields, sp->cells, sp->lengths);
+    CAMLreturn(make_row(sp->cells, sp->lengths, sp->fields, RES_intern(result)));
+  }
+
+  off = res_row_offset(result, Int64_val(offset), "get_row");
+  res = RESval(result)->res;
+  saved = mysql_row_tell(res);
+  mysql_row_seek(res, off);
+  row = mysql_fetch_row(res);
+  fields = make_row(row, mysql_fetch_lengths(res), mysql_num_fields(res), RES_intern(result));
+  mysql_row_seek(res, saved);
+
+  CAMLreturn(fields);
+}
+
+/*
+ * Lazy rows -- a row of a stored result whose columns are read straight
+ * from the MYSQL_ROW owned by the result, only the accessed columns are
+ * copied to the OCaml heap.
+ *
+ *      block with tag 0 (Mysql.Row.t)
+ *      0:      result the row belongs to (keeps it alive)
+ *      1:      block with Abstract_tag holding the MYSQL_ROWS*, or the
+ *              start of the row in the row file of spilled results
+ *
+ * Every access checks that the result was not freed meanwhile.
+ */
+
+#define LROW_result(x) Field(x,0)
+#define LROWptr(x) ((void*)Field(Field(x,1),0))
+#define LROWval(x) ((MYSQL_ROWS*)LROWptr(x))
+
+static value
+alloc_lazy_row(value result, const void *cur)
+{
+  CAMLparam1(result);
+  CAMLlocal2(ptr, v);
+
+  ptr = caml_alloc_small(1, Abstract_tag);
+  Field(ptr, 0) = (value)cur;
+  v = caml_alloc_small(2, 0);
+  Field(v, 0) = result;
+  Field(v, 1) = ptr;
+  CAMLreturn(v);
+}
+
+/* stored_length returns the length of the non-NULL column [i] of a
+ * stored row without going through mysql_fetch_lengths, which only
+ * works for the current row. Stored rows keep the columns one after
+ * another, each followed by a NUL, with data[n] pointing past the last
+ * one, so the length is the distance to the next non-NULL column.
+ */
+
+static unsigned long
+stored_length(MYSQL_ROW data, unsigned int i, unsigned int n)
+{
+  unsigned int j;
+
+  for (j = i + 1; j < n && !data[j]; j++)
+    ;
+  return data[j] - data[i] - 1;
+}
+
+/* lazy_column returns the data of column [i] (NULL for a NULL value)
+ * and stores its length in [*len].
+ */
+
+static char*
+lazy_column(value row, value index, unsigned long *len, const char *fun)
+{
+  MYSQL_ROW data;
+  unsigned int n;
+
+  check_res(LROW_result(row), fun);
+  n = res_num_fields(RESval(LROW_result(row)));
+  long i = Long_val(index);
+
+  if (i < 0 || i >= n)
+    caml_invalid_argument("index out of bounds");
+
+  if (RESval(LROW_result(row))->store)
+    return (char*)store_cell(LROWptr(row), i, len);
+
+  data = LROWval(row)->data;
+  *len = data[i] ? stored_length(data, i, n) : 0;
+  return data[i];
+}
+
+EXTERNAL value
+db_row_fetch(value result)
+{
+  CAMLparam1(result);
+  CAMLlocal1(row);
+  MYSQL_RES *res = check_res(result, "Row.fetch");
+  MYSQL_ROW_OFFSET cur;
+
+  if (!res && !RESval(result)->store)
+    mysqlfailwith("Mysql.Row.fetch: result did not return fetchable data");
+
+  if (RESval(result)->store)
+  {
+    store_t *sp = RESval(result)->store;
+    if (sp->cursor >= sp->rows)
+      CAMLreturn(Val_none);
+    row = alloc_lazy_row(result, store_row_ptr(sp, sp->cursor++));
+    CAMLreturn(Val_some(row));
+  }
+
+  cur = mysql_row_tell(res);
+  if (!cur)
+    CAMLreturn(Val_none);
+  mysql_row_seek(res, cur->next);
+
+  row = alloc_lazy_row(result, cur);
+  CAMLreturn(Val_some(row));
+}
+
+EXTERNAL value
+db_row_get(value result, value offset)
+{
+  CAMLparam2(result, offset);
+
+  if (RESval(result)->store)
+    CAMLreturn(alloc_lazy_row(result, res_store_row(result, Int64_val(offset), "Row.get")));
+
+  CAMLreturn(alloc_lazy_row(result, res_row_offset(result, Int64_val(offset), "Row.get")));
+}
+
+EXTERNAL value
+db_row_is_null(value row, value index)
+{
+  unsigned long len;
+  return Val_bool(lazy_column(row, index, &len, "Row.is_null") == NULL);
+}
+
+EXTERNAL value
+db_row_length(value row, value index)
+{
+  unsigned long len;
+  lazy_column(row, index, &len, "Row.length");
+  return Val_long(len);
+}
+
+EXTERNAL value
+db_row_get_string(value row, value index)
+{
+  CAMLparam2(row, index);
+  unsigned long len;
+  char *s = lazy_column(row, index, &len, "Row.get_string");
+
+  CAMLreturn(val_str_option_intern(RES_intern(LROW_result(row)), Long_val(index), s, len));
+}
+
+/* db_row_get_int parses the column in place, failing like int_of_string
+ * on anything but a decimal number in the range of int */
+
+EXTERNAL value
+db_row_get_int(value row, value index)
+{
+  CAMLparam2(row, index);
+  CAMLlocal1(v);
+  unsigned long len, i = 0;
+  char *s = lazy_column(row, index, &len, "Row.get_int");
+  uintnat n = 0, limit = (uintnat)Max_long + 1;
+  int neg = 0;
+
+  if (!s)
+    CAMLreturn(Val_none);
+
+  if (i < len && (s[i] == '-' || s[i] == '+'))
+    neg = s[i++] == '-';
+  if (i == len)
+    caml_failwith("int_of_string");
+  for (; i < len; i++)
+  {
+    if (s[i] < '0' || s[i] > '9' || n > (limit - (s[i] - '0')) / 10)
+      caml_failwith("int_of_string");
+    n = n * 10 + (s[i] - '0');
+  }
+  if (!neg && n == limit)
+    caml_failwith("int_of_string");
+
+  v = Val_long(neg ? -(intnat)n : (intnat)n);
+  CAMLreturn(Val_some(v));
+}
+
+EXTERNAL value
+db_row_to_array(value row)
+{
+  CAMLparam1(row);
+  CAMLlocal2(fields, s);
+  unsigned int i, n;
+  unsigned long len;
+  char *p;
+
+  check_res(LROW_result(row), "Row.to_array");
+  n = res_num_fields(RESval(LROW_result(row)));
+
+  fields = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++)
+  {
+    p = lazy_column(row, Val_int(i), &len, "Row.to_array");
+    s = val_str_option_intern(RES_intern(LROW_result(row)), i, p, len);
+    Store_field(fields, i, s);
+  }
+
+  CAMLreturn(fields);
+}
+
+/*
+ * db_build_index -- builds the row index of a stored result ahead of
+ * db_decode_row.
+ */
+
+EXTERNAL value
+db_build_index(value result)
+{
+  CAMLparam1(result);
+  MYSQL_RES *res = check_res(result, "parallel_map");
+
+  if (res && !RESval(result)->store && mysql_num_rows(res) > 0)
+    res_row_offset(result, 0, "parallel_map");
+
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * db_decode_row -- returns the row at the given offset like db_get_row,
+ * but only reads the result: neither the cursor nor the lengths of the
+ * current row are used, and values are not interned.  Once the index
+ * is built it can be called from several domains at once.
+ */
+
+EXTERNAL value
+db_decode_row(value result, value offset)
+{
+  CAMLparam2(result, offset);
+  CAMLlocal2(fields, s);
+  MYSQL_ROW data = NULL;
+  const char *p = NULL, *cell;
+  unsigned int i, n;
+  unsigned long len;
+
+  if (RESval(result)->store)
+    p = res_store_row(result, Int64_val(offset), "parallel_map");
+  else
+    data = res_row_offset(result, Int64_val(offset), "parallel_map")->data;
+  n = res_num_fields(RESval(result));
+
+  fields = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++)
+  {
+    if (p)
+    {
+      cell = store_cell(p, 0, &len);
+      p = (cell ? cell : p + sizeof(uint32_t)) + len;
+    }
+    else
+    {
+      cell = data[i];
+      len = cell ? stored_length(data, i, n) : 0;
+    }
+    s = val_str_option(cell, len);
+    Store_field(fields, i, s);
+  }
+
+  CAMLreturn(fields);
+}
+
+/*
+ * Export -- rows formatted as CSV, TSV or JSON lines straight from the
+ * result memory into a large buffer written to a file descriptor.  No
+ * OCaml value is touched once the export has started, so the whole of
+ * it runs in a blocking section.
+ */
+
+#define EXPORT_BUF (1 << 20)
+
+enum { EXPORT_CSV, EXPORT_TSV, EXPORT_JSON };
+
+typedef struct {
+  int fd;
+  int format;
+  char *buf;
+  size_t len;
+  int err;                      /* errno of the failed write, or -1 */
+} export_t;
+
+static void
+export_flush(export_t *o)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (!o->err && done < o->len)
+  {
+    n = write(o->fd, o->buf + done, o->len - done);
+    if (n < 0 && errno != EINTR)
+      o->err = errno;
+    else if (n == 0)
+      o->err = EIO; /* no progress, would loop forever */
+    else if (n > 0)
+      done += n;
+  }
+  o->len = 0;
+}
+
+static void
+export_put(export_t *o, const char *p, size_t n)
+{
+  size_t k;
+
+  while (n > 0 && !o->err)
+  {
+    if (o->len == EXPORT_BUF)
+      export_flush(o);
+    k = EXPORT_BUF - o->len < n ? EXPORT_BUF - o->len : n;
+    memcpy(o->buf + o->len, p, k);
+    o->len += k;
+    p += k;
+    n -= k;
+  }
+}
+
+#define export_str(o, s) export_put(o, s, sizeof(s) - 1)
+
+/* escape sequence of [c] in the current format, NULL if none needed */
+static const char*
+export_escape(export_t *o, unsigned char c, char *tmp)
+{
+  switch (o->format)
+  {
+    case EXPORT_CSV:
+      return c == '"' ? "\"\"" : NULL;
+    case EXPORT_TSV:
+      switch (c)
+      {
+        case '\\': return "\\\\";
+        case '\t': return "\\t";
+        case '\n': return "\\n";
+        case '\r': return "\\r";
+        case '\0': return "\\0";
+        default: return NULL;
+      }
+    default:
+      switch (c)
+      {
+        case '"': return "\\\"";
+        case '\\': return "\\\\";
+        case '\n': return "\\n";
+        case '\r': return "\\r";
+        case '\t': return "\\t";
+        default:
+          if (c >= 0x20)
+            return NULL;
+          snprintf(tmp, 8, "\\u%04x", c);
+          return tmp;
+      }
+  }
+}
+
+/* copies the runs of bytes needing no escape in one go */
+static void
+export_escaped(export_t *o, const char *p, size_t n)
+{
+  size_t i, start = 0;
+  const char *e;
+  char tmp[8];
+
+  for (i = 0; i < n; i++)
+  {
+    e = export_escape(o, (unsigned char)p[i], tmp);
+    if (!e)
+      continue;
+    export_put(o, p + start, i - start);
+    export_put(o, e, strlen(e));
+    start = i + 1;
+  }
+  export_put(o, p + start, n - start);
+}
+
+static int
+export_csv_quoted(const char *p, size_t n)
+{
+  size_t i;
+
+  if (n == 0)
+    return 1; /* tells empty strings from NULL */
+  for (i = 0; i < n; i++)
+    if (p[i] == ',' || p[i] == '"' || p[i] == '\n' || p[i] == '\r')
+      return 1;
+  return 0;
+}
+
+static int
+export_numeric(enum enum_field_types t)
+{
+  switch (t)
+  {
+    case MYSQL_TYPE_TINY: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG: case MYSQL_TYPE_INT24: case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE:
+    case MYSQL_TYPE_DECIMAL: case MYSQL_TYPE_NEWDECIMAL:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static void
+export_value(export_t *o, MYSQL_FIELD *field, unsigned int i, const char *p, size_t n)
+{
+  switch (o->format)
+  {
+    case EXPORT_CSV:
+      if (i > 0)
+        export_str(o, ",");
+      if (!p)
+        break;
+      if (!export_csv_quoted(p, n))
+        export_put(o, p, n);
+      else
+      {
+        export_str(o, "\"");
+        export_escaped(o, p, n);
+        export_str(o, "\"");
+      }
+      break;
+    case EXPORT_TSV:
+      if (i > 0)
+        export_str(o, "\t");
+      if (!p)
+        export_str(o, "\\N");
+      else
+        export_escaped(o, p, n);
+      break;
+    default:
+      if (i > 0)
+        export_str(o, ",\"");
+      else
+        export_str(o, "{\"");
+      export_escaped(o, field[i].name, strlen(field[i].name));
+      export_str(o, "\":");
+      if (!p)
+        export_str(o, "null");
+      else if (export_numeric(field[i].type) && n > 0)
+        export_put(o, p, n);
+      else
+      {
+        export_str(o, "\"");
+        export_escaped(o, p, n);
+        export_str(o, "\"");
+      }
+  }
+}
+
+static void
+export_end_row(export_t *o)
+{
+  if (o->format == EXPORT_JSON)
+    export_str(o, "}\n");
+  else
+    export_str(o, "\n");
+}
+
+static void
+export_header(export_t *o, MYSQL_FIELD *fields, unsigned int n)
+{
+  unsigned int i;
+
+  if (o->format == EXPORT_JSON)
+    return;
+  for (i = 0; i < n; i++)
+    export_value(o, fields, i, fields[i].name, strlen(fields[i].name));
+  export_end_row(o);
+}
+
+static export_t*
+export_create(value v_fd, value v_format)
+{
+  export_t *o = calloc(1, sizeof(export_t));
+
+  if (!o || !(o->buf = malloc(EXPORT_BUF)))
+  {
+    free(o);
+    caml_raise_out_of_memory();
+  }
+  o->fd = Int_val(v_fd);
+  o->format = Int_val(v_format);
+  return o;
+}
+
+static void
+export_finish(export_t *o, const char *fun)
+{
+  int err;
+
+  if (!o->err)
+    export_flush(o);
+  err = o->err;
+  free(o->buf);
+  free(o);
+  if (err)
+    mysqlfailmsg("Mysql.%s: %s", fun, strerror(err));
+}
+
+EXTERNAL value
+db_export(value result, value v_format, value v_header, value v_fd)
+{
+  CAMLparam4(result, v_format, v_header, v_fd);
+  res_t *r = RESval(result);
+  MYSQL_RES *res = check_res(result, "export");
+  MYSQL_FIELD *fields = res_fields(r);
+  MYSQL_ROW data = NULL;
+  const char *p = NULL, *cell;
+  uint64_t row, rows = res_num_rows(r);
+  unsigned int i, n = res_num_fields(r);
+  unsigned long len;
+  int header = Bool_val(v_header);
+  store_t *store = r->store;
+  MYSQL_ROW_OFFSET *index;
+  export_t *o;
+
+  if (!res && !store)
+    mysqlfailwith("Mysql.export: result did not return fetchable data");
+  if (!store && rows > 0)
+    res_row_offset(result, 0, "export"); /* builds the index */
+  index = r->index;
+  o = export_create(v_fd, v_format);
+
+  /* only C locals are used from now on, the result is pinned so that
+     Mysql.free from another thread cannot release the rows */
+  r->busy++;
+  caml_enter_blocking_section();
+  if (header)
+    export_header(o, fields, n);
+  for (row = 0; row < rows && !o->err; row++)
+  {
+    if (store)
+      p = store_row_ptr(store, row);
+    else
+      data = index[row]->data;
+    for (i = 0; i < n; i++)
+    {
+      if (p)
+      {
+        cell = store_cell(p, 0, &len);
+        p = (cell ? cell : p + sizeof(uint32_t)) + len;
+      }
+      else
+      {
+        cell = data[i];
+        len = cell ? stored_length(data, i, n) : 0;
+      }
+      export_value(o, fields, i, cell, len);
+    }
+    export_end_row(o);
+  }
+  caml_leave_blocking_section();
+  RESval(result)->busy--;
+
+  export_finish(o, "export");
+  CAMLreturn(caml_copy_int64(rows));
+}
+
+/*
+ * Snapshots -- a result saved with its fields description in a single
+ * buffer, which can be loaded back (or mapped from a file) as a result
+ * without a connection.  The rows keep the row file layout of spilled
+ * results, so that the same code serves both.
+ *
+ * Layout (native byte order, checked with the bom field):
+ *
+ *      header: snap_header_t
+ *      fields: for each field a snap_field_t followed by the name, the
+ *              table and the default value (when present) as C strings
+ *      rows:   8 byte aligned, same as the row file of spilled results
+ *      index:  8 byte aligned array of uint64_t, offset of each row from
+ *              the first one
+ */
+
+#define SNAP_MAGIC "OCMYSNP1"
+#define SNAP_BOM 0x01020304u
+
+#define SNAP_HAS_TABLE 1
+#define SNAP_HAS_DEF 2
+
+typedef struct snap_header_tag
+{
+  char magic[8];
+  uint32_t bom;
+  uint32_t fields;
+  uint64_t rows;
+  uint64_t data_off;
+  uint64_t index_off;
+} snap_header_t;
+
+typedef struct snap_field_tag
+{
+  uint32_t type;
+  uint32_t flags;
+  uint32_t decimals;
+  uint32_t strings;             /* SNAP_HAS_TABLE | SNAP_HAS_DEF */
+  uint64_t max_length;
+} snap_field_t;
+
+typedef struct snap_writer_tag
+{
+  char *out;                    /* NULL to compute the size only */
+  size_t pos;
+  uint64_t row_off;             /* offset of the next row, for the index */
+} snap_writer_t;
+
+static void
+snap_put(snap_writer_t *w, const void *src, size_t len)
+{
+  if (w->out && len)
+    memcpy(w->out + w->pos, src, len);
+  w->pos += len;
+}
+
+static void
+snap_align(snap_writer_t *w)
+{
+  static const char pad[8];
+  snap_put(w, pad, (8 - w->pos % 8) % 8);
+}
+
+static void
+snap_put_row(snap_writer_t *w, char **cells, unsigned long *lengths, unsigned int n)
+{
+  unsigned int i;
+  uint32_t l;
+
+  for (i = 0; i < n; i++)
+  {
+    l = cells[i] ? (uint32_t)lengths[i] : STORE_NULL;
+    snap_put(w, &l, sizeof l);
+    snap_put(w, cells[i], lengths[i]);
+  }
+}
+
+static void
+snap_put_index(snap_writer_t *w, char **cells, unsigned long *lengths, unsigned int n)
+{
+  unsigned int i;
+
+  snap_put(w, &w->row_off, sizeof w->row_off);
+  for (i = 0; i < n; i++)
+    w->row_off += sizeof(uint32_t) + lengths[i];
+  (void)cells;
+}
+
+/* snap_rows -- calls [f] on every row of a result, in order, without
+ * moving the cursor.  [cells] and [lengths] are scratch buffers of
+ * res_num_fields(r) entries. */
+
+typedef void (*snap_row_fn)(snap_writer_t *w, char **cells, unsigned long *lengths, unsigned int n);
+
+static void
+snap_rows(res_t *r, snap_row_fn f, snap_writer_t *w, char **cells, unsigned long *lengths)
+{
+  unsigned int i, n = res_num_fields(r);
+  MYSQL_ROW_OFFSET cur, saved;
+  uint64_t k;
+
+  if (r->store)
+  {
+    for (k = 0; k < r->store->rows; k++)
+    {
+      store_row(store_row_ptr(r->store, k), n, cells, lengths);
+      f(w, cells, lengths, n);
+    }
+    return;
+  }
+  if (!r->res)
+    return;
+
+  saved = mysql_row_tell(r->res);
+  mysql_data_seek(r->res, 0);
+  cur = mysql_row_tell(r->res);
+  mysql_row_seek(r->res, saved);
+  for (; cur; cur = cur->next)
+  {
+    for (i = 0; i < n; i++)
+    {
+      cells[i] = cur->data[i];
+      lengths[i] = cur->data[i] ? stored_length(cur->data, i, n) : 0;
+    }
+    f(w, cells, lengths, n);
+  }
+}
+
+/*
+ * snapshot_write -- writes the snapshot of [r] into [out] and returns
+ * its size.  When [out] is NULL only the size is computed.
+ */
+
+static size_t
+snapshot_write(res_t *r, char *out, char **cells, unsigned long *lengths)
+{
+  MYSQL_FIELD *f = res_fields(r);
+  unsigned int i, n = res_num_fields(r);
+  snap_writer_t w = { out, 0, 0 };
+  snap_header_t h;
+  snap_field_t sf;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, SNAP_MAGIC, sizeof h.magic);
+  h.bom = SNAP_BOM;
+  h.fields = n;
+  h.rows = res_num_rows(r);
+  snap_put(&w, &h, sizeof h);
+
+  for (i = 0; i < n; i++)
+  {
+    sf.type = f[i].type;
+    sf.flags = f[i].flags;
+    sf.decimals = f[i].decimals;
+    sf.strings = (f[i].table ? SNAP_HAS_TABLE : 0) | (f[i].def ? SNAP_HAS_DEF : 0);
+    sf.max_length = f[i].max_length;
+    snap_put(&w, &sf, sizeof sf);
+    snap_put(&w, f[i].name, strlen(f[i].name) + 1);
+    if (f[i].table)
+      snap_put(&w, f[i].table, strlen(f[i].table) + 1);
+    if (f[i].def)
+      snap_put(&w, f[i].def, strlen(f[i].def) + 1);
+  }
+  snap_align(&w);
+
+  h.data_off = w.pos;
+  snap_rows(r, snap_put_row, &w, cells, lengths);
+  snap_align(&w);
+  h.index_off = w.pos;
+  snap_rows(r, snap_put_index, &w, cells, lengths);
+
+  if (out)
+    memcpy(out, &h, sizeof h);
+  return w.pos;
+}
+
+/* snapshot_dump -- returns a malloc'ed snapshot of [r] in [*out] and
+ * its size, or 0 if out of memory */
+
+static size_t
+snapshot_dump(res_t *r, char **out)
+{
+  unsigned int n = res_num_fields(r);
+  char **cells = malloc((n + 1) * sizeof(char*));
+  unsigned long *lengths = malloc((n + 1) * sizeof(unsigned long));
+  size_t size = 0;
+
+  *out = NULL;
+  if (cells && lengths)
+  {
+    size = snapshot_write(r, NULL, cells, lengths);
+    *out = malloc(size);
+    if (*out)
+      snapshot_write(r, *out, cells, lengths);
+    else
+      size = 0;
+  }
+  free(cells);
+  free(lengths);
+  return size;
+}
+
+/* snap_string -- reads a C string at [*pos], NULL if it is not
+ * terminated within the [size] bytes of [mem] */
+
+static char*
+snap_string(char *mem, size_t size, size_t *pos)
+{
+  char *s = mem + *pos;
+  char *end = *pos < size ? memchr(s, 0, size - *pos) : NULL;
+
+  if (!end)
+    return NULL;
+  *pos += end - s + 1;
+  return s;
+}
+
+/* snap_row_ok -- checks that the cells of the row at [off] lie within
+ * the [size] bytes of [data] */
+
+static int
+snap_row_ok(const char *data, uint64_t size, uint64_t off, unsigned int fields)
+{
+  unsigned int i;
+  uint32_t l;
+
+  for (i = 0; i < fields; i++)
+  {
+    if (off > size || size - off < sizeof l)
+      return 0;
+    memcpy(&l, data + off, sizeof l);
+    off += sizeof l;
+    if (l != STORE_NULL)
+    {
+      if (size - off < l)
+        return 0;
+      off += l;
+    }
+  }
+  return 1;
+}
+
+/*
+ * snapshot_load -- builds the store of a snapshot held in [mem], which
+ * it takes ownership of.  Returns NULL (and releases nothing) when the
+ * buffer is not a valid snapshot, with the reason in [*err].  The cells
+ * of every row are checked to lie within the buffer, except for
+ * [mapped] snapshots where only the structure is checked, so that
+ * mapping a file does not read all of it.
+ */
+
+static store_t*
+snapshot_load(char *mem, size_t size, int mapped, const char **err)
+{
+  snap_header_t h;
+  snap_field_t sf;
+  store_t *s;
+  size_t pos = sizeof h;
+  uint64_t k, data_size;
+  unsigned int i;
+
+  *err = "not a snapshot";
+  if (size < sizeof h)
+    return NULL;
+  memcpy(&h, mem, sizeof h);
+  if (memcmp(h.magic, SNAP_MAGIC, sizeof h.magic))
+    return NULL;
+  *err = "snapshot from a different architecture";
+  if (h.bom != SNAP_BOM)
+    return NULL;
+  *err = "corrupted snapshot";
+  if (h.data_off % 8 || h.index_off % 8 || h.data_off < sizeof h ||
+      h.data_off > h.index_off || h.index_off > size ||
+      h.rows > (size - h.index_off) / sizeof(uint64_t) ||
+      h.fields > (h.data_off - sizeof h) / sizeof(snap_field_t))
+    return NULL;
+
+  s = calloc(1, sizeof(store_t));
+  if (!s || !(s->defs = calloc((size_t)h.fields + 1, sizeof(MYSQL_FIELD))))
+  {
+    free(s);
+    *err = "out of memory";
+    return NULL;
+  }
+  s->fields = h.fields;
+  s->rows = h.rows;
+
+  for (i = 0; i < h.fields; i++)
+  {
+    if (pos + sizeof sf > h.data_off)
+      goto corrupted;
+    memcpy(&sf, mem + pos, sizeof sf);
+    pos += sizeof sf;
+    s->defs[i].type = sf.type;
+    s->defs[i].flags = sf.flags;
+    s->defs[i].decimals = sf.decimals;
+    s->defs[i].max_length = sf.max_length;
+    if (!(s->defs[i].name = snap_string(mem, h.data_off, &pos)))
+      goto corrupted;
+    if ((sf.strings & SNAP_HAS_TABLE) && !(s->defs[i].table = snap_string(mem, h.data_off, &pos)))
+      goto corrupted;
+    if ((sf.strings & SNAP_HAS_DEF) && !(s->defs[i].def = snap_string(mem, h.data_off, &pos)))
+      goto corrupted;
+  }
+
+  s->data = mem + h.data_off;
+  s->index = (const uint64_t*)(mem + h.index_off);
+  data_size = h.index_off - h.data_off;
+  for (k = 0; k < h.rows; k++)
+  {
+    if (s->index[k] > data_size || data_size - s->index[k] < (uint64_t)h.fields * sizeof(uint32_t))
+      goto corrupted;
+    if (!mapped && !snap_row_ok(s->data, data_size, s->index[k], h.fields))
+      goto corrupted;
+  }
+
+  if (!store_alloc_row(s))
+  {
+    *err = "out of memory";
+    goto failed;
+  }
+  s->mem = mem;
+  s->size = size;
+  s->mapped = mapped;
+  return s;
+
+corrupted:
+  *err = "corrupted snapshot";
+failed:
+  store_free(s);
+  return NULL;
+}
+
+EXTERNAL value
+db_snapshot_to_bytes(value result)
+{
+  CAMLparam1(result);
+  CAMLlocal1(out);
+  char *buf;
+  size_t size;
+
+  check_res(result, "Snapshot.to_bytes");
+  size = snapshot_dump(RESval(result), &buf);
+  if (!buf)
+    mysqlfailwith("Mysql.Snapshot.to_bytes: out of memory");
+
+  out = caml_alloc_string(size);
+  memcpy(Bytes_val(out), buf, size);
+  free(buf);
+
+  CAMLreturn(out);
+}
+
+EXTERNAL value
+db_snapshot_of_bytes(value v_bytes)
+{
+  CAMLparam1(v_bytes);
+  size_t size = caml_string_length(v_bytes);
+  char *mem = malloc(size ? size : 1);
+  const char *err;
+  store_t *s;
+
+  if (!mem)
+    mysqlfailwith("Mysql.Snapshot.of_bytes: out of memory");
+  memcpy(mem, Bytes_val(v_bytes), size);
+
+  s = snapshot_load(mem, size, 0, &err);
+  if (!s)
+  {
+    free(mem);
+    mysqlfailmsg("Mysql.Snapshot.of_bytes: %s", err);
+  }
+
+  CAMLreturn(alloc_res(NULL, s));
+}
+
+EXTERNAL value
+db_snapshot_map_file(value v_path)
+{
+  CAMLparam1(v_path);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.Snapshot.map_file: not supported on this platform");
+  CAMLreturn(Val_unit);
+#else
+  char *path = strdup(String_val(v_path));
+  const char *err = NULL;
+  char *mem = NULL;
+  store_t *s = NULL;
+  struct stat st;
+  int fd, e = 0;
+
+  if (!path)
+    mysqlfailwith("Mysql.Snapshot.map_file: out of memory");
+
+  caml_enter_blocking_section();
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st))
+    e = errno;
+  else if (st.st_size == 0)
+    err = "not a snapshot";
+  else if ((mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    e = errno;
+    mem = NULL;
+  }
+  if (fd >= 0)
+    close(fd);
+  if (mem && !(s = snapshot_load(mem, st.st_size, 1, &err)))
+    munmap(mem, st.st_size);
+  caml_leave_blocking_section();
+
+  free(path);
+  if (e)
+    mysqlfailmsg("Mysql.Snapshot.map_file: %s: %s", String_val(v_path), strerror(e));
+  if (!s)
+    mysqlfailmsg("Mysql.Snapshot.map_file: %s: %s", String_val(v_path), err);
+
+  CAMLreturn(alloc_res(NULL, s));
+#endif
+}
+
+/*
+ * Marshalling of results goes through snapshots, a marshalled result
+ * is read back as a snapshot.
+ */
+
+static void
+res_serialize(value handle, uintnat *wsize_32, uintnat *wsize_64)
+{
+  res_t *r = (res_t*)Data_custom_val(handle);
+  char *buf = NULL;
+  size_t size = 0;
+
+  if (!r->freed)
+  {
+    size = snapshot_dump(r, &buf);
+    if (!buf)
+      caml_failwith("Mysql: cannot marshal result, out of memory");
+  }
+  caml_serialize_int_8(size);
+  caml_serialize_block_1(buf, size);
+  free(buf);
+
+  *wsize_32 = sizeof(res_t);
+  *wsize_64 = sizeof(res_t);
+}
+
+static uintnat
+res_deserialize(void *dst)
+{
+  res_t *r = (res_t*)dst;
+  size_t size = caml_deserialize_uint_8();
+  const char *err;
+  char *mem;
+
+  r->res = NULL;
+  r->index = NULL;
+  r->store = NULL;
+  r->busy = 0;
+  r->freed = (size == 0);
+  if (size)
+  {
+    if (!(mem = malloc(size)))
+      caml_deserialize_error("Mysql: cannot unmarshal result, out of memory");
+    caml_deserialize_block_1(mem, size);
+    if (!(r->store = snapshot_load(mem, size, 0, &err)))
+    {
+      free(mem);
+      caml_deserialize_error((char*)err);
+    }
+  }
+
+  return sizeof(res_t);
+}
+
+EXTERNAL value
+db_register_ops(value v_unit)
+{
+  caml_register_custom_operations(&res_ops);
+  return Val_unit;
+}
+
+/*
+ * db_status -- returns current status (simplistic)
+ */
+
+EXTERNAL value
+db_status(value dbd)
+{
+  CAMLparam1(dbd);
+  CAMLreturn(Val_int(mysql_errno(check_db(dbd,"status"))));
+}
+
+/*
+ * db_errmsg -- returns string option with last error message (None ==
+ * no error)
+ */
+
+EXTERNAL value
+db_errmsg(value dbd)
+{
+  CAMLparam1(dbd);
+  CAMLlocal1(s);
+  const char *msg;
+
+  msg = mysql_error(check_db(dbd,"errmsg"));
+  if (!msg || msg[0] == '\0')
+    msg = (char*) NULL;
+  s = val_str_option(msg, msg == (char *) NULL ? 0 : strlen(msg));
+  CAMLreturn(s);
+}
+
+/*
+ * Escaping.  Most strings need no escaping at all: they are detected by
+ * a vectorized scan and returned as is.  Other strings which are ASCII
+ * (or in a single byte character set) are escaped straight into the
+ * result, whose size is known from the scan.  Only the remaining ones
+ * go through the client library, which knows about multi-byte
+ * character sets.
+ */
+
+/* escape_to[c] is the character following the backslash when c is
+ * escaped, 0 when c is kept as is */
+
+static const char escape_to[256] = {
+  ['\0'] = '0', ['\n'] = 'n', ['\r'] = 'r', ['\\'] = '\\',
+  ['\''] = '\'', ['"'] = '"', ['\032'] = 'Z',
+};
+
+typedef struct escape_scan_tag
+{
+  size_t specials;              /* characters escaped with a backslash */
+  size_t quotes;                /* single quotes */
+  int ascii;
+} escape_scan_t;
+
+static void
+escape_scan_bytes(const unsigned char *s, size_t len, escape_scan_t *e)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    e->specials += escape_to[s[i]] != 0;
+    e->quotes += s[i] == '\'';
+    e->ascii &= s[i] < 0x80;
+  }
+}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+
+static void
+escape_scan(const unsigned char *s, size_t len, escape_scan_t *e)
+{
+  const __m128i nul = _mm_setzero_si128();
+  const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+  const __m128i bs = _mm_set1_epi8('\\'), quote = _mm_set1_epi8('\'');
+  const __m128i dquote = _mm_set1_epi8('"'), ctrlz = _mm_set1_epi8('\032');
+  __m128i v, q, m;
+  size_t i;
+
+  e->specials = e->quotes = 0;
+  e->ascii = 1;
+  for (i = 0; i + 16 <= len; i += 16)
+  {
+    v = _mm_loadu_si128((const __m128i*)(s + i));
+    q = _mm_cmpeq_epi8(v, quote);
+    m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, lf)),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, bs)));
+    m = _mm_or_si128(_mm_or_si128(m, q),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, ctrlz)));
+    e->specials += __builtin_popcount(_mm_movemask_epi8(m));
+    e->quotes += __builtin_popcount(_mm_movemask_epi8(q));
+    e->ascii &= _mm_movemask_epi8(v) == 0;
+  }
+  escape_scan_bytes(s + i, len - i, e);
+}
+
+#else
+
+/* SWAR: test 8 bytes at once, count byte by byte only the words
+ * holding something */
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_HAS(x, c) ((((x) ^ (SWAR_ONES * (c))) - SWAR_ONES) & ~((x) ^ (SWAR_ONES * (c))) & SWAR_HIGHS)
+
+static void
+escape_scan(const unsigned char *s, size_t len, escape_scan_t *e)
+{
+  uint64_t x;
+  size_t i;
+
+  e->specials = e->quotes = 0;
+  e->ascii = 1;
+  for (i = 0; i + 8 <= len; i += 8)
+  {
+    memcpy(&x, s + i, sizeof x);
+    if ((x & SWAR_HIGHS) || SWAR_HAS(x, 0) || SWAR_HAS(x, '\n') || SWAR_HAS(x, '\r') ||
+        SWAR_HAS(x, '\\') || SWAR_HAS(x, '\'') || SWAR_HAS(x, '"') || SWAR_HAS(x, '\032'))
+      escape_scan_bytes(s + i, 8, e);
+  }
+  escape_scan_bytes(s + i, len - i, e);
+}
+
+#endif
+
+/* escape_into -- escapes [s] into [out], which must hold the size
+ * computed by escape_scan, like mysql_real_escape_string for a single
+ * byte character set.  With NO_BACKSLASH_ESCAPES only quotes are
+ * doubled. */
+
+static void
+escape_into(char *out, const unsigned char *s, size_t len, int no_backslash)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (no_backslash ? s[i] == '\'' : escape_to[s[i]] != 0)
+    {
+      *out++ = no_backslash ? '\'' : '\\';
+      *out++ = no_backslash ? '\'' : escape_to[s[i]];
+    }
+    else
+      *out++ = s[i];
+  }
+}
+
+/* multi-byte character sets where the second byte of a character can be
+ * a backslash or a quote, which need the client library to escape.  The
+ * bytes of the multi-byte characters of the others (utf8mb3, utf8mb4,
+ * ujis...) are all 0x80 and above, so escape_into does the same. */
+static int
+escape_unsafe_charset(const char *name)
+{
+  static const char *unsafe[] = { "big5", "cp932", "gbk", "gb18030", "sjis" };
+  size_t i;
+
+  for (i = 0; i < sizeof unsafe / sizeof unsafe[0]; i++)
+    if (name && 0 == strcmp(name, unsafe[i]))
+      return 1;
+  return 0;
+}
+
+/* escape_direct -- escapes [str] in OCaml, the scan having found that
+ * the library is not needed.  Returns [str] itself when there is
+ * nothing to escape. */
+
+static value
+escape_direct(value str, escape_scan_t *e, int no_backslash)
+{
+  CAMLparam1(str);
+  CAMLlocal1(res);
+  size_t len = caml_string_length(str);
+  size_t extra = no_backslash ? e->quotes : e->specials;
+
+  if (extra == 0)
+    CAMLreturn(str);
+
+  res = caml_alloc_string(len + extra);
+  escape_into((char*)Bytes_val(res), (const unsigned char*)String_val(str), len, no_backslash);
+  CAMLreturn(res);
+}
+
+/*
+ * db_escape - takes a string and escape all characters inside which
+ * must be escaped inside MySQL strings.  This helps to construct SQL
+ * statements easily.  Simply returns the new string including the
+ * quotes.
+ */
+
+EXTERNAL value
+db_escape(value str)
+{
+  CAMLparam1(str);
+  char *s;
+  char *buf;
+  int len, esclen;
+  CAMLlocal1(res);
+  escape_scan_t e;
+
+  escape_scan((const unsigned char*)String_val(str), caml_string_length(str), &e);
+  if (e.ascii)
+    CAMLreturn(escape_direct(str, &e, 0));
+
+  /* the default character set of the library is not known here, the
+   * library is initialized when the module is loaded */
+  s = String_val(str);
+  len = caml_string_length(str);
+  buf = (char*)caml_stat_alloc(2*len+1);
+  esclen = mysql_escape_string(buf,s,len);
+
+  res = caml_alloc_string(esclen);
+  memcpy(String_val(res), buf, esclen);
+  caml_stat_free(buf);
+
+  CAMLreturn(res);
+}
+
+EXTERNAL value
+db_real_escape(value dbd, value str)
+{
+  CAMLparam2(dbd, str);
+  char *s;
+  char *buf;
+  int len, esclen;
+  MYSQL *mysql;
+  CAMLlocal1(res);
+  escape_scan_t e;
+  MY_CHARSET_INFO cs;
+
+  mysql = check_db(dbd, "real_escape");
+
+  escape_scan((const unsigned char*)String_val(str), caml_string_length(str), &e);
+  if (!e.ascii)
+    mysql_get_character_set_info(mysql, &cs);
+  if (e.ascii || cs.mbmaxlen == 1 || !escape_unsafe_charset(cs.csname))
+    CAMLreturn(escape_direct(str, &e, (mysql->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES) != 0));
+
+  s = String_val(str);
+  len = caml_string_length(str);
+  buf = (char*)caml_stat_alloc(2*len+1);
+  /*
+   * mysql_real_escape doesn't perform network I/O,
+   * so no need for blocking section (and extra copying)
+   * */
+  esclen = mysql_real_escape_string(mysql,buf,s,len);
+
+  res = caml_alloc_string(esclen);
+  memcpy(String_val(res), buf, esclen);
+  caml_stat_free(buf);
+
+  CAMLreturn(res);
+}
+
+EXTERNAL value
+db_set_charset(value dbd, value str)
+{
+  CAMLparam2(dbd, str);
+  char *s;
+  MYSQL *mysql;
+  int res;
+
+  mysql = check_db(dbd, "set_charset");
+
+  s = strdup(String_val(str));
+  caml_enter_blocking_section();
+  res = mysql_set_character_set(mysql,s);
+  free(s);
+  caml_leave_blocking_section();
+
+  if (res)
+    mysqlfailmsg("Mysql.set_charset : %s",mysql_error(mysql));
+
+  CAMLreturn(Val_unit);
+}
+
+/*
+ * db_size -- returns the size of the current result (number of rows).
+ */
+
+EXTERNAL value
+db_size(value result)
+{
+  CAMLparam1(result);
+  int64_t size;
+
+  check_res(result, "size");
+  size = (int64_t)res_num_rows(RESval(result));
+
+  CAMLreturn(caml_copy_int64(size));
+}
+
+EXTERNAL value
+db_affected(value dbd) {
+  CAMLparam1(dbd);
+  CAMLreturn(caml_copy_int64(mysql_affected_rows(DBDmysql(dbd))));
+}
+
+EXTERNAL value
+db_insert_id(value dbd) {
+  CAMLparam1(dbd);
+  CAMLreturn(caml_copy_int64(mysql_insert_id(DBDmysql(dbd))));
+}
+
+EXTERNAL value
+db_fields(value result)
+{
+  check_res(result, "fields");
+  return Val_long(res_num_fields(RESval(result)));
+}
+
+EXTERNAL value
+db_client_info(value unit) {
+  CAMLparam1(unit);
+  CAMLlocal1(info);
+  info = caml_copy_string(mysql_get_client_info());
+  CAMLreturn(info);
+}
+
+EXTERNAL value
+db_host_info(value dbd) {
+  CAMLparam1(dbd);
+  CAMLlocal1(info);
+  info = caml_copy_string(mysql_get_host_info(DBDmysql(dbd)));
+  CAMLreturn(info);
+}
+
+EXTERNAL value
+db_server_info(value dbd) {
+  CAMLparam1(dbd);
+  CAMLlocal1(info);
+  info = caml_copy_string(mysql_get_server_info(DBDmysql(dbd)));
+  CAMLreturn(info);
+}
+
+EXTERNAL value
+db_proto_info(value dbd) {
+  long info = (long)mysql_get_proto_info(DBDmysql(dbd));
+  return Val_long(info);
+}
+
+/* db_session_key identifies the data a query on [dbd] sees: user, server
+ * and current database */
+EXTERNAL value
+db_session_key(value dbd) {
+  CAMLparam1(dbd);
+  CAMLlocal1(key);
+  MYSQL *mysql = check_db(dbd, "session_key");
+  size_t len = 32;
+  char *buf;
+
+  len += mysql->user ? strlen(mysql->user) : 0;
+  len += mysql->host ? strlen(mysql->host) : 0;
+  len += mysql->unix_socket ? strlen(mysql->unix_socket) : 0;
+  len += mysql->db ? strlen(mysql->db) : 0;
+  buf = caml_stat_alloc(len);
+  snprintf(buf, len, "%s@%s:%u:%s/%s",
+           mysql->user ? mysql->user : "", mysql->host ? mysql->host : "", mysql->port,
+           mysql->unix_socket ? mysql->unix_socket : "", mysql->db ? mysql->db : "");
+  key = caml_copy_string(buf);
+  caml_stat_free(buf);
+  CAMLreturn(key);
+}
+
+/* db_in_transaction tells whether the last response of the server reported
+ * an open transaction or autocommit off, still known once the connection
+ * is lost */
+EXTERNAL value
+db_in_transaction(value dbd) {
+  MYSQL *mysql = check_db(dbd, "in_transaction");
+  return Val_bool((mysql->server_status & SERVER_STATUS_IN_TRANS) != 0
+                  || (mysql->server_status & SERVER_STATUS_AUTOCOMMIT) == 0);
+}
+
+
+/*
+ * type2dbty - maps column types to dbty values which describe the
+ * column types in OCaml.
+ */
+
+#define INT_TY          0
+#define FLOAT_TY        1
+#define STRING_TY       2
+#define SET_TY          3
+#define ENUM_TY         4
+#define DATETIME_TY     5
+#define DATE_TY         6
+#define TIME_TY         7
+#define YEAR_TY         8
+#define TIMESTAMP_TY    9
+#define UNKNOWN_TY      10
+#define INT64_TY        11
+#define BLOB_TY         12
+#define DECIMAL_TY			13
+
+static value
+type2dbty (int type)
+{
+  /* a switch over the field type compiles to a jump table */
+  switch (type)
+  {
+    case FIELD_TYPE_DECIMAL     : return Val_long(DECIMAL_TY);
+    case FIELD_TYPE_TINY        : return Val_long(INT_TY);
+    case FIELD_TYPE_SHORT       : return Val_long(INT_TY);
+    case FIELD_TYPE_LONG        : return Val_long(INT_TY);
+    case FIELD_TYPE_FLOAT       : return Val_long(FLOAT_TY);
+    case FIELD_TYPE_DOUBLE      : return Val_long(FLOAT_TY);
+    case FIELD_TYPE_NULL        : return Val_long(STRING_TY);
+    case FIELD_TYPE_TIMESTAMP   : return Val_long(TIMESTAMP_TY);
+    case FIELD_TYPE_LONGLONG    : return Val_long(INT64_TY);
+    case FIELD_TYPE_INT24       : return Val_long(INT_TY);
+    case FIELD_TYPE_DATE        : return Val_long(DATE_TY);
+    case FIELD_TYPE_TIME        : return Val_long(TIME_TY);
+    case FIELD_TYPE_DATETIME    : return Val_long(DATETIME_TY);
+    case FIELD_TYPE_YEAR        : return Val_long(YEAR_TY);
+    case FIELD_TYPE_NEWDATE     : return Val_long(UNKNOWN_TY);
+    case FIELD_TYPE_ENUM        : return Val_long(ENUM_TY);
+    case FIELD_TYPE_SET         : return Val_long(SET_TY);
+    case FIELD_TYPE_TINY_BLOB   : return Val_long(BLOB_TY);
+    case FIELD_TYPE_MEDIUM_BLOB : return Val_long(BLOB_TY);
+    case FIELD_TYPE_LONG_BLOB   : return Val_long(BLOB_TY);
+    case FIELD_TYPE_BLOB        : return Val_long(BLOB_TY);
+    case FIELD_TYPE_VAR_STRING  : return Val_long(STRING_TY);
+    case FIELD_TYPE_STRING      : return Val_long(STRING_TY);
+    default                     : return Val_long(UNKNOWN_TY);
+  }
+}
+
+value
+make_field(MYSQL_FIELD *f) {
+  CAMLparam0();
+  CAMLlocal5(out, data, name, table, def);
+
+  name = caml_copy_string(f->name);
+
+  if (f->table)
+    table = val_str_option(f->table, strlen(f->table));
+  else
+    table = Val_none;
+
+  if (f->def)
+    def = val_str_option(f->def, strlen(f->def));
+  else
+    def = Val_none;
+
+  data = caml_alloc_small(7, 0);
+  Field(data, 0) = name;
+  Field(data, 1) = table;
+  Field(data, 2) = def;
+  Field(data, 3) = type2dbty(f->type);
+  Field(data, 4) = Val_long(f->max_length);
+  Field(data, 5) = Val_long(f->flags);
+  Field(data, 6) = Val_long(f->decimals);
+
+  CAMLreturn(data);
+}
+
+EXTERNAL value
+db_fetch_field(value result) {
+  CAMLparam1(result);
+  CAMLlocal2(field, out);
+  MYSQL_FIELD *f;
+  MYSQL_RES *res = check_res(result, "fetch_field");
+  store_t *st = RESval(result)->store;
+
+  if (st && st->defs)
+    f = st->field_cursor < st->fields ? &st->defs[st->field_cursor++] : NULL;
+  else if (res)
+    f = mysql_fetch_field(res);
+  else
+    CAMLreturn(Val_none);
+  if (!f)
+    CAMLreturn(Val_none);
+
+  field = make_field(f);
+  CAMLreturn(Val_some(field));
+}
+
+EXTERNAL value
+db_fetch_field_dir(value result, value pos) {
+  CAMLparam2(result, pos);
+  CAMLlocal2(field, out);
+  MYSQL_FIELD *f;
+  MYSQL_RES *res = check_res(result, "fetch_field_dir");
+  store_t *st = RESval(result)->store;
+
+  if (st && st->defs)
+    f = (Long_val(pos) >= 0 && Long_val(pos) < st->fields) ? &st->defs[Long_val(pos)] : NULL;
+  else if (res)
+    f = mysql_fetch_field_direct(res, Long_val(pos));
+  else
+    CAMLreturn(Val_none);
+  if (!f)
+    CAMLreturn(Val_none);
+
+  field = make_field(f);
+  CAMLreturn(Val_some(field));
+}
+
+
+EXTERNAL value
+db_fetch_fields(value result) {
+  CAMLparam1(result);
+  CAMLlocal1(fields);
+  MYSQL_FIELD *f;
+  int i, n;
+
+  check_res(result, "fetch_fields");
+  n = res_num_fields(RESval(result));
+
+  if (n == 0)
+    CAMLreturn(Val_none);
+
+  f = res_fields(RESval(result));
+
+  fields = caml_alloc_tuple(n);
+
+  for (i = 0; i < n; i++) {
+    Store_field(fields, i, make_field(f+i));
+  }
+
+  CAMLreturn(Val_some(fields));
+}
+
+/*
+ * db_metadata -- returns the names, types and flags of all the columns
+ * of a result at once, without building full field records.
+ */
+
+EXTERNAL value
+db_metadata(value result) {
+  CAMLparam1(result);
+  CAMLlocal4(out, names, types, flags);
+  MYSQL_FIELD *f;
+  unsigned int i, n;
+
+  check_res(result, "metadata");
+  n = res_num_fields(RESval(result));
+  f = res_fields(RESval(result));
+
+  names = caml_alloc_tuple(n);
+  types = caml_alloc_tuple(n);
+  flags = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++) {
+    Store_field(names, i, caml_copy_string(f[i].name));
+    Store_field(types, i, type2dbty(f[i].type));
+    Store_field(flags, i, Val_long(f[i].flags));
+  }
+
+  out = caml_alloc_tuple(3);
+  Store_field(out, 0, names);
+  Store_field(out, 1, types);
+  Store_field(out, 2, flags);
+  CAMLreturn(out);
+}
+
+static void
+check_stmt(MYSQL_STMT* stmt, char *fun)
+{
+  if (!stmt)
+    mysqlfailmsg("Mysql.Prepared.%s called with closed statement", fun);
+}
+
+static void
+stmt_finalize(value handle)
+{
+  MYSQL_STMT* stmt = *(MYSQL_STMT**)Data_custom_val(handle);
+  if (!stmt) return;
+  caml_enter_blocking_section();
+  mysql_stmt_close(stmt);
+  caml_leave_blocking_section();
+  *(MYSQL_STMT**)Data_custom_val(handle) = (MYSQL_STMT*)NULL;
+}
+
+struct custom_operations stmt_ops = {
+  "Mysql Prepared Statement",
+  stmt_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+#if defined(custom_fixed_length_default)
+  custom_fixed_length_default,
+#endif
+};
+
+
+EXTERNAL value
+caml_mysql_stmt_prepare(value v_dbd, value v_sql)
+{
+  CAMLparam2(v_dbd,v_sql);
+  CAMLlocal2(res,handle);
+  int ret = 0;
+  MYSQL_STMT* stmt = NULL;
+  MYSQL* db = check_db(v_dbd, "Prepared.create");
+  char* sql_c = strdup(String_val(v_sql));
+  if (!sql_c)
+    mysqlfailwith("Mysql.Prepared.create : strdup");
+  caml_enter_blocking_section();
+  stmt = mysql_stmt_init(db);
+  if (!stmt)
+  {
+    free(sql_c);
+    caml_leave_blocking_section();
+    mysqlfailwith("Mysql.Prepared.create : mysql_stmt_init");
+  }
+  ret = mysql_stmt_prepare(stmt, sql_c, strlen(sql_c));
+  free(sql_c);
+  if (ret)
+  {
+    const char* err = mysql_stmt_error(stmt);
+    char buf[1024];
+    snprintf(buf, sizeof buf, "Mysql.Prepared.create : mysql_stmt_prepare = %i. Query : %s. Error : %s",ret,String_val(v_sql),err);
+    mysql_stmt_close(stmt);
+    caml_leave_blocking_section();
+    mysqlfailwith(buf);
+  }
+  caml_leave_blocking_section();
+  handle = caml_alloc_custom(&stmt_ops, sizeof(MYSQL_STMT*), 0, 1);
+  *(MYSQL_STMT**)Data_custom_val(handle) = stmt;
+  res = caml_alloc_small(5, 0);
+  Field(res, 0) = handle;
+  Field(res, 1) = Val_none;
+  Field(res, 2) = v_dbd;
+  Field(res, 3) = Atom(0);
+  Field(res, 4) = v_sql;
+  CAMLreturn(res);
+}
+
+EXTERNAL value
+caml_mysql_stmt_close(value v_stmt)
+{
+  CAMLparam1(v_stmt);
+  MYSQL_STMT* stmt = STMTval(v_stmt);
+  check_stmt(stmt,"close");
+  caml_enter_blocking_section();
+  mysql_stmt_close(stmt);
+  caml_leave_blocking_section();
+  STMTval(v_stmt) = (MYSQL_STMT*)NULL;
+  /*
+   * there is nothing we can do when connection is lost
+   * and anyway in this case the stmt is automatically released by the server
+   * so do not raise exception
+   *
+   * if (ret)
+   *   mysqlfailmsg("mysql_stmt_close: %s", mysql_stmt_error(stmt));
+   */
+  CAMLreturn(Val_unit);
+}
+
+typedef struct row_t_tag
+{
+  size_t count;
+  MYSQL_STMT* stmt; /* not owned */
+
+  MYSQL_BIND* bind;
+  unsigned long* length;
+  my_bool* error;
+  my_bool* is_null;
+  int current; /* a row was fetched and its columns can be read */
+} row_t;
+
+row_t* create_row(MYSQL_STMT* stmt, size_t count)
+{
+  row_t* row = malloc(sizeof(row_t));
+  if (row)
+  {
+    row->stmt = stmt;
+    row->count = count;
+    row->current = 0;
+    row->bind = calloc(count,sizeof(MYSQL_BIND));
+    row->error = calloc(count,sizeof(my_bool));
+    row->length = calloc(count,sizeof(unsigned long));
+    row->is_null = calloc(count,sizeof(my_bool));
+  }
+  return row;
+}
+
+void set_param_string(row_t *r, value v, int index)
+{
+  MYSQL_BIND* bind = &r->bind[index];
+  size_t len = caml_string_length(v);
+
+  r->length[index] = len;
+  bind->length = &r->length[index];
+  bind->buffer_length = len;
+  bind->buffer_type = MYSQL_TYPE_STRING;
+  bind->buffer = malloc(len);
+  memcpy(bind->buffer, String_val(v), len);
+}
+
+void set_param_null(row_t *r, int index)
+{
+  MYSQL_BIND* bind = &r->bind[index];
+
+  bind->buffer_type = MYSQL_TYPE_NULL;
+  bind->buffer = NULL;
+}
+
+/* parameter sent later with mysql_stmt_send_long_data */
+void set_param_long(row_t *r, int index)
+{
+  MYSQL_BIND* bind = &r->bind[index];
+
+  bind->buffer_type = MYSQL_TYPE_BLOB;
+  bind->buffer = NULL;
+  bind->buffer_length = 0;
+}
+
+void bind_result(row_t* r, int index)
+{
+  MYSQL_BIND* bind = &r->bind[index];
+
+  bind->buffer_type = MYSQL_TYPE_STRING;
+  bind->buffer = 0;
+  bind->buffer_length = 0;
+  bind->is_null = &r->is_null[index];
+  bind->length = &r->length[index];
+  bind->error = &r->error[index];
+}
+
+value get_column(row_t* r, int index, value tables)
+{
+  CAMLparam1(tables);
+  CAMLlocal1(str);
+  unsigned long length = r->length[index];
+  MYSQL_BIND* bind = &r->bind[index];
+  char buf[INTERN_MAX_LEN];
+
+  if (*bind->is_null) CAMLreturn(Val_none);
+  if (0 == length)
+  {
+    str = caml_copy_string("");
+  }
+  else if (interned(tables, index, length))
+  {
+    bind->buffer = buf;
+    bind->buffer_length = length;
+    mysql_stmt_fetch_column(r->stmt, bind, index, 0);
+    bind->buffer = 0; /* reset binding */
+    bind->buffer_length = 0;
+    str = intern_string(Field(tables, index), buf, length);
+  }
+  else
+  {
+    str = caml_alloc_string(length);
+    bind->buffer = String_val(str);
+    bind->buffer_length = length;
+    mysql_stmt_fetch_column(r->stmt, bind, index, 0);
+    bind->buffer = 0; /* reset binding */
+    bind->buffer_length = 0;
+  }
+
+  CAMLreturn(Val_some(str));
+}
+
+void destroy_row(row_t* r)
+{
+  if (r)
+  {
+    free(r->bind);
+    free(r->error);
+    free(r->length);
+    free(r->is_null);
+    free(r);
+  }
+}
+
+static void
+stmt_result_finalize(value handle)
+{
+  row_t *row = *(row_t**)Data_custom_val(handle);
+  destroy_row(row);
+}
+
+static row_t*
+check_stmt_result(value result, char *fun)
+{
+  row_t *row = ROWval(result);
+  if (!row)
+    mysqlfailmsg("Mysql.Prepared.%s called with freed result", fun);
+  check_stmt(row->stmt, fun);
+  return row;
+}
+
+struct custom_operations stmt_result_ops = {
+  "Mysql Prepared Statement Results",
+  stmt_result_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+#if defined(custom_compare_ext_default)
+  custom_compare_ext_default,
+#endif
+#if defined(custom_fixed_length_default)
+  custom_fixed_length_default,
+#endif
+};
+
+/* parameter arrays accepted by bind_params */
+enum { PARAMS_STRING, PARAMS_NULL, PARAMS_LONG };
+
+/*
+ * bind_params -- copies the parameters out of the OCaml heap and binds
+ * them to the statement. The returned row must be released with
+ * free_params once the statement is executed.
+ * With PARAMS_LONG the parameters are Prepared.param values, the
+ * Stream ones are only bound here, see send_long_params.
+ */
+
+static row_t*
+bind_params(MYSQL_STMT* stmt, value v_params, int with_null, const char *fun)
+{
+  CAMLparam1(v_params);
+  CAMLlocal1(v);
+  unsigned int i = 0;
+  unsigned int len = Wosize_val(v_params);
+  int err = 0;
+  row_t* row = NULL;
+
+  if (len != mysql_stmt_param_count(stmt))
+    mysqlfailmsg("Prepared.%s : Got %i parameters, but expected %i", fun, len, mysql_stmt_param_count(stmt));
+  row = create_row(stmt, len);
+  if (!row)
+    mysqlfailmsg("Prepared.%s : create_row for params", fun);
+  for (i = 0; i < len; i++)
+  {
+    v = Field(v_params,i);
+    if (PARAMS_LONG == with_null)
+      if (Is_long(v))
+        set_param_null(row, i);
+      else if (0 == Tag_val(v))
+        set_param_string(row, Field(v,0), i);
+      else
+        set_param_long(row, i);
+    else if (with_null)
+      if (Val_none == v)
+        set_param_null(row, i);
+      else
+        set_param_string(row, Some_val(v), i);
+    else
+      set_param_string(row, v, i);
+  }
+  err = mysql_stmt_bind_param(stmt, row->bind);
+  if (err)
+  {
+    for (i = 0; i < len; i++) free(row->bind[i].buffer);
+    destroy_row(row);
+    mysqlfailmsg("Prepared.%s : mysql_stmt_bind_param = %i",fun,err);
+  }
+  CAMLreturnT(row_t*, row);
+}
+
+static void
+free_params(row_t* row)
+{
+  size_t i;
+  for (i = 0; i < row->count; i++) free(row->bind[i].buffer);
+  destroy_row(row);
+}
+
+/*
+ * send_long_params -- feeds the Stream parameters to the server chunk
+ * by chunk, each chunk is copied to a buffer outside of the OCaml heap
+ * so that the runtime is released while it is sent. Frees [row] and
+ * resets the statement before raising.
+ */
+
+static void
+send_long_params(MYSQL_STMT* stmt, row_t* row, value v_params)
+{
+  CAMLparam1(v_params);
+  CAMLlocal3(v, f, ret);
+  unsigned int i = 0;
+  int err = 0;
+  long n = 0;
+  char *chunk = NULL;
+  size_t size = 0;
+
+  for (i = 0; i < row->count; i++)
+  {
+    v = Field(v_params,i);
+    if (Is_long(v) || 0 == Tag_val(v))
+      continue;
+    f = Field(v,0);
+    while (1)
+    {
+      ret = caml_callback_exn(f, Val_unit);
+      if (Is_exception_result(ret))
+      {
+        free(chunk);
+        free_params(row);
+        mysql_stmt_reset(stmt);
+        caml_raise(Extract_exception(ret));
+      }
+      if (Val_none == ret)
+        break;
+      v = Some_val(ret);
+      n = Long_val(Field(v,1));
+      if (n < 0 || (size_t)n > caml_string_length(Field(v,0)))
+      {
+        free(chunk);
+        free_params(row);
+        mysql_stmt_reset(stmt);
+        caml_invalid_argument("Mysql.Prepared.execute_params: chunk length");
+      }
+      if (0 == n)
+        continue;
+      if ((size_t)n > size)
+      {
+        char *p = realloc(chunk, n);
+        if (!p)
+        {
+          free(chunk);
+          free_params(row);
+          mysql_stmt_reset(stmt);
+          caml_raise_out_of_memory();
+        }
+        chunk = p;
+        size = n;
+      }
+      memcpy(chunk, Bytes_val(Field(v,0)), n);
+      caml_enter_blocking_section();
+      err = mysql_stmt_send_long_data(stmt, i, chunk, n);
+      caml_leave_blocking_section();
+      if (err)
+      {
+        free(chunk);
+        free_params(row);
+        mysql_stmt_reset(stmt);
+        mysqlfailmsg("Prepared.execute_params : mysql_stmt_send_long_data = %i, %s",err,mysql_stmt_error(stmt));
+      }
+    }
+  }
+  free(chunk);
+  CAMLreturn0;
+}
+
+/*
+ * caml_mysql_stmt_execute_gen -- executes the statement, with a
+ * deadline of [timeout] seconds on the execution if [timeout] > 0 (see
+ * db_exec_timeout), fetching of the rows is not covered.
+ */
+
+value
+caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null, double timeout)
+{
+  CAMLparam2(v_stmt,v_params);
+  CAMLlocal2(res, handle);
+  unsigned int i = 0;
+  unsigned int len = 0;
+  int err = 0;
+  int fired = 0;
+  row_t* row = NULL;
+  MYSQL_STMT* stmt = STMTval(v_stmt);
+#ifndef _WIN32
+  watchdog_t w;
+  MYSQL* mysql = NULL;
+#endif
+  check_stmt(stmt,"execute");
+#ifdef _WIN32
+  if (timeout > 0)
+    mysqlfailwith("Prepared.execute : timeout is not supported on this platform");
+#else
+  if (timeout > 0)
+    mysql = check_db(STMT_dbd(v_stmt), "Prepared.execute");
+#endif
+  row = bind_params(stmt, v_params, with_null, "execute");
+  if (PARAMS_LONG == with_null)
+    send_long_params(stmt, row, v_params);
+
+#ifndef _WIN32
+  if (timeout > 0 && watchdog_start(&w, mysql, timeout))
+  {
+    free_params(row);
+    mysqlfailwith("Prepared.execute : cannot start watchdog thread");
+  }
+#endif
+  caml_enter_blocking_section();
+  err = mysql_stmt_execute(stmt);
+#ifndef _WIN32
+  if (timeout > 0)
+    fired = watchdog_stop(&w);
+#endif
+  caml_leave_blocking_section();
+
+  free_params(row);
+
+  if (err && fired)
+    mysqlfailmsg("Prepared.execute : query timed out after %g s: %s",timeout,mysql_stmt_error(stmt));
+  if (err)
+  {
+    mysqlfailmsg("Prepared.execute : mysql_stmt_execute = %i, %s",err,mysql_stmt_error(stmt));
+  }
+
+  len = mysql_stmt_field_count(stmt);
+  row = create_row(stmt, len);
+  if (!row)
+    mysqlfailwith("Prepared.execute : create_row for results");
+  if (len)
+  {
+    for (i = 0; i < len; i++)
+    {
+      bind_result(row,i);
+    }
+    if (mysql_stmt_bind_result(stmt, row->bind))
+    {
+      destroy_row(row);
+      mysqlfailwith("Prepared.execute : mysql_stmt_bind_result");
+    }
+  }
+  handle = caml_alloc_custom(&stmt_result_ops, sizeof(row_t*), 0, 1);
+  *(row_t**)Data_custom_val(handle) = row;
+  res = caml_alloc_small(2, 0);
+  Field(res, 0) = handle;
+  Field(res, 1) = STMT_intern(v_stmt);
+  CAMLreturn(res);
+}
+
+EXTERNAL value caml_mysql_stmt_execute(value v_stmt, value v_param)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, PARAMS_STRING, 0.);
+}
+
+EXTERNAL value caml_mysql_stmt_execute_null(value v_stmt, value v_param)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, PARAMS_NULL, 0.);
+}
+
+EXTERNAL value caml_mysql_stmt_execute_timeout(value v_stmt, value v_param, value v_timeout)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, PARAMS_STRING, Double_val(v_timeout));
+}
+
+EXTERNAL value caml_mysql_stmt_execute_null_timeout(value v_stmt, value v_param, value v_timeout)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, PARAMS_NULL, Double_val(v_timeout));
+}
+
+EXTERNAL value caml_mysql_stmt_execute_params(value v_stmt, value v_param)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, PARAMS_LONG, 0.);
+}
+
+EXTERNAL value caml_mysql_stmt_execute_params_timeout(value v_stmt, value v_param, value v_timeout)
+{
+  return caml_mysql_stmt_execute_gen(v_stmt, v_param, PARAMS_LONG, Double_val(v_timeout));
+}
+
+/*
+ * caml_mysql_stmt_query_one_gen -- executes the statement and returns
+ * its first row, if any. Execution, fetching of the row and discarding
+ * of the remaining rows are done in a single blocking section with the
+ * column data fetched into one C buffer, no result handle is created.
+ */
+
+value
+caml_mysql_stmt_query_one_gen(value v_stmt, value v_params, int with_null)
+{
+  CAMLparam2(v_stmt,v_params);
+  CAMLlocal2(arr,s);
+  unsigned int i = 0;
+  int err = 0;
+  int found = 0;
+  const char* fail = NULL;
+  size_t total = 0;
+  char* data = NULL;
+  row_t* params = NULL;
+  row_t* row = NULL;
+  MYSQL_STMT* stmt = STMTval(v_stmt);
+  check_stmt(stmt,"query_one");
+  params = bind_params(stmt, v_params, with_null, "query_one");
+  row = create_row(stmt, mysql_stmt_field_count(stmt));
+  if (!row)
+  {
+    free_params(params);
+    mysqlfailwith("Prepared.query_one : create_row for results");
+  }
+
+  caml_enter_blocking_section();
+  err = mysql_stmt_execute(stmt);
+  if (err)
+    fail = "mysql_stmt_execute";
+  else if (row->count)
+  {
+    for (i = 0; i < row->count; i++)
+      bind_result(row,i);
+    if (mysql_stmt_bind_result(stmt, row->bind))
+      fail = "mysql_stmt_bind_result";
+    else
+    {
+      err = mysql_stmt_fetch(stmt);
+      found = (0 == err || MYSQL_DATA_TRUNCATED == err);
+      if (1 == err)
+        fail = "mysql_stmt_fetch";
+      else if (found)
+      {
+        for (i = 0; i < row->count; i++)
+          if (!row->is_null[i]) total += row->length[i];
+        data = malloc(total ? total : 1);
+        if (!data)
+          fail = "malloc";
+        else
+        {
+          total = 0;
+          for (i = 0; i < row->count; i++)
+          {
+            MYSQL_BIND* bind = &row->bind[i];
+            if (row->is_null[i] || 0 == row->length[i]) continue;
+            bind->buffer = data + total;
+            bind->buffer_length = row->length[i];
+            mysql_stmt_fetch_column(stmt, bind, i, 0);
+            total += row->length[i];
+          }
+        }
+      }
+    }
+  }
+  mysql_stmt_free_result(stmt);
+  caml_leave_blocking_section();
+
+  free_params(params);
+
+  if (fail)
+  {
+    free(data);
+    destroy_row(row);
+    mysqlfailmsg("Prepared.query_one : %s = %i, %s",fail,err,mysql_stmt_error(stmt));
+  }
+
+  if (!found)
+  {
+    destroy_row(row);
+    CAMLreturn(Val_none);
+  }
+
+  arr = caml_alloc(row->count,0);
+  total = 0;
+  for (i = 0; i < row->count; i++)
+  {
+    if (row->is_null[i])
+      s = Val_none;
+    else
+    {
+      s = val_str_option_intern(STMT_intern(v_stmt), i, data + total, row->length[i]);
+      total += row->length[i];
+    }
+    Store_field(arr,i,s);
+  }
+  free(data);
+  destroy_row(row);
+  CAMLreturn(Val_some(arr));
+}
+
+EXTERNAL value caml_mysql_stmt_query_one(value v_stmt, value v_param)
+{
+  return caml_mysql_stmt_query_one_gen(v_stmt, v_param, 0);
+}
+
+EXTERNAL value caml_mysql_stmt_query_one_null(value v_stmt, value v_param)
+{
+  return caml_mysql_stmt_query_one_gen(v_stmt, v_param, 1);
+}
+
+EXTERNAL value
+caml_mysql_stmt_fetch(value result)
+{
+  CAMLparam1(result);
+  CAMLlocal1(arr);
+  unsigned int i = 0;
+  int res = 0;
+  row_t* r = check_stmt_result(result,"fetch");
+  caml_enter_blocking_section();
+  res = mysql_stmt_fetch(r->stmt);
+  caml_leave_blocking_section();
+  r->current = (0 == res || MYSQL_DATA_TRUNCATED == res);
+  if (!r->current) CAMLreturn(Val_none);
+  arr = caml_alloc(r->count,0);
+  for (i = 0; i < r->count; i++)
+  {
+    Store_field(arr,i,get_column(r,i,ROW_intern(result)));
+  }
+  CAMLreturn(Val_some(arr));
+}
+
+/*
+ * caml_mysql_stmt_next -- fetches the next row without copying its
+ * columns, they are read afterwards with caml_mysql_stmt_column or
+ * caml_mysql_stmt_stream_column.
+ */
+
+EXTERNAL value
+caml_mysql_stmt_next(value result)
+{
+  CAMLparam1(result);
+  int res = 0;
+  row_t* r = check_stmt_result(result,"next");
+  caml_enter_blocking_section();
+  res = mysql_stmt_fetch(r->stmt);
+  caml_leave_blocking_section();
+  r->current = (0 == res || MYSQL_DATA_TRUNCATED == res);
+  CAMLreturn(Val_bool(r->current));
+}
+
+static row_t*
+check_column(value result, value v_index, char *fun)
+{
+  row_t* r = check_stmt_result(result,fun);
+  long index = Long_val(v_index);
+
+  if (!r->current)
+    mysqlfailmsg("Mysql.Prepared.%s: no current row", fun);
+  if (index < 0 || (size_t)index >= r->count)
+    caml_invalid_argument("index out of bounds");
+  return r;
+}
+
+EXTERNAL value
+caml_mysql_stmt_column(value result, value v_index)
+{
+  CAMLparam2(result, v_index);
+  row_t* r = check_column(result, v_index, "column");
+  CAMLreturn(get_column(r, Long_val(v_index), ROW_intern(result)));
+}
+
+/*
+ * caml_mysql_stmt_stream_column -- passes the column of the current row
+ * to [f] in chunks of at most [chunk] bytes, all the chunks using the
+ * same buffer.  Returns false for NULL.
+ */
+
+EXTERNAL value
+caml_mysql_stmt_stream_column(value result, value v_index, value v_chunk, value f)
+{
+  CAMLparam4(result, v_index, v_chunk, f);
+  CAMLlocal2(buf, ret);
+  row_t* r = check_column(result, v_index, "stream_column");
+  int index = Long_val(v_index);
+  MYSQL_BIND* bind = &r->bind[index];
+  unsigned long length = r->length[index];
+  unsigned long off, n, chunk = Long_val(v_chunk);
+
+  if (Long_val(v_chunk) <= 0)
+    caml_invalid_argument("Mysql.Prepared.stream_column: chunk size");
+  if (*bind->is_null)
+    CAMLreturn(Val_false);
+
+  buf = caml_alloc_string(length < chunk ? length : chunk);
+  for (off = 0; off < length; off += n)
+  {
+    n = length - off < chunk ? length - off : chunk;
+    bind->buffer = Bytes_val(buf);
+    bind->buffer_length = n;
+    mysql_stmt_fetch_column(r->stmt, bind, index, off);
+    bind->buffer = 0; /* reset binding */
+    bind->buffer_length = 0;
+    ret = caml_callback2_exn(f, buf, Val_long(n));
+    if (Is_exception_result(ret))
+      caml_raise(Extract_exception(ret));
+  }
 
-  CAMLreturn(data);
+  CAMLreturn(Val_true);
 }
 
+/*
+ * caml_mysql_stmt_free_result -- release the result bindings and any
+ * rows still pending on the statement. Must be called before the
+ * statement is closed.
+ */
+
 EXTERNAL value
-db_fetch_field(value result) {
+caml_mysql_stmt_free_result(value result)
+{
   CAMLparam1(result);
-  CAMLlocal2(field, out);
-  MYSQL_FIELD *f;
-  MYSQL_RES *res = RESval(result);
+  row_t* r = check_stmt_result(result,"free_result");
+  MYSQL_STMT* stmt = r->stmt;
 
-  if (!res)
-    CAMLreturn(Val_none);
+  ROWval(result) = NULL;
+  destroy_row(r);
 
-  f = mysql_fetch_field(res);
-  if (!f)
-    CAMLreturn(Val_none);
+  caml_enter_blocking_section();
+  mysql_stmt_free_result(stmt);
+  caml_leave_blocking_section();
 
-  field = make_field(f);
-  CAMLreturn(Val_some(field));
+  CAMLreturn(Val_unit);
 }
 
-EXTERNAL value
-db_fetch_field_dir(value result, value pos) {
-  CAMLparam2(result, pos);
-  CAMLlocal2(field, out);
-  MYSQL_FIELD *f;
-  MYSQL_RES *res = RESval(result);
+/*
+ * caml_mysql_stmt_store_result -- fetches the remaining rows of a
+ * prepared statement result into an ordinary result, the rows being
+ * kept in memory in the row file layout of spilled results.  The
+ * statement result is released.
+ */
 
-  if (!res)
-    CAMLreturn(Val_none);
+typedef struct growbuf_tag
+{
+  char *buf;
+  size_t len;
+  size_t cap;
+} growbuf_t;
 
-  f = mysql_fetch_field_direct(res, Long_val(pos));
-  if (!f)
-    CAMLreturn(Val_none);
+static int
+growbuf_append(growbuf_t *g, const void *src, size_t len)
+{
+  size_t cap = g->cap ? g->cap : 4096;
+  char *p;
 
-  field = make_field(f);
-  CAMLreturn(Val_some(field));
+  if (g->len + len > g->cap)
+  {
+    while (cap < g->len + len)
+      cap *= 2;
+    if (!(p = realloc(g->buf, cap)))
+      return -1;
+    g->buf = p;
+    g->cap = cap;
+  }
+  if (src)
+    memcpy(g->buf + g->len, src, len);
+  g->len += len;
+  return 0;
 }
 
-
 EXTERNAL value
-db_fetch_fields(value result) {
+caml_mysql_stmt_store_result(value result)
+{
   CAMLparam1(result);
-  CAMLlocal1(fields);
-  MYSQL_RES *res = RESval(result);
-  MYSQL_FIELD *f;
-  int i, n;
+  row_t *r = check_stmt_result(result, "store_result");
+  MYSQL_STMT *stmt = r->stmt;
+  growbuf_t data = { NULL, 0, 0 }, index = { NULL, 0, 0 };
+  static const char pad[8];
+  MYSQL_BIND *bind;
+  MYSQL_RES *meta;
+  store_t *s;
+  uint64_t off, rows = 0;
+  size_t aligned = 0;
+  unsigned int i, fields = r->count;
+  uint32_t l;
+  int ret = 0, err = 0;
+  char msg[512];
+
+  meta = mysql_stmt_result_metadata(stmt);
+  if (!meta)
+    mysqlfailwith("Mysql.Prepared.store_result: no result set");
+  s = calloc(1, sizeof(store_t));
+  if (!s)
+  {
+    mysql_free_result(meta);
+    mysqlfailwith("Mysql.Prepared.store_result: out of memory");
+  }
+  ROWval(result) = NULL;
 
-  if (!res)
-    CAMLreturn(Val_none);
+  caml_enter_blocking_section();
+  while (!err && ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED))
+  {
+    off = data.len;
+    err = growbuf_append(&index, &off, sizeof off);
+    for (i = 0; i < r->count && !err; i++)
+    {
+      bind = &r->bind[i];
+      l = *bind->is_null ? STORE_NULL : (uint32_t)r->length[i];
+      err = growbuf_append(&data, &l, sizeof l);
+      if (err || *bind->is_null || !r->length[i])
+        continue;
+      err = growbuf_append(&data, NULL, r->length[i]);
+      if (err)
+        continue;
+      bind->buffer = data.buf + data.len - r->length[i];
+      bind->buffer_length = r->length[i];
+      if (mysql_stmt_fetch_column(stmt, bind, i, 0))
+        err = -2;
+      bind->buffer = 0; /* reset binding */
+      bind->buffer_length = 0;
+    }
+    rows++;
+  }
+  if (!err && ret != MYSQL_NO_DATA)
+    err = -2;
+  if (err == -2)
+    snprintf(msg, sizeof msg, "%s", mysql_stmt_error(stmt));
+  if (!err)
+  {
+    aligned = (data.len + 7) / 8 * 8;
+    err = growbuf_append(&data, pad, aligned - data.len);
+    if (!err)
+      err = growbuf_append(&data, index.buf, index.len);
+  }
+  mysql_stmt_free_result(stmt);
+  caml_leave_blocking_section();
 
-  n = mysql_num_fields(res);
+  destroy_row(r);
+  free(index.buf);
+  if (err)
+  {
+    free(data.buf);
+    free(s);
+    mysql_free_result(meta);
+    if (err == -2)
+      mysqlfailmsg("Mysql.Prepared.store_result: %s", msg);
+    mysqlfailwith("Mysql.Prepared.store_result: out of memory");
+  }
 
-  if (n == 0)
-    CAMLreturn(Val_none);
+  s->mem = data.buf;
+  s->size = data.len;
+  s->data = data.buf;
+  s->index = (const uint64_t*)(data.buf + aligned);
+  s->rows = rows;
+  s->fields = fields;
+  result = alloc_res(meta, s);
+  if (!store_alloc_row(s))
+    mysqlfailwith("Mysql.Prepared.store_result: out of memory");
+
+  CAMLreturn(result);
+}
 
-  f = mysql_fetch_fields(res);
+/*
+ * caml_mysql_stmt_export -- same as db_export for the remaining rows of
+ * a statement result, each column is fetched into a scratch buffer.
+ */
 
-  fields = caml_alloc_tuple(n);
+EXTERNAL value
+caml_mysql_stmt_export(value result, value v_format, value v_header, value v_fd)
+{
+  CAMLparam4(result, v_format, v_header, v_fd);
+  row_t *r = check_stmt_result(result, "export");
+  MYSQL_STMT *stmt = r->stmt;
+  MYSQL_RES *meta;
+  MYSQL_FIELD *fields;
+  MYSQL_BIND *bind;
+  growbuf_t cell = { NULL, 0, 0 };
+  uint64_t rows = 0;
+  unsigned int i;
+  int ret = 0, err = 0;
+  char msg[512] = "";
+  export_t *o;
+
+  /* export_create may raise, nothing to release yet */
+  o = export_create(v_fd, v_format);
+  meta = mysql_stmt_result_metadata(stmt);
+  if (!meta)
+  {
+    free(o->buf);
+    free(o);
+    mysqlfailwith("Mysql.Prepared.export: no result set");
+  }
+  fields = mysql_fetch_fields(meta);
 
-  for (i = 0; i < n; i++) {
-    Store_field(fields, i, make_field(f+i));
+  caml_enter_blocking_section();
+  if (Bool_val(v_header))
+    export_header(o, fields, r->count);
+  while (!err && !o->err && ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED))
+  {
+    for (i = 0; i < r->count && !err; i++)
+    {
+      bind = &r->bind[i];
+      if (*bind->is_null)
+      {
+        export_value(o, fields, i, NULL, 0);
+        continue;
+      }
+      cell.len = 0;
+      if (r->length[i] && (err = growbuf_append(&cell, NULL, r->length[i])))
+        break;
+      bind->buffer = cell.buf;
+      bind->buffer_length = r->length[i];
+      if (r->length[i] && mysql_stmt_fetch_column(stmt, bind, i, 0))
+        err = -2;
+      bind->buffer = 0; /* reset binding */
+      bind->buffer_length = 0;
+      export_value(o, fields, i, cell.buf ? cell.buf : "", r->length[i]);
+    }
+    export_end_row(o);
+    rows++;
   }
+  if (!err && !o->err && ret != MYSQL_NO_DATA)
+    err = -2;
+  if (err == -2)
+    snprintf(msg, sizeof msg, "%s", mysql_stmt_error(stmt));
+  caml_leave_blocking_section();
 
-  CAMLreturn(Val_some(fields));
+  r->current = 0;
+  free(cell.buf);
+  mysql_free_result(meta);
+  if (err)
+  {
+    free(o->buf);
+    free(o);
+    if (err == -2)
+      mysqlfailmsg("Mysql.Prepared.export: %s", msg);
+    mysqlfailwith("Mysql.Prepared.export: out of memory");
+  }
+  export_finish(o, "Prepared.export");
+  CAMLreturn(caml_copy_int64(rows));
 }
 
-static void
-check_stmt(MYSQL_STMT* stmt, char *fun)
+EXTERNAL value
+caml_mysql_stmt_affected(value stmt) 
 {
-  if (!stmt)
-    mysqlfailmsg("Mysql.Prepared.%s called with closed statement", fun);
+  CAMLparam1(stmt);
+  check_stmt(STMTval(stmt),"affected");
+  CAMLreturn(caml_copy_int64(mysql_stmt_affected_rows(STMTval(stmt))));
 }
 
-static void
-stmt_finalize(value v_stmt)
+EXTERNAL value
+caml_mysql_stmt_insert_id(value stmt) 
 {
-  MYSQL_STMT* stmt = STMTval(v_stmt);
-  if (!stmt) return;
-  caml_enter_blocking_section();
-  mysql_stmt_close(stmt);
-  caml_leave_blocking_section();
-  STMTval(v_stmt) = (MYSQL_STMT*)NULL;
+  CAMLparam1(stmt);
+  check_stmt(STMTval(stmt),"insert_id");
+  CAMLreturn(caml_copy_int64(mysql_stmt_insert_id(STMTval(stmt))));
 }
 
-struct custom_operations stmt_ops = {
-  "Mysql Prepared Statement",
-  stmt_finalize,
-  custom_compare_default,
-  custom_hash_default,
-  custom_serialize_default,
-  custom_deserialize_default,
-#if defined(custom_compare_ext_default)
-  custom_compare_ext_default,
-#endif
-#if defined(custom_fixed_length_default)
-  custom_fixed_length_default,
-#endif
-};
-
-
 EXTERNAL value
-caml_mysql_stmt_prepare(value v_dbd, value v_sql)
+caml_mysql_stmt_status(value stmt)
 {
-  CAMLparam2(v_dbd,v_sql);
-  CAMLlocal1(res);
-  int ret = 0;
-  MYSQL_STMT* stmt = NULL;
-  MYSQL* db = check_db(v_dbd, "Prepared.create");
-  char* sql_c = strdup(String_val(v_sql));
-  if (!sql_c)
-    mysqlfailwith("Mysql.Prepared.create : strdup");
-  caml_enter_blocking_section();
-  stmt = mysql_stmt_init(db);
-  if (!stmt)
-  {
-    free(sql_c);
-    caml_leave_blocking_section();
-    mysqlfailwith("Mysql.Prepared.create : mysql_stmt_init");
-  }
-  ret = mysql_stmt_prepare(stmt, sql_c, strlen(sql_c));
-  free(sql_c);
-  if (ret)
-  {
-    const char* err = mysql_stmt_error(stmt);
-    char buf[1024];
-    snprintf(buf, sizeof buf, "Mysql.Prepared.create : mysql_stmt_prepare = %i. Query : %s. Error : %s",ret,String_val(v_sql),err);
-    mysql_stmt_close(stmt);
-    caml_leave_blocking_section();
-    mysqlfailwith(buf);
-  }
-  caml_leave_blocking_section();
-  res = caml_alloc_custom(&stmt_ops, sizeof(MYSQL_STMT*), 0, 1);
-  STMTval(res) = stmt;
-  CAMLreturn(res);
+  CAMLparam1(stmt);
+  check_stmt(STMTval(stmt), "status");
+  CAMLreturn(Val_int(mysql_stmt_errno(STMTval(stmt))));
 }
 
 EXTERNAL value
-caml_mysql_stmt_close(value v_stmt)
+caml_mysql_stmt_result_metadata(value stmt)
 {
-  CAMLparam1(v_stmt);
-  MYSQL_STMT* stmt = STMTval(v_stmt);
-  check_stmt(stmt,"close");
-  caml_enter_blocking_section();
-  mysql_stmt_close(stmt);
-  caml_leave_blocking_section();
-  STMTval(v_stmt) = (MYSQL_STMT*)NULL;
-  /*
-   * there is nothing we can do when connection is lost
-   * and anyway in this case the stmt is automatically released by the server
-   * so do not raise exception
-   *
-   * if (ret)
-   *   mysqlfailmsg("mysql_stmt_close: %s", mysql_stmt_error(stmt));
-   */
-  CAMLreturn(Val_unit);
+    CAMLparam1(stmt);
+    CAMLlocal1(res);
+
+    check_stmt(STMTval(stmt), "result_metadata");
+    res = alloc_res(mysql_stmt_result_metadata(STMTval(stmt)), NULL);
+
+    CAMLreturn(res);
 }
 
-typedef struct row_t_tag
+
+/*
+ * Bulk writer
+ *
+ * Rows are encoded as SQL tuples by the callers and appended to
+ * batches, each batch being the text of one multi-row INSERT no longer
+ * than the server max_allowed_packet.  A writer thread with its own
+ * connection sends the batches when they are full, when the oldest row
+ * has been waiting for [interval] seconds or when a flush is requested.
+ * Callers block while more than [max_queue] bytes are pending.
+ * Failed batches are reported to the caller by the next add, flush or
+ * close.
+ */
+
+#ifndef _WIN32
+
+typedef struct batch_tag
 {
-  size_t count;
-  MYSQL_STMT* stmt; /* not owned */
+  struct batch_tag *next;
+  char *buf;
+  size_t len, cap;
+  size_t bytes;                 /* size of the rows */
+  unsigned long rows;
+  struct timespec deadline;     /* when the batch must be sent */
+} batch_t;
 
-  MYSQL_BIND* bind;
-  unsigned long* length;
-  my_bool* error;
-  my_bool* is_null;
-} row_t;
+typedef struct bulk_error_tag
+{
+  struct bulk_error_tag *next;
+  char *msg;
+} bulk_error_t;
 
-row_t* create_row(MYSQL_STMT* stmt, size_t count)
+typedef struct bulk_tag
 {
-  row_t* row = malloc(sizeof(row_t));
-  if (row)
+  MYSQL *mysql;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;        /* signalled to the writer */
+  pthread_cond_t progress;      /* signalled by the writer */
+
+  char *prefix;                 /* INSERT INTO t (c1, ..) VALUES */
+  size_t prefix_len;
+  char *suffix;                 /* ON DUPLICATE KEY UPDATE ... */
+  size_t suffix_len;
+  unsigned int columns;
+  int no_backslash;             /* NO_BACKSLASH_ESCAPES at connection */
+  size_t max_stmt;              /* max length of a statement */
+  unsigned long max_rows;       /* max rows in a statement */
+  double interval;
+  size_t max_queue;
+
+  batch_t *head, *tail;         /* batches ready to be sent */
+  batch_t *cur;                 /* batch being filled */
+  size_t queued;                /* bytes of rows not written yet */
+  unsigned long long added;     /* rows added */
+  unsigned long long done;      /* rows written or failed */
+  unsigned long long flush_upto;
+  int closing;
+  int orphaned;                 /* handle collected, writer cleans up */
+  bulk_error_t *err_head, *err_tail;
+
+  /* statistics */
+  unsigned long long flushes, rows, failed;
+  unsigned long last_rows;
+  double last_latency, total_latency;
+} bulk_t;
+
+#define BULKval(x) (*(bulk_t**)Data_custom_val(x))
+
+static double
+monotonic_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+deadline_after(struct timespec *ts, double seconds)
+{
+  struct timeval now;
+  long long nsec;
+
+  gettimeofday(&now, NULL);
+  nsec = (long long)now.tv_usec * 1000 + (long long)(seconds * 1e9);
+  ts->tv_sec = now.tv_sec + nsec / 1000000000;
+  ts->tv_nsec = nsec % 1000000000;
+}
+
+static int
+deadline_passed(const struct timespec *ts)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec > ts->tv_sec ||
+    (now.tv_sec == ts->tv_sec && (long)now.tv_usec * 1000 >= ts->tv_nsec);
+}
+
+static void
+batch_free(batch_t *batch)
+{
+  if (batch)
   {
-    row->stmt = stmt;
-    row->count = count;
-    row->bind = calloc(count,sizeof(MYSQL_BIND));
-    row->error = calloc(count,sizeof(my_bool));
-    row->length = calloc(count,sizeof(unsigned long));
-    row->is_null = calloc(count,sizeof(my_bool));
+    free(batch->buf);
+    free(batch);
   }
-  return row;
 }
 
-void set_param_string(row_t *r, value v, int index)
+/* bulk_seal moves the current batch to the queue of ready batches */
+static int
+bulk_seal(bulk_t *b)
 {
-  MYSQL_BIND* bind = &r->bind[index];
-  size_t len = caml_string_length(v);
+  batch_t *batch = b->cur;
+  char *buf;
 
-  r->length[index] = len;
-  bind->length = &r->length[index];
-  bind->buffer_length = len;
-  bind->buffer_type = MYSQL_TYPE_STRING;
-  bind->buffer = malloc(len);
-  memcpy(bind->buffer, String_val(v), len);
+  if (batch->len + b->suffix_len > batch->cap)
+  {
+    buf = realloc(batch->buf, batch->len + b->suffix_len);
+    if (!buf)
+      return -1;
+    batch->buf = buf;
+    batch->cap = batch->len + b->suffix_len;
+  }
+  memcpy(batch->buf + batch->len, b->suffix, b->suffix_len);
+  batch->len += b->suffix_len;
+
+  if (b->tail)
+    b->tail->next = batch;
+  else
+    b->head = batch;
+  b->tail = batch;
+  b->cur = NULL;
+  return 0;
 }
 
-void set_param_null(row_t *r, int index)
+/* bulk_append adds an encoded row, called with the lock held */
+static int
+bulk_append(bulk_t *b, const char *row, size_t len)
 {
-  MYSQL_BIND* bind = &r->bind[index];
+  batch_t *batch = b->cur;
+  char *buf;
 
-  bind->buffer_type = MYSQL_TYPE_NULL;
-  bind->buffer = NULL;
+  if (batch && (batch->rows >= b->max_rows ||
+                batch->len + 1 + len + b->suffix_len > b->max_stmt))
+  {
+    if (bulk_seal(b))
+      return -1;
+    batch = NULL;
+  }
+  if (!batch)
+  {
+    batch = calloc(1, sizeof(batch_t));
+    if (!batch)
+      return -1;
+    batch->cap = b->prefix_len + len + 4096;
+    batch->buf = malloc(batch->cap);
+    if (!batch->buf)
+    {
+      free(batch);
+      return -1;
+    }
+    memcpy(batch->buf, b->prefix, b->prefix_len);
+    batch->len = b->prefix_len;
+    deadline_after(&batch->deadline, b->interval);
+    b->cur = batch;
+  }
+  if (batch->len + 1 + len > batch->cap)
+  {
+    size_t cap = 2 * batch->cap + len;
+    if (cap > b->max_stmt + 1)
+      cap = b->max_stmt + 1;
+    buf = realloc(batch->buf, cap);
+    if (!buf)
+      return -1;
+    batch->buf = buf;
+    batch->cap = cap;
+  }
+  if (batch->rows)
+    batch->buf[batch->len++] = ',';
+  memcpy(batch->buf + batch->len, row, len);
+  batch->len += len;
+  batch->bytes += len;
+  batch->rows++;
+  b->queued += len;
+  b->added++;
+  return 0;
+}
+
+static void
+bulk_destroy(bulk_t *b)
+{
+  batch_t *batch;
+  bulk_error_t *err;
+
+  while ((batch = b->head))
+  {
+    b->head = batch->next;
+    batch_free(batch);
+  }
+  batch_free(b->cur);
+  while ((err = b->err_head))
+  {
+    b->err_head = err->next;
+    free(err->msg);
+    free(err);
+  }
+  mysql_close(b->mysql);
+  pthread_cond_destroy(&b->wakeup);
+  pthread_cond_destroy(&b->progress);
+  pthread_mutex_destroy(&b->lock);
+  free(b->prefix);
+  free(b->suffix);
+  free(b);
 }
 
-void bind_result(row_t* r, int index)
+/* bulk_send executes one batch, called without the lock */
+static char*
+bulk_send(bulk_t *b, batch_t *batch, double *latency)
 {
-  MYSQL_BIND* bind = &r->bind[index];
+  char buf[1024];
+  double start = monotonic_now();
+  MYSQL_RES *res;
+  int ret;
 
-  bind->buffer_type = MYSQL_TYPE_STRING;
-  bind->buffer = 0;
-  bind->buffer_length = 0;
-  bind->is_null = &r->is_null[index];
-  bind->length = &r->length[index];
-  bind->error = &r->error[index];
+  ret = mysql_real_query(b->mysql, batch->buf, batch->len);
+  if (!ret && (res = mysql_store_result(b->mysql)))
+    mysql_free_result(res);
+  *latency = monotonic_now() - start;
+
+  if (!ret)
+    return NULL;
+  snprintf(buf, sizeof buf, "Mysql.Bulk_writer: batch of %lu rows failed: %s",
+           batch->rows, mysql_error(b->mysql));
+  return strdup(buf);
 }
 
-value get_column(row_t* r, int index)
+/* bulk_push_error queues [msg] to be raised by the next call, called
+ * with the lock held */
+static void
+bulk_push_error(bulk_t *b, char *msg)
 {
-  CAMLparam0();
-  CAMLlocal1(str);
-  unsigned long length = r->length[index];
-  MYSQL_BIND* bind = &r->bind[index];
+  bulk_error_t *err = msg ? malloc(sizeof(bulk_error_t)) : NULL;
 
-  if (*bind->is_null) CAMLreturn(Val_none);
-  if (0 == length)
+  if (!err)
   {
-    str = caml_copy_string("");
+    free(msg); /* the rows still count in the failed statistics */
+    return;
   }
+  err->next = NULL;
+  err->msg = msg;
+  if (b->err_tail)
+    b->err_tail->next = err;
   else
-  {
-    str = caml_alloc_string(length);
-    bind->buffer = String_val(str);
-    bind->buffer_length = length;
-    mysql_stmt_fetch_column(r->stmt, bind, index, 0);
-    bind->buffer = 0; /* reset binding */
-    bind->buffer_length = 0;
-  }
+    b->err_head = err;
+  b->err_tail = err;
+}
 
-  CAMLreturn(Val_some(str));
+/* bulk_drop_cur discards the current batch when it cannot be sealed for
+ * lack of memory, its rows count as failed.  Called with the lock held. */
+static void
+bulk_drop_cur(bulk_t *b)
+{
+  batch_t *batch = b->cur;
+  char buf[256];
+
+  snprintf(buf, sizeof buf, "Mysql.Bulk_writer: batch of %lu rows dropped: out of memory",
+           batch->rows);
+  b->cur = NULL;
+  b->queued -= batch->bytes;
+  b->done += batch->rows;
+  b->failed += batch->rows;
+  batch_free(batch);
+  bulk_push_error(b, strdup(buf));
+  pthread_cond_broadcast(&b->progress);
 }
 
-void destroy_row(row_t* r)
+static void*
+bulk_run(void *arg)
 {
-  if (r)
+  bulk_t *b = (bulk_t*)arg;
+  batch_t *batch;
+  double latency;
+  char *msg;
+  int orphaned;
+
+  mysql_thread_init();
+  pthread_mutex_lock(&b->lock);
+  for (;;)
   {
-    free(r->bind);
-    free(r->error);
-    free(r->length);
-    free(r->is_null);
-    free(r);
+    while (!b->head)
+    {
+      if (b->cur && (b->closing || b->flush_upto > b->done || deadline_passed(&b->cur->deadline)))
+      {
+        if (0 == bulk_seal(b))
+          break;
+        /* the deadline has passed, waiting on it would spin */
+        bulk_drop_cur(b);
+        continue;
+      }
+      if (b->closing && !b->cur)
+        break;
+      if (b->cur)
+        pthread_cond_timedwait(&b->wakeup, &b->lock, &b->cur->deadline);
+      else
+        pthread_cond_wait(&b->wakeup, &b->lock);
+    }
+    if (!b->head)
+      break;
+
+    batch = b->head;
+    b->head = batch->next;
+    if (!b->head)
+      b->tail = NULL;
+    pthread_mutex_unlock(&b->lock);
+
+    msg = bulk_send(b, batch, &latency);
+
+    pthread_mutex_lock(&b->lock);
+    b->flushes++;
+    b->last_rows = batch->rows;
+    b->last_latency = latency;
+    b->total_latency += latency;
+    b->queued -= batch->bytes;
+    b->done += batch->rows;
+    if (msg)
+    {
+      b->failed += batch->rows;
+      bulk_push_error(b, msg);
+    }
+    else
+      b->rows += batch->rows;
+    pthread_cond_broadcast(&b->progress);
+    batch_free(batch);
   }
+  orphaned = b->orphaned;
+  pthread_mutex_unlock(&b->lock);
+
+  if (orphaned)
+    bulk_destroy(b);
+  mysql_thread_end();
+  return NULL;
 }
 
 static void
-stmt_result_finalize(value result)
+bulk_finalize(value v)
 {
-  row_t *row = ROWval(result);
-  destroy_row(row);
+  bulk_t *b = BULKval(v);
+  if (!b)
+    return;
+  pthread_mutex_lock(&b->lock);
+  b->closing = 1;
+  b->orphaned = 1;
+  pthread_cond_signal(&b->wakeup);
+  pthread_mutex_unlock(&b->lock);
+  pthread_detach(b->thread);
+  BULKval(v) = NULL;
 }
 
-struct custom_operations stmt_result_ops = {
-  "Mysql Prepared Statement Results",
-  stmt_result_finalize,
+#else
+
+typedef struct bulk_tag bulk_t;
+#define BULKval(x) (*(bulk_t**)Data_custom_val(x))
+
+static void
+bulk_finalize(value v)
+{
+}
+
+#endif /* _WIN32 */
+
+struct custom_operations bulk_ops = {
+  "Mysql Bulk Writer",
+  bulk_finalize,
   custom_compare_default,
   custom_hash_default,
   custom_serialize_default,
@@ -1084,137 +4877,414 @@ struct custom_operations stmt_result_ops = {
 #endif
 };
 
-value
-caml_mysql_stmt_execute_gen(value v_stmt, value v_params, int with_null)
+#ifndef _WIN32
+
+static bulk_t*
+check_bulk(value v, const char *fun)
 {
-  CAMLparam2(v_stmt,v_params);
-  CAMLlocal2(res,v);
-  unsigned int i = 0;
-  unsigned int len = Wosize_val(v_params);
-  int err = 0;
-  row_t* row = NULL;
-  MYSQL_STMT* stmt = STMTval(v_stmt);
-  check_stmt(stmt,"execute");
-  if (len != mysql_stmt_param_count(stmt))
-    mysqlfailmsg("Prepared.execute : Got %i parameters, but expected %i", len, mysql_stmt_param_count(stmt));
-  row = create_row(stmt, len);
-  if (!row)
-    mysqlfailwith("Prepared.execute : create_row for params");
-  for (i = 0; i < len; i++)
+  bulk_t *b = BULKval(v);
+  if (!b)
+    mysqlfailmsg("Mysql.Bulk_writer.%s called with closed writer", fun);
+  return b;
+}
+
+/* bulk_take_error removes the first pending batch error, if any.
+ * Called with the lock held. */
+static bulk_error_t*
+bulk_take_error(bulk_t *b)
+{
+  bulk_error_t *err = b->err_head;
+
+  if (err)
   {
-    v = Field(v_params,i);
-    if (with_null)
-      if (Val_none == v)
-        set_param_null(row, i);
-      else
-        set_param_string(row, Some_val(v), i);
-    else
-      set_param_string(row, v, i);
+    b->err_head = err->next;
+    if (!b->err_head)
+      b->err_tail = NULL;
   }
-  err = mysql_stmt_bind_param(stmt, row->bind);
-  if (err)
+  return err;
+}
+
+static void
+bulk_raise_error(bulk_error_t *err)
+{
+  char buf[1024];
+
+  if (!err)
+    return;
+  snprintf(buf, sizeof buf, "%s", err->msg);
+  free(err->msg);
+  free(err);
+  mysqlfailwith(buf);
+}
+
+static unsigned long long
+server_max_allowed_packet(MYSQL *mysql)
+{
+  unsigned long long packet = 0;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  if (mysql_query(mysql, "SELECT @@max_allowed_packet"))
+    return 0;
+  res = mysql_store_result(mysql);
+  if (!res)
+    return 0;
+  row = mysql_fetch_row(res);
+  if (row && row[0])
+    packet = strtoull(row[0], NULL, 10);
+  mysql_free_result(res);
+  return packet;
+}
+
+#endif /* _WIN32 */
+
+/*
+ * caml_mysql_bulk_create -- connects the writer and starts its thread.
+ * config is { max_rows; max_bytes; interval; max_queue; columns }
+ */
+
+EXTERNAL value
+caml_mysql_bulk_create(value v_options, value v_db, value v_prefix, value v_suffix, value v_config)
+{
+  CAMLparam5(v_options, v_db, v_prefix, v_suffix, v_config);
+  CAMLlocal1(res);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.Bulk_writer.create: not supported on this platform");
+#else
+  unsigned long client_flag = 0;
+  unsigned long long packet;
+  long max_bytes = Long_val(Field(v_config, 1));
+  MY_CHARSET_INFO cs;
+  bulk_t *b;
+  MYSQL *init = mysql_init(NULL);
+
+  if (!init)
+    mysqlfailwith("Mysql.Bulk_writer.create: connect failed");
+  set_options(init, v_options, &client_flag);
+  if (!real_connect(init, v_db, client_flag))
   {
-    for (i = 0; i < len; i++) free(row->bind[i].buffer);
-    destroy_row(row);
-    mysqlfailmsg("Prepared.execute : mysql_stmt_bind_param = %i",err);
+    char buf[1024];
+    snprintf(buf, sizeof buf, "Mysql.Bulk_writer.create: %s", mysql_error(init));
+    mysql_close(init);
+    mysqlfailwith(buf);
+  }
+
+  /* rows are escaped by add without the connection, which the writer uses */
+  mysql_get_character_set_info(init, &cs);
+  if (cs.mbmaxlen > 1 && escape_unsafe_charset(cs.csname))
+  {
+    char buf[256];
+    snprintf(buf, sizeof buf, "Mysql.Bulk_writer.create: character set %s is not supported", cs.csname);
+    mysql_close(init);
+    mysqlfailwith(buf);
   }
+
   caml_enter_blocking_section();
-  err = mysql_stmt_execute(stmt);
+  packet = server_max_allowed_packet(init);
   caml_leave_blocking_section();
+  if (packet == 0)
+    packet = 1024 * 1024;
+  /* room for the packet header and the command byte */
+  packet = packet > 1024 ? packet - 1024 : packet;
 
-  for (i = 0; i < len; i++) free(row->bind[i].buffer);
-  destroy_row(row);
-
-  if (err)
+  b = calloc(1, sizeof(bulk_t));
+  if (!b)
   {
-    mysqlfailmsg("Prepared.execute : mysql_stmt_execute = %i, %s",err,mysql_stmt_error(stmt));
+    mysql_close(init);
+    mysqlfailwith("Mysql.Bulk_writer.create: out of memory");
+  }
+  b->mysql = init;
+  b->prefix_len = caml_string_length(v_prefix);
+  b->prefix = malloc(b->prefix_len);
+  b->suffix_len = caml_string_length(v_suffix);
+  b->suffix = malloc(b->suffix_len + 1);
+  if (!b->prefix || !b->suffix)
+  {
+    mysql_close(init);
+    free(b->prefix); free(b->suffix); free(b);
+    mysqlfailwith("Mysql.Bulk_writer.create: out of memory");
+  }
+  memcpy(b->prefix, String_val(v_prefix), b->prefix_len);
+  memcpy(b->suffix, String_val(v_suffix), b->suffix_len);
+  b->max_rows = Long_val(Field(v_config, 0));
+  b->max_stmt = (max_bytes > 0 && (unsigned long long)max_bytes < packet) ? (size_t)max_bytes : (size_t)packet;
+  b->interval = Double_val(Field(v_config, 2));
+  b->max_queue = Long_val(Field(v_config, 3));
+  b->columns = Long_val(Field(v_config, 4));
+  b->no_backslash = (init->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES) != 0;
+  if (b->max_rows == 0)
+    b->max_rows = 1;
+
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->wakeup, NULL);
+  pthread_cond_init(&b->progress, NULL);
+  if (0 != pthread_create(&b->thread, NULL, bulk_run, b))
+  {
+    bulk_destroy(b);
+    mysqlfailwith("Mysql.Bulk_writer.create: cannot start writer thread");
   }
 
-  len = mysql_stmt_field_count(stmt);
-  row = create_row(stmt, len);
+  res = caml_alloc_custom(&bulk_ops, sizeof(bulk_t*), 0, 1);
+  BULKval(res) = b;
+#endif
+  CAMLreturn(res);
+}
+
+/*
+ * caml_mysql_bulk_add -- encodes a row as (v1,..,vn) and queues it,
+ * waiting for the writer while the queue is full.
+ */
+
+EXTERNAL value
+caml_mysql_bulk_add(value v_bulk, value v_row)
+{
+  CAMLparam2(v_bulk, v_row);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.Bulk_writer.add: not supported on this platform");
+#else
+  bulk_t *b = check_bulk(v_bulk, "add");
+  unsigned int i, n = Wosize_val(v_row);
+  size_t cap = 2, len = 0;
+  char *row;
+  value v;
+  int ret = 0;
+  bulk_error_t *err;
+  escape_scan_t e;
+  size_t n_v;
+
+  if (n != b->columns)
+    mysqlfailmsg("Mysql.Bulk_writer.add: got %u values, but expected %u", n, b->columns);
+
+  for (i = 0; i < n; i++)
+  {
+    v = Field(v_row, i);
+    cap += 1 + (v == Val_none ? 4 : 2 * caml_string_length(Some_val(v)) + 2);
+  }
+  row = malloc(cap + 1);
   if (!row)
-    mysqlfailwith("Prepared.execute : create_row for results");
-  if (len)
+    mysqlfailwith("Mysql.Bulk_writer.add: out of memory");
+
+  row[len++] = '(';
+  for (i = 0; i < n; i++)
   {
-    for (i = 0; i < len; i++)
+    v = Field(v_row, i);
+    if (i)
+      row[len++] = ',';
+    if (v == Val_none)
     {
-      bind_result(row,i);
+      memcpy(row + len, "NULL", 4);
+      len += 4;
     }
-    if (mysql_stmt_bind_result(stmt, row->bind))
+    else
     {
-      destroy_row(row);
-      mysqlfailwith("Prepared.execute : mysql_stmt_bind_result");
+      n_v = caml_string_length(Some_val(v));
+      escape_scan((const unsigned char*)String_val(Some_val(v)), n_v, &e);
+      row[len++] = '\'';
+      escape_into(row + len, (const unsigned char*)String_val(Some_val(v)), n_v, b->no_backslash);
+      len += n_v + (b->no_backslash ? e.quotes : e.specials);
+      row[len++] = '\'';
     }
   }
-  res = caml_alloc_custom(&stmt_result_ops, sizeof(row_t*), 0, 1);
-  ROWval(res) = row;
-  CAMLreturn(res);
-}
+  row[len++] = ')';
 
-EXTERNAL value caml_mysql_stmt_execute(value v_stmt, value v_param)
-{
-  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 0);
+  if (len + b->prefix_len + b->suffix_len > b->max_stmt)
+  {
+    free(row);
+    mysqlfailwith("Mysql.Bulk_writer.add: row exceeds max_allowed_packet");
+  }
+
+  caml_enter_blocking_section();
+  pthread_mutex_lock(&b->lock);
+  while (b->queued + len > b->max_queue && b->queued > 0)
+  {
+    /* the rows of the current batch count in the queue: hand them over
+       to the writer rather than waiting for the interval */
+    if (b->cur && 0 != (ret = bulk_seal(b)))
+      break;
+    pthread_cond_signal(&b->wakeup);
+    pthread_cond_wait(&b->progress, &b->lock);
+  }
+  if (0 == ret)
+    ret = bulk_append(b, row, len);
+  pthread_cond_signal(&b->wakeup);
+  err = bulk_take_error(b);
+  pthread_mutex_unlock(&b->lock);
+  caml_leave_blocking_section();
+  free(row);
+
+  bulk_raise_error(err);
+  if (ret)
+    mysqlfailwith("Mysql.Bulk_writer.add: out of memory");
+#endif
+  CAMLreturn(Val_unit);
 }
 
-EXTERNAL value caml_mysql_stmt_execute_null(value v_stmt, value v_param)
+/*
+ * caml_mysql_bulk_flush -- waits until all the rows added so far are
+ * written.
+ */
+
+EXTERNAL value
+caml_mysql_bulk_flush(value v_bulk)
 {
-  return caml_mysql_stmt_execute_gen(v_stmt, v_param, 1);
+  CAMLparam1(v_bulk);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.Bulk_writer.flush: not supported on this platform");
+#else
+  bulk_t *b = check_bulk(v_bulk, "flush");
+  bulk_error_t *err;
+
+  caml_enter_blocking_section();
+  pthread_mutex_lock(&b->lock);
+  if (b->flush_upto < b->added)
+    b->flush_upto = b->added;
+  pthread_cond_signal(&b->wakeup);
+  while (b->done < b->flush_upto)
+    pthread_cond_wait(&b->progress, &b->lock);
+  err = bulk_take_error(b);
+  pthread_mutex_unlock(&b->lock);
+  caml_leave_blocking_section();
+
+  bulk_raise_error(err);
+#endif
+  CAMLreturn(Val_unit);
 }
 
+/*
+ * caml_mysql_bulk_close -- writes the pending rows, stops the writer
+ * thread and closes its connection.
+ */
+
 EXTERNAL value
-caml_mysql_stmt_fetch(value result)
+caml_mysql_bulk_close(value v_bulk)
 {
-  CAMLparam1(result);
-  CAMLlocal1(arr);
-  unsigned int i = 0;
-  int res = 0;
-  row_t* r = ROWval(result);
-  check_stmt(r->stmt,"fetch");
+  CAMLparam1(v_bulk);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.Bulk_writer.close: not supported on this platform");
+#else
+  char buf[1024];
+  bulk_t *b = check_bulk(v_bulk, "close");
+  int failed = 0;
+
+  BULKval(v_bulk) = NULL;
   caml_enter_blocking_section();
-  res = mysql_stmt_fetch(r->stmt);
+  pthread_mutex_lock(&b->lock);
+  b->closing = 1;
+  pthread_cond_signal(&b->wakeup);
+  pthread_mutex_unlock(&b->lock);
+  pthread_join(b->thread, NULL);
   caml_leave_blocking_section();
-  if (0 != res && MYSQL_DATA_TRUNCATED != res) CAMLreturn(Val_none);
-  arr = caml_alloc(r->count,0);
-  for (i = 0; i < r->count; i++)
+
+  if (b->err_head)
   {
-    Store_field(arr,i,get_column(r,i));
+    failed = 1;
+    snprintf(buf, sizeof buf, "%s", b->err_head->msg);
   }
-  CAMLreturn(Val_some(arr));
+  bulk_destroy(b);
+  if (failed)
+    mysqlfailwith(buf);
+#endif
+  CAMLreturn(Val_unit);
 }
 
 EXTERNAL value
-caml_mysql_stmt_affected(value stmt) 
+caml_mysql_bulk_stats(value v_bulk)
 {
-  CAMLparam1(stmt);
-  check_stmt(STMTval(stmt),"affected");
-  CAMLreturn(caml_copy_int64(mysql_stmt_affected_rows(STMTval(stmt))));
+  CAMLparam1(v_bulk);
+  CAMLlocal1(res);
+#ifdef _WIN32
+  mysqlfailwith("Mysql.Bulk_writer.stats: not supported on this platform");
+#else
+  bulk_t *b = check_bulk(v_bulk, "stats");
+  unsigned long long flushes, rows, failed, queued;
+  unsigned long last_rows;
+  double last_latency, total_latency;
+
+  pthread_mutex_lock(&b->lock);
+  flushes = b->flushes;
+  rows = b->rows;
+  failed = b->failed;
+  queued = b->queued;
+  last_rows = b->last_rows;
+  last_latency = b->last_latency;
+  total_latency = b->total_latency;
+  pthread_mutex_unlock(&b->lock);
+
+  res = caml_alloc_tuple(7);
+  Store_field(res, 0, Val_long(flushes));
+  Store_field(res, 1, Val_long(rows));
+  Store_field(res, 2, Val_long(failed));
+  Store_field(res, 3, Val_long(last_rows));
+  Store_field(res, 4, caml_copy_double(last_latency));
+  Store_field(res, 5, caml_copy_double(total_latency));
+  Store_field(res, 6, Val_long(queued));
+#endif
+  CAMLreturn(res);
 }
 
+/*
+ * db_monotonic_now -- seconds from an arbitrary origin, not affected by
+ * changes of the system time.
+ */
+
 EXTERNAL value
-caml_mysql_stmt_insert_id(value stmt) 
+db_monotonic_now(value v_unit)
 {
-  CAMLparam1(stmt);
-  check_stmt(STMTval(stmt),"insert_id");
-  CAMLreturn(caml_copy_int64(mysql_stmt_insert_id(STMTval(stmt))));
+#ifdef _WIN32
+  return caml_copy_double(GetTickCount64() / 1e3);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return caml_copy_double(ts.tv_sec + ts.tv_nsec / 1e9);
+#endif
 }
 
+/*
+ * db_sleep -- waits [seconds] without holding the runtime.
+ */
+
 EXTERNAL value
-caml_mysql_stmt_status(value stmt)
+db_sleep(value v_seconds)
 {
-  CAMLparam1(stmt);
-  check_stmt(STMTval(stmt), "status");
-  CAMLreturn(Val_int(mysql_stmt_errno(STMTval(stmt))));
+  CAMLparam1(v_seconds);
+  double seconds = Double_val(v_seconds);
+#ifndef _WIN32
+  struct timespec ts;
+#endif
+
+  if (seconds <= 0)
+    CAMLreturn(Val_unit);
+  caml_enter_blocking_section();
+#ifdef _WIN32
+  Sleep((DWORD)(seconds * 1e3));
+#else
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) && EINTR == errno)
+    ;
+#endif
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
 }
 
+/*
+ * db_thread_init, db_thread_end -- per thread state of the client library,
+ * for the threads and domains created from OCaml which use connections.
+ */
+
 EXTERNAL value
-caml_mysql_stmt_result_metadata(value stmt)
+db_thread_init(value unit)
 {
-    CAMLparam1(stmt);
-    CAMLlocal1(res);
-
-    check_stmt(STMTval(stmt), "result_metadata");
-    res = caml_alloc_custom(&res_ops, sizeof(MYSQL_RES*), 0, 1);
-    RESval(res) = mysql_stmt_result_metadata(STMTval(stmt));
+  (void)unit;
+  if (mysql_thread_init())
+    mysqlfailwith("Mysql: mysql_thread_init failed");
+  return Val_unit;
+}
 
-    CAMLreturn(res);
+EXTERNAL value
+db_thread_end(value unit)
+{
+  (void)unit;
+  mysql_thread_end();
+  return Val_unit;
 }